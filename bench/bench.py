@@ -0,0 +1,260 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-or-later
+# SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is>
+# SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com>
+"""
+Performance regression suite. Runs the benchmarks below, writes the results
+as JSON and compares them against a stored baseline, failing when a metric
+regresses by more than the threshold.
+
+  parser  BPF parser ns/packet per corpus frame class (tests/test_bpf, root)
+  event   per-event preparation ns/event (bench/bench_event)
+  mock    userspace pipeline events/s and per-stage ns against the netlink
+          mock (neighsnoopd --mock --replay)
+  netns   end to end install latency and burst throughput in a network
+          namespace (tests/testbed/testbed.sh, root and VLAN-aware bridges)
+
+Suites whose requirements are not met are skipped and reported as such.
+Metrics without a baseline are reported but never fail, and a baseline
+metric may carry its own "threshold" in percent when it is noisy. Baselines
+are machine specific, so regenerate them with --update on the machine that
+runs the comparison.
+
+Usage: bench.py [--suites LIST] [--output FILE] [--baseline FILE]
+                [--threshold PCT] [--repeat N] [--update]
+"""
+
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+TOP_DIR = os.path.dirname(BENCH_DIR)
+NEIGHSNOOPD = os.environ.get("NEIGHSNOOPD",
+                             os.path.join(TOP_DIR, "neighsnoopd"))
+INJECT = os.path.join(TOP_DIR, "tests", "testbed", "inject.py")
+
+SUITES = ["parser", "event", "mock", "netns"]
+
+# The mock and netns host layouts, see tests/testbed/inject.py
+MOCK_HOSTS = {"svis": 32, "hosts": 250, "ext": 4, "macvlans": 2}
+NETNS_HOSTS = {"s": 4, "H": 64, "e": 4, "m": 2}
+
+
+class Skipped(Exception):
+    pass
+
+
+def run(cmd, **kwargs):
+    proc = subprocess.run(cmd, stdout=subprocess.PIPE,
+                          stderr=subprocess.STDOUT, text=True, **kwargs)
+    if proc.returncode != 0:
+        sys.stderr.write(proc.stdout)
+        raise RuntimeError("%s exited with %d" % (" ".join(cmd),
+                                                  proc.returncode))
+    return proc.stdout
+
+
+def require(path):
+    if not os.access(path, os.X_OK):
+        raise Skipped("%s is not built" % os.path.relpath(path, TOP_DIR))
+
+
+def require_root():
+    if os.geteuid() != 0:
+        raise Skipped("needs root")
+
+
+def metric(value, unit, better):
+    return {"value": round(value, 3), "unit": unit, "better": better}
+
+
+def best(samples, better):
+    """The least noisy sample of a metric is the best one."""
+    return min(samples) if better == "lower" else max(samples)
+
+
+def collect(runs, parse):
+    """Runs a benchmark args.repeat times and keeps the best of each metric."""
+    samples = {}
+    for output in runs:
+        for name, (value, unit, better) in parse(output).items():
+            samples.setdefault(name, ([], unit, better))[0].append(value)
+    return {name: metric(best(values, better), unit, better)
+            for name, (values, unit, better) in samples.items()}
+
+
+def suite_parser(args):
+    test_bpf = os.path.join(TOP_DIR, "tests", "test_bpf")
+    require(test_bpf)
+    require_root()
+
+    def parse(output):
+        results = {}
+        for m in re.finditer(r"^(xdp|tc)\s+(\S+)\s+(\d+) ns/pkt", output,
+                             re.M):
+            results["parser.%s.%s" % (m[1], m[2])] = (int(m[3]), "ns",
+                                                      "lower")
+        return results
+
+    corpus = os.path.join(TOP_DIR, "tests", "corpus")
+    return collect((run([test_bpf, "-d", corpus])
+                    for _ in range(args.repeat)), parse)
+
+
+def suite_event(args):
+    bench_event = os.path.join(BENCH_DIR, "bench_event")
+    require(bench_event)
+
+    # The eager variant reproduces a former hot path for comparison only
+    def parse(output):
+        m = re.search(r"^deferred:\s+([\d.]+) ns/event", output, re.M)
+        if not m:
+            raise RuntimeError("No deferred result in the bench_event output")
+        return {"event.deferred": (float(m[1]), "ns", "lower")}
+
+    return collect((run([bench_event, "2000000"])
+                    for _ in range(args.repeat)), parse)
+
+
+def suite_mock(args):
+    require(NEIGHSNOOPD)
+    hosts = ["--svis", str(MOCK_HOSTS["svis"]),
+             "--hosts", str(MOCK_HOSTS["hosts"]),
+             "--ext-every", str(MOCK_HOSTS["ext"]),
+             "--macvlans", str(MOCK_HOSTS["macvlans"])]
+    mock = ",".join("%s=%d" % item for item in MOCK_HOSTS.items())
+
+    def parse(output):
+        results = {}
+        m = re.search(r"Throughput: ([\d.]+) frames/s, ([\d.]+) events/s",
+                      output)
+        if not m:
+            raise RuntimeError("No throughput in the replay output")
+        results["mock.frames_per_sec"] = (float(m[1]), "frames/s", "higher")
+        results["mock.events_per_sec"] = (float(m[2]), "events/s", "higher")
+        for m in re.finditer(r"Stage (\w+)\s+\d+ samples\s+([\d.]+) ns avg",
+                             output):
+            results["mock.stage.%s" % m[1]] = (float(m[2]), "ns", "lower")
+        return results
+
+    with tempfile.NamedTemporaryFile(suffix=".pcap") as pcap:
+        run([sys.executable, INJECT, "pcap", "--output", pcap.name] + hosts)
+        return collect((run([NEIGHSNOOPD, "--replay", pcap.name,
+                             "--mock", mock, "br0"])
+                        for _ in range(args.repeat)), parse)
+
+
+def suite_netns(args):
+    require(NEIGHSNOOPD)
+    require_root()
+    # Probe for VLAN-aware bridges in a throwaway network namespace
+    if subprocess.run(["unshare", "--net", "ip", "link", "add", "br0",
+                       "type", "bridge", "vlan_filtering", "1"],
+                      stdout=subprocess.DEVNULL,
+                      stderr=subprocess.DEVNULL).returncode != 0:
+        raise Skipped("needs VLAN-aware bridge support in the kernel")
+
+    def parse(output):
+        results = {}
+        m = re.search(r"p50 ([\d.]+) us, p99 ([\d.]+) us", output)
+        if m:
+            results["netns.latency_p50"] = (float(m[1]), "us", "lower")
+            results["netns.latency_p99"] = (float(m[2]), "us", "lower")
+        m = re.search(r"\(([\d.]+) installs/s\)", output)
+        if m:
+            results["netns.installs_per_sec"] = (float(m[1]), "installs/s",
+                                                 "higher")
+        return results
+
+    testbed = [os.path.join(TOP_DIR, "tests", "testbed", "testbed.sh")]
+    for opt, value in NETNS_HOSTS.items():
+        testbed += ["-" + opt, str(value)]
+    return collect((run(testbed) for _ in range(args.repeat)), parse)
+
+
+def compare(results, baseline, threshold):
+    """Prints every metric against its baseline and returns the regressions."""
+    regressions = []
+    print("%-32s %14s %14s %8s" % ("metric", "baseline", "result", "change"))
+    for name, result in sorted(results.items()):
+        base = baseline.get(name)
+        if not base or not base["value"]:
+            print("%-32s %14s %14.1f %8s  %s" % (name, "-", result["value"],
+                                                 "-", result["unit"]))
+            continue
+
+        change = (result["value"] - base["value"]) / base["value"] * 100
+        limit = base.get("threshold", threshold)
+        worse = change if result["better"] == "lower" else -change
+        regressed = worse > limit
+        if regressed:
+            regressions.append(name)
+        print("%-32s %14.1f %14.1f %+7.1f%%  %s%s" % (
+            name, base["value"], result["value"], change, result["unit"],
+            "  REGRESSION (limit %g%%)" % limit if regressed else ""))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--suites", default=",".join(SUITES))
+    parser.add_argument("--output",
+                        default=os.path.join(BENCH_DIR, "results.json"))
+    parser.add_argument("--baseline",
+                        default=os.path.join(BENCH_DIR, "baseline.json"))
+    parser.add_argument("--threshold", type=float, default=10.0,
+                        help="allowed regression in percent")
+    parser.add_argument("--repeat", type=int, default=5)
+    parser.add_argument("--update", action="store_true",
+                        help="store the results as the new baseline")
+    args = parser.parse_args()
+
+    metrics = {}
+    skipped = {}
+    for suite in args.suites.split(","):
+        if suite not in SUITES:
+            parser.error("unknown suite %s" % suite)
+        try:
+            metrics.update(globals()["suite_" + suite](args))
+        except Skipped as e:
+            skipped[suite] = str(e)
+            print("Skipping %s: %s" % (suite, e))
+
+    with open(args.output, "w") as f:
+        json.dump({"metrics": metrics, "skipped": skipped}, f, indent=2,
+                  sort_keys=True)
+        f.write("\n")
+
+    try:
+        with open(args.baseline) as f:
+            baseline = json.load(f)["metrics"]
+    except FileNotFoundError:
+        baseline = {}
+
+    if args.update:
+        # Hand tuned thresholds of noisy metrics outlive the values
+        for name, result in metrics.items():
+            if "threshold" in baseline.get(name, {}):
+                result["threshold"] = baseline[name]["threshold"]
+        with open(args.baseline, "w") as f:
+            json.dump({"metrics": metrics}, f, indent=2, sort_keys=True)
+            f.write("\n")
+        print("Stored %d metrics in %s" % (len(metrics), args.baseline))
+        return 0
+
+    regressions = compare(metrics, baseline, args.threshold)
+    if regressions:
+        print("FAIL: %d metrics regressed beyond the threshold" %
+              len(regressions))
+        return 1
+    print("PASS: no regressions beyond the threshold")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,136 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is> */
+/* SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com> */
+/* SPDX-FileContributor: Freysteinn Alfredsson <freysteinn@freysteinn.com> */
+/* SPDX-FileContributor: Julius Thor Bess Rikardsson <juliusbess@gmail.com> */
+
+/*
+ * Microbenchmark for the per-event preparation in handle_neighbor_reply().
+ *
+ * "eager" reproduces the former hot path: a zeroed lookup cache with string
+ * buffers, and the MAC and IP rendered for every event. "deferred" is the
+ * current path, where the cache is compact and strings are only rendered by
+ * log calls that pass the level check.
+ *
+ * Usage: bench_event [EVENTS]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "neighsnoopd.h"
+#include "neighsnoopd_shared.h"
+
+struct env env = {0};
+
+// The lookup cache as it was before rendering was deferred
+struct eager_cache {
+    struct neighbor_reply *neighbor_reply;
+    __u8 mac_str[MAC_ADDR_STR_LEN];
+    __u32 ifindex;
+    char ifname[IFNAMSIZ];
+    __u32 link_ifindex;
+    char kind[128];
+    char ip_str[INET6_ADDRSTRLEN];
+    __u32 cidr;
+    bool is_ext_learned;
+    bool is_macvlan;
+    struct {
+        char network_str[INET6_ADDRSTRLEN];
+    } debug;
+};
+
+struct deferred_cache {
+    struct neighbor_reply *neighbor_reply;
+    struct link_info *link;
+    __u32 cidr;
+    bool is_ext_learned;
+};
+
+#define N_REPLIES 256
+
+static struct neighbor_reply replies[N_REPLIES];
+static volatile __u32 sink;
+
+static __u64 now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static __attribute__((noinline)) void event_eager(struct neighbor_reply *reply)
+{
+    struct eager_cache cache = {0};
+    cache.neighbor_reply = reply;
+
+    mac_to_string(cache.mac_str, reply->mac, sizeof(cache.mac_str));
+    if (format_ip_address(cache.ip_str, sizeof(cache.ip_str), &reply->ip))
+        return;
+
+    pr_debug("Received Neighbor Reply MAC: %s - IP: %s\n", cache.mac_str,
+             cache.ip_str);
+    sink += cache.mac_str[0] + cache.ip_str[0];
+}
+
+static __attribute__((noinline)) void event_deferred(
+    struct neighbor_reply *reply)
+{
+    struct deferred_cache cache = {
+        .neighbor_reply = reply,
+    };
+
+    pr_debug("Received Neighbor Reply MAC: %s - IP: %s\n",
+             fmt_mac(cache.neighbor_reply->mac),
+             fmt_ip(&cache.neighbor_reply->ip));
+    sink += cache.neighbor_reply->mac[0];
+}
+
+static double run(void (*event)(struct neighbor_reply *), long events)
+{
+    __u64 start = now_ns();
+
+    for (long i = 0; i < events; i++)
+        event(&replies[i % N_REPLIES]);
+
+    return (double)(now_ns() - start) / events;
+}
+
+int main(int argc, char **argv)
+{
+    long events = argc > 1 ? strtol(argv[1], NULL, 0) : 10000000;
+
+    if (events <= 0) {
+        fprintf(stderr, "Invalid number of events\n");
+        return EXIT_FAILURE;
+    }
+
+    // Half IPv4 ARP replies and half IPv6 NAs
+    for (int i = 0; i < N_REPLIES; i++) {
+        struct neighbor_reply *reply = &replies[i];
+        __u8 mac[6] = { 0x02, 0x00, 0x5e, 0x10, i >> 8, i };
+
+        memcpy(reply->mac, mac, sizeof(mac));
+        if (i % 2) {
+            inet_pton(AF_INET6, "2001:db8::1", &reply->ip);
+            reply->ip.s6_addr[15] = i;
+            reply->in_family = AF_INET6;
+        } else {
+            map_ipv4_to_ipv6(&reply->ip, htonl(0xc0000200 | i));
+            reply->in_family = AF_INET;
+        }
+    }
+
+    // Warm up caches and branch predictors
+    run(event_eager, events / 10);
+    run(event_deferred, events / 10);
+
+    printf("eager:    %.1f ns/event\n", run(event_eager, events));
+    printf("deferred: %.1f ns/event\n", run(event_deferred, events));
+
+    return EXIT_SUCCESS;
+}
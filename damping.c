@@ -0,0 +1,310 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is> */
+/* SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com> */
+/* SPDX-FileContributor: Freysteinn Alfredsson <freysteinn@freysteinn.com> */
+/* SPDX-FileContributor: Julius Thor Bess Rikardsson <juliusbess@gmail.com> */
+
+/*
+ * Damping of neighbors whose MAC address flaps, like BGP route flap damping
+ * (RFC 2439). When two hosts fight over an address, every reply would move
+ * the binding and become a kernel write and a notification to every
+ * listener. Each move of a neighbor's binding adds DAMPING_PENALTY to its
+ * penalty, which decays exponentially with the configured half-life. A
+ * neighbor whose penalty exceeds the suppress threshold has its moves held
+ * back until the penalty has decayed below the reuse threshold, and the
+ * newest binding is then installed. The penalty is capped so that no
+ * neighbor is suppressed for longer than the maximum suppress time.
+ *
+ * A reply is held back when it would move the binding away from the MAC
+ * address last installed, which is the one refreshes re-assert. Suppressed
+ * neighbors are kept in a list by key and checked every
+ * DAMPING_TICK_MS.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "neighsnoopd.h"
+#include "neighsnoopd_shared.h"
+
+extern struct env env;
+
+#define DAMPING_PENALTY 1000
+#define DAMPING_TICK_MS 1000
+
+struct damping_key {
+    struct in6_addr ip;
+    __u16 vlan_id;
+};
+
+struct damping_stats {
+    __u64 flaps;      // Moves of a binding
+    __u64 suppressed; // Neighbors that crossed the suppress threshold
+    __u64 held;       // Replies held back while suppressed
+    __u64 released;   // Neighbors that decayed below the reuse threshold
+};
+
+// 2^(-i/16) in 16.16 fixed point, for the fractions of a half-life
+static const __u32 decay_table[16] = {
+    65536, 62757, 60097, 57549, 55109, 52773, 50535, 48393,
+    46341, 44376, 42495, 40693, 38968, 37316, 35734, 34219,
+};
+
+static struct damping_key *suppressed;
+static __u32 suppressed_len;
+static __u32 suppressed_cap;
+static workq_handler_t release_handler;
+static __u64 next_tick_ms;
+static struct damping_stats stats;
+
+/*
+ * Parses off or half-life=S,max-suppress=S,suppress=N,reuse=N of --damping
+ * into config, which holds the defaults. Returns 0 or -1 when invalid.
+ */
+int damping_parse_config(struct damping_config *config, const char *arg)
+{
+    char *const keys[] = { "half-life", "max-suppress", "suppress", "reuse",
+                           NULL };
+    __u32 *fields[] = { &config->half_life_s, &config->max_suppress_s,
+                        &config->suppress, &config->reuse };
+    char *opts, *subopts, *value, *end;
+    int err = 0;
+
+    if (!strcmp(arg, "off")) {
+        config->disabled = true;
+        return 0;
+    }
+
+    opts = subopts = strdup(arg);
+    if (!opts)
+        return -1;
+
+    while (*subopts) {
+        int key = getsubopt(&subopts, keys, &value);
+
+        if (key < 0 || !value) {
+            err = -1;
+            break;
+        }
+        *fields[key] = strtoul(value, &end, 0);
+        if (*end) {
+            err = -1;
+            break;
+        }
+    }
+    free(opts);
+
+    if (!config->half_life_s || config->half_life_s > 3600 ||
+        config->max_suppress_s < config->half_life_s ||
+        config->max_suppress_s > 86400 || !config->reuse ||
+        config->suppress <= config->reuse)
+        err = -1;
+    return err;
+}
+
+// Decays a penalty over the milliseconds since it was last decayed
+static __u32 damping_decay(__u32 penalty, __u64 elapsed_ms)
+{
+    __u64 half_life_ms = env.damping.half_life_s * 1000ULL;
+    __u64 halvings = elapsed_ms / half_life_ms;
+    __u64 frac = (elapsed_ms % half_life_ms) * 16 / half_life_ms;
+
+    if (halvings >= 32)
+        return 0;
+    return ((__u64)(penalty >> halvings) * decay_table[frac]) >> 16;
+}
+
+// The highest penalty that decays to the reuse threshold in time
+static __u32 damping_ceiling(void)
+{
+    __u32 halvings = env.damping.max_suppress_s / env.damping.half_life_s;
+    __u64 ceiling;
+
+    if (halvings >= 32)
+        return UINT32_MAX;
+    ceiling = (__u64)env.damping.reuse << halvings;
+    return ceiling > UINT32_MAX ? UINT32_MAX : ceiling;
+}
+
+void damping_init(workq_handler_t handler)
+{
+    release_handler = handler;
+}
+
+static void damping_suppress(struct neigh_entry *neigh)
+{
+    if (suppressed_len == suppressed_cap) {
+        __u32 cap = suppressed_cap ? suppressed_cap * 2 : 64;
+        struct damping_key *grown;
+
+        grown = realloc(suppressed, cap * sizeof(*grown));
+        if (!grown) {
+            pr_err(errno, "Failed to suppress %s", fmt_ip(&neigh->ip));
+            return;
+        }
+        suppressed = grown;
+        suppressed_cap = cap;
+    }
+
+    suppressed[suppressed_len].ip = neigh->ip;
+    suppressed[suppressed_len].vlan_id = neigh->vlan_id;
+    suppressed_len++;
+    neigh->suppressed = true;
+    stats.suppressed++;
+
+    pr_info("Neighbor %s flaps, holding back its updates\n",
+            fmt_ip(&neigh->ip));
+    if (!next_tick_ms)
+        next_tick_ms = now_ms() + DAMPING_TICK_MS;
+}
+
+/*
+ * Checks a reply that is about to be installed. A reply with another MAC
+ * address than the one before it is a flap. Returns true when the reply
+ * would move the binding of a suppressed neighbor and has to be held back.
+ */
+bool damping_hold(const struct neighbor_reply *reply)
+{
+    struct neigh_entry *neigh;
+    __u64 now;
+
+    neigh = neigh_table_get(&reply->ip, reply->vlan_id, false);
+    if (!neigh)
+        return false;
+
+    if (!neigh->damped) {
+        neigh->damped = true;
+        memcpy(neigh->damped_mac, reply->mac, sizeof(reply->mac));
+        return false;
+    }
+
+    if (memcmp(neigh->damped_mac, reply->mac, sizeof(reply->mac))) {
+        memcpy(neigh->damped_mac, reply->mac, sizeof(reply->mac));
+        stats.flaps++;
+
+        if (!env.damping.disabled) {
+            __u32 ceiling = damping_ceiling();
+
+            now = now_ms();
+            neigh->penalty = damping_decay(neigh->penalty,
+                                           now - neigh->penalty_ms);
+            neigh->penalty_ms = now;
+            if ((__u64)neigh->penalty + DAMPING_PENALTY < ceiling)
+                neigh->penalty += DAMPING_PENALTY;
+            else
+                neigh->penalty = ceiling;
+
+            if (!neigh->suppressed && neigh->penalty > env.damping.suppress)
+                damping_suppress(neigh);
+        }
+    }
+
+    // Replies that keep the installed binding still refresh it
+    if (neigh->suppressed && (!neigh->known ||
+        memcmp(neigh->mac, reply->mac, sizeof(reply->mac)))) {
+        pr_debug("Neighbor %s is suppressed with penalty %u: held\n",
+                 fmt_ip(&reply->ip), neigh->penalty);
+        stats.held++;
+        return true;
+    }
+    return false;
+}
+
+// Installs the newest binding of a neighbor whose suppression ended
+static void damping_release(struct neigh_entry *neigh)
+{
+    struct neighbor_reply reply = {
+        .vlan_id = neigh->vlan_id,
+        .ip = neigh->ip,
+        .in_family = IN6_IS_ADDR_V4MAPPED(&neigh->ip) ? AF_INET : AF_INET6,
+    };
+
+    neigh->suppressed = false;
+    stats.released++;
+    pr_info("Neighbor %s stopped flapping, installing %s\n",
+            fmt_ip(&neigh->ip), fmt_mac(neigh->damped_mac));
+
+    if (neigh->known &&
+        !memcmp(neigh->mac, neigh->damped_mac, sizeof(neigh->mac)))
+        return;
+
+    memcpy(reply.mac, neigh->damped_mac, sizeof(reply.mac));
+    release_handler(&reply);
+}
+
+// Releases the suppressed neighbors that have decayed below reuse
+void damping_run(void)
+{
+    __u64 now;
+    __u32 i = 0;
+
+    if (!suppressed_len)
+        return;
+
+    now = now_ms();
+    if (now < next_tick_ms)
+        return;
+    next_tick_ms = now + DAMPING_TICK_MS;
+
+    while (i < suppressed_len) {
+        struct damping_key *key = &suppressed[i];
+        struct neigh_entry *neigh;
+
+        neigh = neigh_table_get(&key->ip, key->vlan_id, false);
+        if (neigh && neigh->suppressed &&
+            damping_decay(neigh->penalty, now - neigh->penalty_ms) >=
+            env.damping.reuse) {
+            i++;
+            continue;
+        }
+
+        // The order of the list does not matter
+        *key = suppressed[--suppressed_len];
+        if (neigh && neigh->suppressed)
+            damping_release(neigh);
+    }
+
+    if (!suppressed_len)
+        next_tick_ms = 0;
+}
+
+// Milliseconds until the next check of the suppressed neighbors
+int damping_timeout(void)
+{
+    __u64 now;
+
+    if (!suppressed_len)
+        return -1;
+    now = now_ms();
+    return next_tick_ms > now ? next_tick_ms - now : 0;
+}
+
+void damping_free(void)
+{
+    free(suppressed);
+    suppressed = NULL;
+    suppressed_len = suppressed_cap = 0;
+}
+
+void damping_print_stats(void)
+{
+    __u64 now = now_ms();
+
+    pr_info("Damping: %llu flaps, %llu suppressed, %llu held, %llu released, "
+            "%u suppressed now\n", stats.flaps, stats.suppressed, stats.held,
+            stats.released, suppressed_len);
+
+    for (__u32 i = 0; i < suppressed_len; i++) {
+        struct neigh_entry *neigh = neigh_table_get(&suppressed[i].ip,
+                                                    suppressed[i].vlan_id,
+                                                    false);
+        if (!neigh)
+            continue;
+        pr_info("Suppressed %s VLAN %u penalty %u, newest MAC %s\n",
+                fmt_ip(&neigh->ip), neigh->vlan_id,
+                damping_decay(neigh->penalty, now - neigh->penalty_ms),
+                fmt_mac(neigh->damped_mac));
+    }
+}
@@ -0,0 +1,70 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is> */
+/* SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com> */
+/* SPDX-FileContributor: Freysteinn Alfredsson <freysteinn@freysteinn.com> */
+/* SPDX-FileContributor: Julius Thor Bess Rikardsson <juliusbess@gmail.com> */
+
+/*
+ * Standalone driver for the fuzz targets, for AFL and for compilers without
+ * libFuzzer. Runs LLVMFuzzerTestOneInput() once for every file given, or
+ * for standard input when there are none, so that a crashing input found by
+ * either fuzzer can be replayed under a debugger.
+ *
+ * Usage: fuzz_TARGET [FILE...]
+ *        afl-fuzz -i fuzz/corpus/TARGET -o OUT -- fuzz_TARGET @@
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include <linux/types.h>
+
+#define FUZZ_INPUT_MAX (1 << 20)
+
+int LLVMFuzzerTestOneInput(const __u8 *data, size_t size);
+
+static int run_file(const char *path, __u8 *buf)
+{
+    FILE *f = path ? fopen(path, "rb") : stdin;
+    size_t size;
+
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    size = fread(buf, 1, FUZZ_INPUT_MAX, f);
+    if (ferror(f)) {
+        fprintf(stderr, "Failed to read %s\n", path ? path : "stdin");
+        if (path)
+            fclose(f);
+        return -1;
+    }
+    if (path)
+        fclose(f);
+
+    LLVMFuzzerTestOneInput(buf, size);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    __u8 *buf;
+    int err = 0;
+
+    buf = malloc(FUZZ_INPUT_MAX);
+    if (!buf) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+
+    if (argc < 2)
+        err = run_file(NULL, buf);
+    for (int i = 1; i < argc; i++)
+        err |= run_file(argv[i], buf);
+
+    free(buf);
+    return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
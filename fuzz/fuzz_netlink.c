@@ -0,0 +1,116 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is> */
+/* SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com> */
+/* SPDX-FileContributor: Freysteinn Alfredsson <freysteinn@freysteinn.com> */
+/* SPDX-FileContributor: Julius Thor Bess Rikardsson <juliusbess@gmail.com> */
+
+/*
+ * Fuzz target for the netlink message callbacks. The first byte of an input
+ * selects the callback and the rest is a stream of netlink messages, run
+ * through mnl_cb_run() as a reply from the kernel would be:
+ *
+ *   0  getneigh_parse_nlm_cb()  FDB lookups, for the MAC and VLAN below
+ *   1  getaddr_parse_nlm_cb()   address dumps, for the IPv4 address below
+ *   2  getaddr_parse_nlm_cb()   address dumps, for the IPv6 address below
+ *   3  handle_link_event()      link notifications and dumps
+ *
+ * The callbacks are static, so the daemon is included whole. The link cache
+ * is flushed after every input to keep runs reproducible.
+ */
+
+#define main neighsnoopd_main
+#include "../neighsnoopd.c"
+#undef main
+
+enum fuzz_target {
+    FUZZ_GETNEIGH,
+    FUZZ_GETADDR4,
+    FUZZ_GETADDR6,
+    FUZZ_LINK,
+    FUZZ_MAX,
+};
+
+/*
+ * The link cache is indexed by ifindex, which the kernel keeps small and
+ * dense. Larger indexes only make the fuzzer run out of memory.
+ */
+#define FUZZ_IFINDEX_MAX 4096
+
+static const __u8 fuzz_mac[ETH_ALEN] = { 0x02, 0, 0, 0, 0, 0x0a };
+
+/*
+ * mnl_nlmsg_ok() compares the message length as a signed int, so a length
+ * above INT_MAX sends mnl_cb_run() off the end of the buffer, and libmnl
+ * parses attributes up to the aligned end of a message. The kernel only
+ * sends aligned messages that fit the buffer, so only the prefix of the
+ * input that does is run.
+ */
+static size_t fuzz_valid_len(const void *buf, size_t len)
+{
+    const struct nlmsghdr *nlh = buf;
+    size_t valid = 0;
+
+    while (len - valid >= sizeof(*nlh) && nlh->nlmsg_len >= sizeof(*nlh) &&
+           NLMSG_ALIGN(nlh->nlmsg_len) <= len - valid) {
+        valid += NLMSG_ALIGN(nlh->nlmsg_len);
+        nlh = buf + valid;
+    }
+    return valid;
+}
+
+static int fuzz_link_event(const struct nlmsghdr *nlh, void *data)
+{
+    struct ifinfomsg *ifm = mnl_nlmsg_get_payload(nlh);
+
+    if (mnl_nlmsg_get_payload_len(nlh) >= sizeof(*ifm) &&
+        (__u32)ifm->ifi_index >= FUZZ_IFINDEX_MAX)
+        return MNL_CB_OK;
+
+    return handle_link_event(nlh, data);
+}
+
+int LLVMFuzzerTestOneInput(const __u8 *data, size_t size)
+{
+    struct neighbor_reply neighbor_reply = {
+        .in_family = AF_INET,
+        .vlan_id = 100,
+    };
+    struct lookup_cache cache = { .neighbor_reply = &neighbor_reply };
+    struct addr_match match = { .ip = &neighbor_reply.ip };
+    size_t len;
+    void *buf;
+
+    if (size < 1 || data[0] >= FUZZ_MAX)
+        return 0;
+
+    buf = malloc(size - 1 ? size - 1 : 1);
+    if (!buf)
+        return 0;
+    memcpy(buf, data + 1, size - 1);
+    len = fuzz_valid_len(buf, size - 1);
+
+    memcpy(neighbor_reply.mac, fuzz_mac, sizeof(fuzz_mac));
+
+    switch (data[0]) {
+    case FUZZ_GETNEIGH:
+        mnl_cb_run(buf, len, 0, 0, getneigh_parse_nlm_cb, &cache);
+        break;
+    case FUZZ_GETADDR4:
+        map_ipv4_to_ipv6(&neighbor_reply.ip, htonl(0xc000020a));
+        mnl_cb_run(buf, len, 0, 0, getaddr_parse_nlm_cb, &match);
+        break;
+    case FUZZ_GETADDR6:
+        inet_pton(AF_INET6, "2001:db8::10", &neighbor_reply.ip);
+        mnl_cb_run(buf, len, 0, 0, getaddr_parse_nlm_cb, &match);
+        break;
+    case FUZZ_LINK:
+        // VLAN devices on ifindex 1 are treated as SVIs
+        env.ifidx_mon = 1;
+        mnl_cb_run(buf, len, 0, 0, fuzz_link_event, NULL);
+        link_cache_flush();
+        break;
+    }
+
+    free(buf);
+    return 0;
+}
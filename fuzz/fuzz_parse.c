@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is> */
+/* SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com> */
+/* SPDX-FileContributor: Freysteinn Alfredsson <freysteinn@freysteinn.com> */
+/* SPDX-FileContributor: Julius Thor Bess Rikardsson <juliusbess@gmail.com> */
+
+/*
+ * Fuzz target for the ARP reply and Neighbor Advertisement parsers in
+ * neighsnoopd_parse.h. Each input is a single Ethernet frame, copied to the
+ * end of a buffer so that the sanitizers catch any read past data_end,
+ * which the verifier would otherwise be the only guard against. The frame
+ * starts NET_IP_ALIGN bytes in, as in the kernel, to keep the network
+ * headers aligned.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/types.h>
+
+#include "neighsnoopd_shared.h"
+
+#define NET_IP_ALIGN 2
+
+static struct neighbor_reply fuzz_reply;
+
+static inline struct neighbor_reply *neighbor_reply_reserve(void)
+{
+    memset(&fuzz_reply, 0, sizeof(fuzz_reply));
+    return &fuzz_reply;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunknown-pragmas" // #pragma unroll
+#include "neighsnoopd_parse.h"
+#pragma GCC diagnostic pop
+
+int LLVMFuzzerTestOneInput(const __u8 *data, size_t size)
+{
+    struct neighbor_reply *neighbor_reply;
+    struct collect_vlans vlans = { 0 };
+    struct hdr_cursor nh;
+    struct ethhdr *eth;
+    void *buf, *frame;
+    int eth_type;
+
+    buf = malloc(NET_IP_ALIGN + size);
+    if (!buf)
+        return 0;
+    frame = buf + NET_IP_ALIGN;
+    memcpy(frame, data, size);
+
+    nh.pos = frame;
+    eth_type = parse_ethhdr_vlan(&nh, frame + size, &eth, &vlans);
+    neighbor_reply = parse_neighbor_reply(&nh, frame + size, eth, eth_type);
+
+    // A record must only ever describe the two families the daemon handles
+    if (neighbor_reply && neighbor_reply->in_family != AF_INET &&
+        neighbor_reply->in_family != AF_INET6)
+        abort();
+
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,187 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-or-later
+# SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is>
+# SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com>
+"""
+Seeds the fuzzer corpora. The parser corpus gets every frame of the pcap
+files in tests/corpus, and the netlink corpus gets the kinds of replies
+and notifications the daemon receives from the kernel, prefixed with the
+target selector byte described in fuzz/fuzz_netlink.c.
+
+Usage: seed_corpus.py [OUTPUT_DIR]
+"""
+
+import glob
+import os
+import socket
+import struct
+import sys
+
+FUZZ_DIR = os.path.dirname(os.path.abspath(__file__))
+PCAP_DIR = os.path.join(FUZZ_DIR, "..", "tests", "corpus")
+
+FUZZ_GETNEIGH = 0
+FUZZ_GETADDR4 = 1
+FUZZ_GETADDR6 = 2
+FUZZ_LINK = 3
+
+NLMSG_DONE = 3
+RTM_NEWLINK = 16
+RTM_DELLINK = 17
+RTM_NEWADDR = 20
+RTM_NEWNEIGH = 28
+NLM_F_MULTI = 2
+
+IFLA_IFNAME = 3
+IFLA_LINK = 5
+IFLA_MASTER = 10
+IFLA_LINKINFO = 18
+IFLA_INFO_KIND = 1
+IFLA_INFO_DATA = 2
+IFLA_VLAN_ID = 1
+IFA_ADDRESS = 1
+IFA_LOCAL = 2
+NDA_LLADDR = 2
+NDA_VLAN = 5
+NTF_EXT_LEARNED = 0x10
+NLA_F_NESTED = 0x8000
+
+NUD_REACHABLE = 0x02
+AF_BRIDGE = 7
+
+HOST_MAC = bytes.fromhex("02000000000a")
+OTHER_MAC = bytes.fromhex("02000000000b")
+
+
+def pad(data):
+    return data + b"\0" * (-len(data) % 4)
+
+
+def attr(attr_type, payload):
+    return pad(struct.pack("=HH", 4 + len(payload), attr_type) + payload)
+
+
+def nlmsg(msg_type, payload, flags=NLM_F_MULTI):
+    return pad(struct.pack("=IHHII", 16 + len(payload), msg_type, flags, 0,
+                           0) + payload)
+
+
+def done():
+    return nlmsg(NLMSG_DONE, struct.pack("=i", 0))
+
+
+def ndmsg(ifindex, flags, *attrs):
+    return nlmsg(RTM_NEWNEIGH, struct.pack("=BxxxiHBB", AF_BRIDGE, ifindex,
+                                           NUD_REACHABLE, flags, 0) +
+                 b"".join(attrs))
+
+
+def ifaddrmsg(family, prefixlen, ifindex, address):
+    return nlmsg(RTM_NEWADDR, struct.pack("=BBBBI", family, prefixlen, 0, 0,
+                                          ifindex) +
+                 attr(IFA_ADDRESS, address) + attr(IFA_LOCAL, address))
+
+
+def ifinfomsg(msg_type, ifindex, name, kind=None, link=None, master=None,
+              info_data=b""):
+    attrs = attr(IFLA_IFNAME, name.encode() + b"\0")
+    if link is not None:
+        attrs += attr(IFLA_LINK, struct.pack("=I", link))
+    if master is not None:
+        attrs += attr(IFLA_MASTER, struct.pack("=I", master))
+    if kind:
+        info = attr(IFLA_INFO_KIND, kind.encode() + b"\0")
+        if info_data:
+            info += attr(IFLA_INFO_DATA | NLA_F_NESTED, info_data)
+        attrs += attr(IFLA_LINKINFO | NLA_F_NESTED, info)
+    return nlmsg(msg_type, struct.pack("=BxHiII", socket.AF_UNSPEC, 0,
+                                       ifindex, 0, 0) + attrs)
+
+
+def vlan_id(vid):
+    return attr(IFLA_VLAN_ID, struct.pack("=H", vid))
+
+
+NETLINK_SEEDS = {
+    "neigh_match": (FUZZ_GETNEIGH, [
+        ndmsg(2, 0, attr(NDA_LLADDR, HOST_MAC),
+              attr(NDA_VLAN, struct.pack("=H", 100))),
+    ]),
+    "neigh_dump": (FUZZ_GETNEIGH, [
+        ndmsg(2, 0, attr(NDA_LLADDR, OTHER_MAC)),
+        ndmsg(2, NTF_EXT_LEARNED, attr(NDA_LLADDR, HOST_MAC),
+              attr(NDA_VLAN, struct.pack("=H", 100))),
+        ndmsg(2, 0, attr(NDA_LLADDR, HOST_MAC),
+              attr(NDA_VLAN, struct.pack("=H", 200))),
+        done(),
+    ]),
+    "addr4_dump": (FUZZ_GETADDR4, [
+        ifaddrmsg(socket.AF_INET, 8, 1, bytes([10, 0, 0, 1])),
+        ifaddrmsg(socket.AF_INET, 24, 3, bytes([192, 0, 2, 1])),
+        ifaddrmsg(socket.AF_INET, 32, 4, bytes([192, 0, 2, 10])),
+        done(),
+    ]),
+    "addr6_dump": (FUZZ_GETADDR6, [
+        ifaddrmsg(socket.AF_INET6, 64, 3,
+                  bytes.fromhex("20010db8000000000000000000000001")),
+        ifaddrmsg(socket.AF_INET6, 64, 3,
+                  bytes.fromhex("fe800000000000000000000000000001")),
+        done(),
+    ]),
+    "link_dump": (FUZZ_LINK, [
+        ifinfomsg(RTM_NEWLINK, 1, "br0", kind="bridge"),
+        ifinfomsg(RTM_NEWLINK, 2, "port0", kind="veth", master=1),
+        ifinfomsg(RTM_NEWLINK, 3, "br0.100", kind="vlan", link=1,
+                  info_data=vlan_id(100)),
+        ifinfomsg(RTM_NEWLINK, 4, "mv0", kind="macvlan", link=3),
+        ifinfomsg(RTM_NEWLINK, 5, "vrf0", kind="vrf"),
+        done(),
+    ]),
+    "link_retag": (FUZZ_LINK, [
+        ifinfomsg(RTM_NEWLINK, 3, "br0.100", kind="vlan", link=1,
+                  info_data=vlan_id(100)),
+        ifinfomsg(RTM_NEWLINK, 3, "br0.200", kind="vlan", link=1,
+                  info_data=vlan_id(200)),
+        ifinfomsg(RTM_DELLINK, 3, "br0.200"),
+    ]),
+}
+
+
+def pcap_frames(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    magic, = struct.unpack_from("<I", data)
+    endian = "<" if magic in (0xa1b2c3d4, 0xa1b23c4d) else ">"
+    offset = 24
+    while offset + 16 <= len(data):
+        _, _, caplen, _ = struct.unpack_from(endian + "IIII", data, offset)
+        offset += 16
+        yield data[offset:offset + caplen]
+        offset += caplen
+
+
+def write(path, data):
+    with open(path, "wb") as f:
+        f.write(data)
+
+
+def main():
+    out = sys.argv[1] if len(sys.argv) > 1 else os.path.join(FUZZ_DIR,
+                                                             "corpus")
+    parse_dir = os.path.join(out, "parse")
+    netlink_dir = os.path.join(out, "netlink")
+    os.makedirs(parse_dir, exist_ok=True)
+    os.makedirs(netlink_dir, exist_ok=True)
+
+    for path in sorted(glob.glob(os.path.join(PCAP_DIR, "*.pcap"))):
+        name = os.path.splitext(os.path.basename(path))[0]
+        for i, frame in enumerate(pcap_frames(path)):
+            write(os.path.join(parse_dir, "%s-%d" % (name, i)), frame)
+
+    for name, (target, messages) in NETLINK_SEEDS.items():
+        write(os.path.join(netlink_dir, name),
+              bytes([target]) + b"".join(messages))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,284 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is> */
+/* SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com> */
+/* SPDX-FileContributor: Freysteinn Alfredsson <freysteinn@freysteinn.com> */
+/* SPDX-FileContributor: Julius Thor Bess Rikardsson <juliusbess@gmail.com> */
+
+/*
+ * Heavy hitters among the sources of replies, for finding the MAC addresses,
+ * IP addresses and VLANs behind a flood without logging every reply. With
+ * --hitters the BPF program counts every parsed reply in a per-CPU
+ * count-min sketch for each kind of key, and keeps the keys with the highest
+ * estimates of its CPU as candidates.
+ *
+ * Every HITTERS_WINDOW_MS the sketches of all CPUs are summed, the
+ * candidates of all CPUs are re-estimated from the sum, and the HITTERS_TOP
+ * heaviest of each kind are kept in a min-heap. The maps are then cleared
+ * for the next window, and SIGUSR1 prints the last complete window. The
+ * estimates never undercount, and overcount by at most the replies of the
+ * window divided by HITTER_WIDTH with high probability.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "neighsnoopd.h"
+#include "neighsnoopd_shared.h"
+
+extern struct env env;
+
+#define HITTERS_WINDOW_MS 10000
+
+struct hitter_heap {
+    struct hitter items[HITTERS_TOP];
+    int len;
+};
+
+static const char *kind_names[HITTER_KINDS] = {
+    [HITTER_MAC] = "MAC",
+    [HITTER_IP] = "IP",
+    [HITTER_VLAN] = "VLAN",
+};
+
+static int sketch_fd = -1;
+static int top_fd = -1;
+static int n_cpus;
+static struct hitter_row *rows;    // One row per CPU as read from the map
+static struct hitter_slots *slots; // One table per CPU as read from the map
+static __u64 merged[HITTER_ROWS][HITTER_WIDTH];
+static struct hitter_heap heaps[HITTER_KINDS];
+static __u64 window_start_ms;
+static __u64 window_ms;
+
+int hitters_attach(int sketch_map_fd, int top_map_fd)
+{
+    n_cpus = libbpf_num_possible_cpus();
+    if (n_cpus <= 0) {
+        errno = -n_cpus;
+        return -1;
+    }
+
+    rows = calloc(n_cpus, sizeof(*rows));
+    slots = calloc(n_cpus, sizeof(*slots));
+    if (!rows || !slots) {
+        hitters_free();
+        return -1;
+    }
+
+    sketch_fd = sketch_map_fd;
+    top_fd = top_map_fd;
+    window_start_ms = now_ms();
+    return 0;
+}
+
+static void heap_swap(struct hitter_heap *heap, int a, int b)
+{
+    struct hitter tmp = heap->items[a];
+
+    heap->items[a] = heap->items[b];
+    heap->items[b] = tmp;
+}
+
+static void heap_down(struct hitter_heap *heap, int i)
+{
+    for (;;) {
+        int min = i;
+        int l = 2 * i + 1;
+        int r = l + 1;
+
+        if (l < heap->len && heap->items[l].count < heap->items[min].count)
+            min = l;
+        if (r < heap->len && heap->items[r].count < heap->items[min].count)
+            min = r;
+        if (min == i)
+            return;
+        heap_swap(heap, i, min);
+        i = min;
+    }
+}
+
+// Keeps the HITTERS_TOP heaviest keys, with the lightest at the root
+static void heap_offer(struct hitter_heap *heap, const struct hitter *hitter)
+{
+    int i;
+
+    for (i = 0; i < heap->len; i++) {
+        if (!memcmp(&heap->items[i].key, &hitter->key, sizeof(hitter->key)))
+            return; // Already a candidate of another CPU
+    }
+
+    if (heap->len < HITTERS_TOP) {
+        i = heap->len++;
+        heap->items[i] = *hitter;
+        while (i && heap->items[(i - 1) / 2].count > heap->items[i].count) {
+            heap_swap(heap, i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+        return;
+    }
+
+    if (hitter->count <= heap->items[0].count)
+        return;
+    heap->items[0] = *hitter;
+    heap_down(heap, 0);
+}
+
+static __u64 sketch_estimate(const struct hitter_key *key)
+{
+    __u64 est = ~0ULL;
+
+    for (__u32 row = 0; row < HITTER_ROWS; row++) {
+        __u64 count = merged[row][hitter_hash(key, row)];
+
+        if (count < est)
+            est = count;
+    }
+    return est;
+}
+
+// Sums the sketch of a kind over the CPUs and clears it for the next window
+static int sketch_merge(enum hitter_kind kind)
+{
+    memset(merged, 0, sizeof(merged));
+    for (__u32 row = 0; row < HITTER_ROWS; row++) {
+        __u32 idx = kind * HITTER_ROWS + row;
+
+        if (bpf_map_lookup_elem(sketch_fd, &idx, rows))
+            return -1;
+        for (int cpu = 0; cpu < n_cpus; cpu++) {
+            for (int i = 0; i < HITTER_WIDTH; i++)
+                merged[row][i] += rows[cpu].counts[i];
+        }
+
+        // Replies counted since the lookup are lost, which a window allows
+        memset(rows, 0, n_cpus * sizeof(*rows));
+        if (bpf_map_update_elem(sketch_fd, &idx, rows, BPF_ANY))
+            return -1;
+    }
+    return 0;
+}
+
+static int hitters_merge(enum hitter_kind kind, struct hitter_heap *heap)
+{
+    __u32 key = kind;
+
+    heap->len = 0;
+    if (sketch_merge(kind) || bpf_map_lookup_elem(top_fd, &key, slots))
+        return -1;
+
+    for (int cpu = 0; cpu < n_cpus; cpu++) {
+        for (int i = 0; i < HITTER_SLOTS; i++) {
+            struct hitter hitter = { .key = slots[cpu].slots[i].key };
+
+            if (!slots[cpu].slots[i].count)
+                continue;
+            hitter.count = sketch_estimate(&hitter.key);
+            heap_offer(heap, &hitter);
+        }
+    }
+
+    memset(slots, 0, n_cpus * sizeof(*slots));
+    return bpf_map_update_elem(top_fd, &key, slots, BPF_ANY);
+}
+
+// Closes the window when it is due
+void hitters_run(void)
+{
+    __u64 now;
+
+    if (sketch_fd < 0)
+        return;
+
+    now = now_ms();
+    if (now - window_start_ms < HITTERS_WINDOW_MS)
+        return;
+
+    for (int kind = 0; kind < HITTER_KINDS; kind++) {
+        if (hitters_merge(kind, &heaps[kind]))
+            pr_err(errno, "Failed to merge the %s sketch", kind_names[kind]);
+    }
+    window_ms = now - window_start_ms;
+    window_start_ms = now;
+}
+
+/*
+ * Copies the heaviest keys of a kind in the last complete window to top,
+ * heaviest first, and returns how many there are, at most HITTERS_TOP.
+ */
+int hitters_top(int kind, struct hitter *top)
+{
+    struct hitter_heap heap = heaps[kind];
+    int n = heap.len;
+
+    // The min-heap pops the lightest first, so fill from the end
+    for (int i = n - 1; i >= 0; i--) {
+        top[i] = heap.items[0];
+        heap.items[0] = heap.items[--heap.len];
+        heap_down(&heap, 0);
+    }
+    return n;
+}
+
+// Milliseconds until the window closes
+int hitters_timeout(void)
+{
+    __u64 now = now_ms();
+
+    if (sketch_fd < 0)
+        return -1;
+    if (now - window_start_ms >= HITTERS_WINDOW_MS)
+        return 0;
+    return HITTERS_WINDOW_MS - (now - window_start_ms);
+}
+
+static const char *fmt_hitter(enum hitter_kind kind,
+                              const struct hitter_key *key)
+{
+    static char buf[16];
+
+    switch (kind) {
+    case HITTER_MAC:
+        return fmt_mac((const __u8 *)key);
+    case HITTER_IP:
+        return fmt_ip((const struct in6_addr *)key);
+    default:
+        snprintf(buf, sizeof(buf), "%llu", key->words[0]);
+        return buf;
+    }
+}
+
+void hitters_print_stats(void)
+{
+    if (sketch_fd < 0)
+        return;
+
+    if (!window_ms) {
+        pr_info("Hitters: the first window closes after %d s\n",
+                HITTERS_WINDOW_MS / 1000);
+        return;
+    }
+
+    for (int kind = 0; kind < HITTER_KINDS; kind++) {
+        struct hitter sorted[HITTERS_TOP];
+        int n = hitters_top(kind, sorted);
+
+        pr_info("Top %s sources over %llu ms:\n", kind_names[kind],
+                window_ms);
+        for (int i = 0; i < n; i++)
+            pr_info("%3d. %-40s %10llu replies\n", i + 1,
+                    fmt_hitter(kind, &sorted[i].key), sorted[i].count);
+    }
+}
+
+void hitters_free(void)
+{
+    free(rows);
+    free(slots);
+    rows = NULL;
+    slots = NULL;
+    sketch_fd = top_fd = -1;
+}
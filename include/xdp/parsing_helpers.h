@@ -19,6 +19,8 @@
 #ifndef __PARSING_HELPERS_H
 #define __PARSING_HELPERS_H
 
+/* CO-RE builds get the kernel types from vmlinux.h instead */
+#ifndef __VMLINUX_H__
 #include <stddef.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
@@ -29,6 +31,7 @@
 #include <linux/udp.h>
 #include <linux/tcp.h>
 #include <linux/in.h>
+#endif
 #include <bpf/bpf_endian.h>
 
 /* Header cursor to keep track of current parsing position */
@@ -41,10 +44,12 @@ struct hdr_cursor {
  *    @h_vlan_TCI: priority and VLAN ID
  *    @h_vlan_encapsulated_proto: packet type ID or len
  */
+#ifndef __VMLINUX_H__
 struct vlan_hdr {
     __be16    h_vlan_TCI;
     __be16    h_vlan_encapsulated_proto;
 };
+#endif
 
 /*
  * Struct icmphdr_common represents the common part of the icmphdr and icmp6hdr
@@ -61,6 +66,11 @@ struct icmphdr_common {
 #define VLAN_MAX_DEPTH 2
 #endif
 
+/* Allow users to parse fewer tags than VLAN_MAX_DEPTH, e.g. with a knob */
+#ifndef VLAN_PARSE_DEPTH
+#define VLAN_PARSE_DEPTH VLAN_MAX_DEPTH
+#endif
+
 /* Longest chain of IPv6 extension headers to resolve */
 #ifndef IPV6_EXT_MAX_CHAIN
 #define IPV6_EXT_MAX_CHAIN 6
@@ -110,7 +120,7 @@ static __always_inline int parse_ethhdr_vlan(struct hdr_cursor *nh,
      */
 #pragma unroll
     for (i = 0; i < VLAN_MAX_DEPTH; i++) {
-        if (!proto_is_vlan(h_proto))
+        if (i >= VLAN_PARSE_DEPTH || !proto_is_vlan(h_proto))
             break;
 
         if ((void *)(vlh + 1) > data_end)
@@ -6,10 +6,36 @@
 
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <arpa/inet.h>
 
 #include "neighsnoopd.h"
 
+static bool clock_frozen;
+static __u64 clock_frozen_ms;
+
+// Milliseconds on the monotonic clock, or the time now_ms_set() gave
+__u64 now_ms(void)
+{
+    struct timespec ts;
+
+    if (clock_frozen)
+        return clock_frozen_ms;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+// Replay runs the timers on the capture clock, see replay.c
+void now_ms_set(__u64 ms)
+{
+    clock_frozen = true;
+    clock_frozen_ms = ms;
+}
+
+void now_ms_reset(void)
+{
+    clock_frozen = false;
+}
 
 void mac_to_string(__u8 *buffer, const __u8 *mac, size_t buffer_size)
 {
@@ -21,6 +47,35 @@ void mac_to_string(__u8 *buffer, const __u8 *mac, size_t buffer_size)
              mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 }
 
+/*
+ * Render addresses for log arguments. The log macros only evaluate their
+ * arguments when the message is printed, so the hot path never formats
+ * strings that are not logged. The buffers rotate so that one log line can
+ * hold several addresses.
+ */
+#define FMT_BUFFERS 4
+
+const char *fmt_mac(const __u8 *mac)
+{
+    static __u8 buffers[FMT_BUFFERS][MAC_ADDR_STR_LEN];
+    static unsigned int next;
+    __u8 *buffer = buffers[next++ % FMT_BUFFERS];
+
+    mac_to_string(buffer, mac, MAC_ADDR_STR_LEN);
+    return (const char *)buffer;
+}
+
+const char *fmt_ip(const struct in6_addr *addr)
+{
+    static char buffers[FMT_BUFFERS][INET6_ADDRSTRLEN];
+    static unsigned int next;
+    char *buffer = buffers[next++ % FMT_BUFFERS];
+
+    if (format_ip_address(buffer, INET6_ADDRSTRLEN, addr))
+        return "<invalid>";
+    return buffer;
+}
+
 void calculate_network_address(const struct in6_addr *ip,
                                const struct in6_addr *netmask,
                                struct in6_addr *network)
@@ -29,6 +84,23 @@ void calculate_network_address(const struct in6_addr *ip,
         network->s6_addr[i] = ip->s6_addr[i] & netmask->s6_addr[i];
 }
 
+/*
+ * Builds the netmask of a prefix. IPv4 netmasks are IPv4-mapped, like the
+ * addresses they apply to.
+ */
+void calculate_netmask(struct in6_addr *netmask, int family, int prefixlen)
+{
+    int bits = family == AF_INET ? 96 + prefixlen : prefixlen;
+
+    memset(netmask, 0, sizeof(*netmask));
+    if (family == AF_INET)
+        memset(&netmask->s6_addr[10], 0xff, 2);
+
+    for (int i = family == AF_INET ? 12 : 0; i < 16 && bits > i * 8; i++)
+        netmask->s6_addr[i] = bits >= (i + 1) * 8 ? 0xff :
+            (__u8)(0xff << (8 - (bits - i * 8)));
+}
+
 int compare_ipv6_addresses(const struct in6_addr *addr1,
                            const struct in6_addr *addr2)
 {
@@ -0,0 +1,377 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is> */
+/* SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com> */
+/* SPDX-FileContributor: Freysteinn Alfredsson <freysteinn@freysteinn.com> */
+/* SPDX-FileContributor: Julius Thor Bess Rikardsson <juliusbess@gmail.com> */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <bpf/bpf.h>
+#include <libmnl/libmnl.h>
+#include <linux/if_link.h>
+#include <linux/rtnetlink.h>
+
+#include "neighsnoopd.h"
+#include "neighsnoopd_shared.h"
+
+extern struct env env;
+
+/*
+ * Link metadata indexed by ifindex. Interface indexes are small and dense, so
+ * a directly indexed table makes every lookup constant-time. The table is
+ * kept current by RTM_NEWLINK and RTM_DELLINK notifications.
+ */
+static struct link_info **links;
+static __u32 links_size;
+
+/*
+ * Interface filter verdicts as a bitmap indexed by ifindex, sized with the
+ * link table. The first IFINDEX_BITMAP_BITS are mirrored into the BPF
+ * filtered_ifindexes map together with the VLAN to SVI table, so that the
+ * BPF program drops replies for filtered SVIs before they reach userspace.
+ */
+static __u64 *filter_bitmap;
+static __u32 vlan_svis[VLAN_ID_MAX];
+static int filter_map_fd = -1;
+static int vlan_map_fd = -1;
+
+static int links_grow(__u32 ifindex)
+{
+    __u32 size = links_size ? links_size : 64;
+    struct link_info **new_links;
+    __u64 *new_bitmap;
+
+    while (size <= ifindex)
+        size *= 2;
+
+    new_links = realloc(links, size * sizeof(*links));
+    if (!new_links)
+        return -1;
+
+    memset(new_links + links_size, 0,
+           (size - links_size) * sizeof(*links));
+    links = new_links;
+
+    new_bitmap = realloc(filter_bitmap, size / 64 * sizeof(*filter_bitmap));
+    if (!new_bitmap)
+        return -1;
+
+    memset(new_bitmap + links_size / 64, 0,
+           (size - links_size) / 64 * sizeof(*filter_bitmap));
+    filter_bitmap = new_bitmap;
+    links_size = size;
+    return 0;
+}
+
+bool link_cache_is_filtered(__u32 ifindex)
+{
+    if (ifindex >= links_size)
+        return false;
+    return filter_bitmap[ifindex / 64] & (1ULL << (ifindex % 64));
+}
+
+static void filter_bitmap_sync(__u32 word)
+{
+    if (filter_map_fd < 0 || word >= IFINDEX_BITMAP_WORDS)
+        return;
+
+    if (bpf_map_update_elem(filter_map_fd, &word, &filter_bitmap[word],
+                            BPF_ANY))
+        pr_err(errno, "Failed to update the filtered interfaces map");
+}
+
+static void filter_bitmap_set(__u32 ifindex, bool filtered)
+{
+    __u32 word = ifindex / 64;
+    __u64 bit = 1ULL << (ifindex % 64);
+    __u64 old = filter_bitmap[word];
+
+    if (filtered)
+        filter_bitmap[word] |= bit;
+    else
+        filter_bitmap[word] &= ~bit;
+
+    if (filter_bitmap[word] != old)
+        filter_bitmap_sync(word);
+}
+
+static void vlan_svi_set(__u16 vlan_id, __u32 ifindex)
+{
+    __u32 key = vlan_id;
+
+    if (vlan_id >= VLAN_ID_MAX || vlan_svis[vlan_id] == ifindex)
+        return;
+
+    vlan_svis[vlan_id] = ifindex;
+    if (vlan_map_fd < 0)
+        return;
+
+    if (bpf_map_update_elem(vlan_map_fd, &key, &ifindex, BPF_ANY))
+        pr_err(errno, "Failed to update the VLAN SVI map");
+}
+
+// SVIs are VLAN devices stacked directly on the monitored bridge
+static bool link_is_svi(const struct link_info *link)
+{
+    return link->vlan_id && link->link_ifindex == (__u32)env.ifidx_mon;
+}
+
+/*
+ * Push the current verdicts into the BPF maps once they exist. Links are
+ * dumped before the BPF object is loaded, so this is a full sync.
+ */
+int link_cache_attach_bpf(int filter_fd, int vlan_fd)
+{
+    filter_map_fd = filter_fd;
+    vlan_map_fd = vlan_fd;
+
+    for (__u32 word = 0; word < links_size / 64; word++)
+        filter_bitmap_sync(word);
+
+    for (__u32 key = 0; key < VLAN_ID_MAX; key++) {
+        if (!vlan_svis[key])
+            continue;
+        if (bpf_map_update_elem(vlan_map_fd, &key, &vlan_svis[key], BPF_ANY)) {
+            pr_err(errno, "Failed to update the VLAN SVI map");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct link_info *link_cache_get(__u32 ifindex)
+{
+    if (ifindex >= links_size)
+        return NULL;
+    return links[ifindex];
+}
+
+// The VRF is the master device when the master is a VRF device
+__u32 link_cache_vrf(const struct link_info *link)
+{
+    struct link_info *master = link_cache_get(link->master);
+
+    if (!master || !master->is_vrf)
+        return 0;
+    return master->ifindex;
+}
+
+static void link_cache_del(__u32 ifindex)
+{
+    if (ifindex >= links_size || !links[ifindex])
+        return;
+
+    if (link_is_svi(links[ifindex]) &&
+        vlan_svis[links[ifindex]->vlan_id] == ifindex)
+        vlan_svi_set(links[ifindex]->vlan_id, 0);
+    filter_bitmap_set(ifindex, false);
+
+    pr_debug("Link %d (%s) removed from the link cache\n", ifindex,
+             links[ifindex]->ifname);
+    free(links[ifindex]);
+    links[ifindex] = NULL;
+}
+
+void link_cache_flush(void)
+{
+    for (__u32 i = 0; i < links_size; i++)
+        link_cache_del(i);
+}
+
+/*
+ * The regex filter is fixed for the lifetime of the process, so it only
+ * needs to be evaluated when an interface appears or is renamed.
+ */
+static bool link_filter_verdict(const char *ifname)
+{
+    if (!env.has_filter)
+        return false;
+
+    return regexec(&env.regex_filter, ifname, 0, NULL, 0) == 0;
+}
+
+static int getlink_parse_attr_cb(const struct nlattr *attr, void *data)
+{
+    const struct nlattr **tb = data;
+    int type = mnl_attr_get_type(attr);
+
+    /* skip unsupported attribute in user-space */
+    if (mnl_attr_type_valid(attr, IFLA_MAX) < 0)
+        return MNL_CB_OK;
+
+    switch(type) {
+        case IFLA_IFNAME:
+            if (mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) < 0) {
+                pr_err(errno, "mnl_attr_validate");
+                return MNL_CB_ERROR;
+            }
+            break;
+        case IFLA_LINK:
+        case IFLA_MASTER:
+            if (mnl_attr_validate(attr, MNL_TYPE_U32) < 0) {
+                pr_err(errno, "mnl_attr_validate");
+                return MNL_CB_ERROR;
+            }
+            break;
+        case IFLA_LINKINFO:
+            if (mnl_attr_validate(attr, MNL_TYPE_NESTED) < 0) {
+                pr_err(errno, "mnl_attr_validate");
+                return MNL_CB_ERROR;
+            }
+    }
+    tb[type] = attr;
+    return MNL_CB_OK;
+}
+
+static __u16 getlink_vlan_id(const struct nlattr *info_data)
+{
+    struct nlattr *attr;
+
+    mnl_attr_for_each_nested(attr, info_data) {
+        if (mnl_attr_get_type(attr) != IFLA_VLAN_ID)
+            continue;
+        if (mnl_attr_validate(attr, MNL_TYPE_U16) < 0) {
+            pr_err(errno, "mnl_attr_validate");
+            return 0;
+        }
+        // The VLAN ID indexes vlan_svis
+        if (mnl_attr_get_u16(attr) >= VLAN_ID_MAX)
+            return 0;
+        return mnl_attr_get_u16(attr);
+    }
+    return 0;
+}
+
+/*
+ * Add, refresh or remove a link from an RTM_NEWLINK or RTM_DELLINK message.
+ * Used for notifications, dump replies and single link lookups alike.
+ */
+int link_cache_update(const struct nlmsghdr *nlh)
+{
+    struct ifinfomsg *ifm = mnl_nlmsg_get_payload(nlh);
+    struct nlattr *tb[IFLA_MAX + 1] = {};
+    struct link_info *link;
+    const char *ifname;
+
+    if (mnl_nlmsg_get_payload_len(nlh) < sizeof(*ifm))
+        return MNL_CB_OK;
+
+    // Bridge port notifications only carry bridge specific attributes
+    if (ifm->ifi_family == AF_BRIDGE)
+        return MNL_CB_OK;
+
+    if (nlh->nlmsg_type == RTM_DELLINK) {
+        link_cache_del(ifm->ifi_index);
+        return MNL_CB_OK;
+    }
+
+    if (nlh->nlmsg_type != RTM_NEWLINK) {
+        pr_err(0, "Unexpected Netlink message type %d, expected %d",
+               nlh->nlmsg_type, RTM_NEWLINK);
+        return MNL_CB_OK;
+    }
+
+    if (mnl_attr_parse(nlh, sizeof(*ifm), getlink_parse_attr_cb, tb) < 0)
+        return MNL_CB_ERROR;
+
+    if (ifm->ifi_index <= 0 || !tb[IFLA_IFNAME])
+        return MNL_CB_OK;
+
+    if ((__u32)ifm->ifi_index >= links_size && links_grow(ifm->ifi_index)) {
+        pr_err(errno, "Failed to grow the link cache");
+        return MNL_CB_ERROR;
+    }
+
+    link = links[ifm->ifi_index];
+    if (!link) {
+        link = calloc(1, sizeof(*link));
+        if (!link) {
+            pr_err(errno, "calloc");
+            return MNL_CB_ERROR;
+        }
+        link->ifindex = ifm->ifi_index;
+        links[ifm->ifi_index] = link;
+    }
+
+    ifname = mnl_attr_get_str(tb[IFLA_IFNAME]);
+    if (strncmp(link->ifname, ifname, sizeof(link->ifname))) {
+        bool filtered = link_filter_verdict(ifname);
+
+        snprintf(link->ifname, sizeof(link->ifname), "%s", ifname);
+        filter_bitmap_set(link->ifindex, filtered);
+        if (filtered)
+            pr_debug("Filtered interface %s using filter: '%s'\n",
+                     link->ifname, env.regexp_filter_ifname);
+    }
+
+    // A re-parented or re-tagged SVI must release its old VLAN
+    if (link_is_svi(link) && vlan_svis[link->vlan_id] == link->ifindex)
+        vlan_svi_set(link->vlan_id, 0);
+
+    link->link_ifindex = tb[IFLA_LINK] ? mnl_attr_get_u32(tb[IFLA_LINK]) : 0;
+    link->master = tb[IFLA_MASTER] ? mnl_attr_get_u32(tb[IFLA_MASTER]) : 0;
+
+    link->kind[0] = '\0';
+    link->vlan_id = 0;
+    if (tb[IFLA_LINKINFO]) {
+        struct nlattr *info_data = NULL;
+        struct nlattr *link_attr;
+        mnl_attr_for_each_nested(link_attr, tb[IFLA_LINKINFO]) {
+            if (mnl_attr_get_type(link_attr) == IFLA_INFO_KIND &&
+                mnl_attr_validate(link_attr, MNL_TYPE_NUL_STRING) == 0) {
+
+                snprintf(link->kind, sizeof(link->kind), "%s",
+                         mnl_attr_get_str(link_attr));
+            }
+            if (mnl_attr_get_type(link_attr) == IFLA_INFO_DATA)
+                info_data = link_attr;
+        }
+        if (info_data && strcmp(link->kind, "vlan") == 0)
+            link->vlan_id = getlink_vlan_id(info_data);
+    }
+
+    link->is_macvlan = strcmp(link->kind, "macvlan") == 0;
+    link->is_vrf = strcmp(link->kind, "vrf") == 0;
+
+    if (link_is_svi(link))
+        vlan_svi_set(link->vlan_id, link->ifindex);
+
+    pr_debug("Link %d (%s) is of type: %s\n", link->ifindex, link->ifname,
+             strlen(link->kind) ? link->kind : "unknown");
+
+    return MNL_CB_OK;
+}
+
+static int getlink_parse_nlm_cb(const struct nlmsghdr *nlh, void *data)
+{
+    return link_cache_update(nlh);
+}
+
+/*
+ * Fetch a single link from the kernel. This is only needed when an interface
+ * is used before its RTM_NEWLINK notification has been processed.
+ */
+struct link_info *link_cache_probe(__u32 ifindex)
+{
+    char buf[MNL_SOCKET_BUFFER_SIZE];
+    struct nlmsghdr *nlh;
+    struct ifinfomsg *ifm;
+
+    nlh = mnl_nlmsg_put_header(buf);
+    nlh->nlmsg_type = RTM_GETLINK;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+
+    ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(struct ifinfomsg));
+    ifm->ifi_family = AF_UNSPEC;
+    ifm->ifi_index = ifindex;
+
+    if (nl_request(NL_SOCK_QUERY, nlh, getlink_parse_nlm_cb, NULL) < 0) {
+        pr_err(errno, "Failed to lookup interface %d", ifindex);
+        return NULL;
+    }
+
+    return link_cache_get(ifindex);
+}
@@ -0,0 +1,310 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is> */
+/* SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com> */
+/* SPDX-FileContributor: Freysteinn Alfredsson <freysteinn@freysteinn.com> */
+/* SPDX-FileContributor: Julius Thor Bess Rikardsson <juliusbess@gmail.com> */
+
+/*
+ * Neighbors seen by the daemon, keyed by IP address and VLAN. The work queue
+ * uses the table to tell new bindings and MAC changes from refreshes of
+ * neighbors it has already handled.
+ *
+ * The table is open addressed with linear probing and grows by doubling at
+ * half load. Every distinct sender of a reply takes an entry, so the table
+ * stops growing at NEIGH_TABLE_MAX slots, which hold half as many neighbors,
+ * rather than letting spoofed replies exhaust memory. A full table is swept
+ * for idle entries, at most every NEIGH_SWEEP_MS, and neighbors it has no
+ * room for are left untracked. Entries are removed by shifting the rest of
+ * their probe run back, so the table needs no tombstones.
+ *
+ * An entry is idle when nothing else refers to it: it is not installed,
+ * owned or suppressed, and has no replies queued. Only what the work queue
+ * and damping remember of earlier replies is lost with it. The entry of a
+ * neighbor the kernel deleted is removed too once it is idle.
+ *
+ * Netlink notifications name a neighbor by its address and interface, not
+ * by the VLAN of the reply, which a macvlan or untagged SVI does not carry.
+ * The interface a neighbor is installed on is therefore indexed as well, in
+ * a chained hash of (IP address, ifindex) to the key of the neighbor.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "neighsnoopd.h"
+
+extern struct env env;
+
+#define NEIGH_TABLE_MIN (1 << 10)
+#define NEIGH_TABLE_MAX (1 << 18)
+#define NEIGH_LINK_BUCKETS (1 << 14)
+#define NEIGH_SWEEP_MS 1000
+
+struct neigh_link {
+    struct in6_addr ip;
+    __u32 ifindex;
+    __u16 vlan_id;
+    struct neigh_link *next;
+};
+
+static struct neigh_entry *neighs;
+static __u32 neighs_size;
+static __u32 neighs_count;
+static struct neigh_link *neigh_links[NEIGH_LINK_BUCKETS];
+static __u64 neighs_swept_ms;
+
+/*
+ * The slot is taken from the low bits, so the key is run through the
+ * splitmix64 finalizer. Only the last four bytes of an IPv4 address vary,
+ * and a plain multiply would leave the host bits out of the low ones.
+ */
+static __u32 neigh_hash(const struct in6_addr *ip, __u32 seed)
+{
+    __u64 a, b, h;
+
+    memcpy(&a, &ip->s6_addr[0], sizeof(a));
+    memcpy(&b, &ip->s6_addr[8], sizeof(b));
+    h = ((a ^ seed) * 0x9e3779b97f4a7c15ULL) ^ b;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+static struct neigh_entry *neigh_slot(struct neigh_entry *table, __u32 size,
+                                      const struct in6_addr *ip,
+                                      __u16 vlan_id)
+{
+    __u32 i = neigh_hash(ip, vlan_id) & (size - 1);
+
+    // The load factor stays below one half, so there is always a free slot
+    while (table[i].used && (table[i].vlan_id != vlan_id ||
+                             memcmp(&table[i].ip, ip, sizeof(*ip))))
+        i = (i + 1) & (size - 1);
+    return &table[i];
+}
+
+static bool neigh_idle(const struct neigh_entry *neigh)
+{
+    return !neigh->installed && !neigh->owned && !neigh->suppressed &&
+        !neigh->pending;
+}
+
+static struct neigh_link **neigh_link_find(const struct in6_addr *ip,
+                                           __u32 ifindex)
+{
+    struct neigh_link **pos;
+
+    pos = &neigh_links[neigh_hash(ip, ifindex) & (NEIGH_LINK_BUCKETS - 1)];
+    while (*pos && ((*pos)->ifindex != ifindex ||
+                    memcmp(&(*pos)->ip, ip, sizeof(*ip))))
+        pos = &(*pos)->next;
+    return pos;
+}
+
+// Drops the index of the interface a neighbor is installed on
+static void neigh_link_remove(const struct neigh_entry *neigh)
+{
+    struct neigh_link **pos;
+    struct neigh_link *link;
+
+    if (!neigh->ifindex)
+        return;
+
+    pos = neigh_link_find(&neigh->ip, neigh->ifindex);
+    link = *pos;
+    if (link && link->vlan_id == neigh->vlan_id) {
+        *pos = link->next;
+        free(link);
+    }
+}
+
+/*
+ * Removes an entry. The entries after it in its probe run that could have
+ * taken its slot are moved back, so that lookups still find them.
+ */
+static void neigh_table_remove(struct neigh_entry *neigh)
+{
+    __u32 mask = neighs_size - 1;
+    __u32 hole = neigh - neighs;
+    __u32 i = hole;
+
+    neigh_link_remove(neigh);
+
+    for (;;) {
+        __u32 home;
+
+        i = (i + 1) & mask;
+        if (!neighs[i].used)
+            break;
+
+        // An entry can move back unless the hole is before its home slot
+        home = neigh_hash(&neighs[i].ip, neighs[i].vlan_id) & mask;
+        if (((hole - home) & mask) < ((i - home) & mask)) {
+            neighs[hole] = neighs[i];
+            hole = i;
+        }
+    }
+
+    memset(&neighs[hole], 0, sizeof(neighs[hole]));
+    neighs_count--;
+}
+
+// Removes the idle entries of a full table. Returns the number removed.
+static __u32 neigh_table_sweep(void)
+{
+    __u64 now = now_ms();
+    __u32 removed = 0;
+    __u32 i = 0;
+
+    if (neighs_swept_ms && now - neighs_swept_ms < NEIGH_SWEEP_MS)
+        return 0;
+    neighs_swept_ms = now;
+
+    // The slot of a removed entry may be taken by the next one, check again
+    while (i < neighs_size) {
+        if (neighs[i].used && neigh_idle(&neighs[i])) {
+            neigh_table_remove(&neighs[i]);
+            removed++;
+        } else {
+            i++;
+        }
+    }
+
+    pr_debug("Neighbor table is full, removed %u idle neighbors\n", removed);
+    return removed;
+}
+
+static int neigh_table_grow(void)
+{
+    __u32 size = neighs_size ? neighs_size * 2 : NEIGH_TABLE_MIN;
+    struct neigh_entry *table;
+
+    table = calloc(size, sizeof(*table));
+    if (!table)
+        return -1;
+
+    for (__u32 i = 0; i < neighs_size; i++) {
+        if (neighs[i].used)
+            *neigh_slot(table, size, &neighs[i].ip, neighs[i].vlan_id) =
+                neighs[i];
+    }
+
+    free(neighs);
+    neighs = table;
+    neighs_size = size;
+    return 0;
+}
+
+/*
+ * Look up the entry of a neighbor, and with create, add it if it is missing.
+ * Returns NULL if the neighbor is not in the table or the table is full.
+ */
+struct neigh_entry *neigh_table_get(const struct in6_addr *ip, __u16 vlan_id,
+                                    bool create)
+{
+    struct neigh_entry *neigh;
+
+    if (!neighs_size) {
+        if (!create || neigh_table_grow())
+            return NULL;
+    }
+
+    neigh = neigh_slot(neighs, neighs_size, ip, vlan_id);
+    if (neigh->used || !create)
+        return neigh->used ? neigh : NULL;
+
+    if ((neighs_count + 1) * 2 > neighs_size) {
+        if (neighs_size >= NEIGH_TABLE_MAX) {
+            if (!neigh_table_sweep())
+                return NULL;
+        } else if (neigh_table_grow()) {
+            pr_err(errno, "Failed to grow the neighbor table");
+            return NULL;
+        }
+        neigh = neigh_slot(neighs, neighs_size, ip, vlan_id);
+    }
+
+    memset(neigh, 0, sizeof(*neigh));
+    neigh->used = true;
+    neigh->ip = *ip;
+    neigh->vlan_id = vlan_id;
+    neighs_count++;
+    return neigh;
+}
+
+// Records the interface a neighbor is installed on
+void neigh_table_link(struct neigh_entry *neigh, __u32 ifindex)
+{
+    struct neigh_link **pos;
+    struct neigh_link *link;
+
+    if (neigh->ifindex == ifindex && *neigh_link_find(&neigh->ip, ifindex))
+        return;
+
+    // A neighbor is installed on one interface at a time
+    neigh_link_remove(neigh);
+    neigh->ifindex = ifindex;
+
+    pos = neigh_link_find(&neigh->ip, ifindex);
+    if (*pos) {
+        (*pos)->vlan_id = neigh->vlan_id;
+        return;
+    }
+
+    link = calloc(1, sizeof(*link));
+    if (!link) {
+        pr_err(errno, "Failed to index neighbor %s", fmt_ip(&neigh->ip));
+        return;
+    }
+    link->ip = neigh->ip;
+    link->ifindex = ifindex;
+    link->vlan_id = neigh->vlan_id;
+    *pos = link;
+}
+
+// Finds the neighbor installed with ip on ifindex
+struct neigh_entry *neigh_table_find(const struct in6_addr *ip,
+                                     __u32 ifindex)
+{
+    struct neigh_link *link = *neigh_link_find(ip, ifindex);
+    struct neigh_entry *neigh;
+
+    if (!link)
+        return NULL;
+
+    neigh = neigh_table_get(ip, link->vlan_id, false);
+    if (!neigh || neigh->ifindex != ifindex)
+        return NULL;
+    return neigh;
+}
+
+// Removes the entry of a neighbor the kernel deleted from ifindex if it is idle
+void neigh_table_forget(const struct in6_addr *ip, __u32 ifindex)
+{
+    struct neigh_entry *neigh = neigh_table_find(ip, ifindex);
+
+    if (neigh && neigh_idle(neigh))
+        neigh_table_remove(neigh);
+}
+
+__u32 neigh_table_count(void)
+{
+    return neighs_count;
+}
+
+void neigh_table_free(void)
+{
+    for (int i = 0; i < NEIGH_LINK_BUCKETS; i++) {
+        while (neigh_links[i]) {
+            struct neigh_link *next = neigh_links[i]->next;
+
+            free(neigh_links[i]);
+            neigh_links[i] = next;
+        }
+    }
+    free(neighs);
+    neighs = NULL;
+    neighs_size = neighs_count = 0;
+    neighs_swept_ms = 0;
+}
@@ -4,183 +4,697 @@
 /* SPDX-FileContributor: Freysteinn Alfredsson <freysteinn@freysteinn.com> */
 /* SPDX-FileContributor: Julius Thor Bess Rikardsson <juliusbess@gmail.com> */
 
-#include <linux/bpf.h>
-#include <linux/ip.h>
-#include <linux/if_arp.h>
-#include <linux/if_packet.h>
-#include <linux/if_ether.h>
-#include <linux/if_vlan.h>
-#include <linux/in.h>
+// Built CO-RE against the kernel types in vmlinux.h, see the Makefile
+#include "vmlinux.h"
 #include <bpf/bpf_helpers.h>
-
-#include <linux/pkt_cls.h>
-#include "include/xdp/parsing_helpers.h"
+#include <bpf/bpf_endian.h>
+
+// UAPI constants are macros, which BTF and so vmlinux.h do not carry
+#define AF_INET 2
+#define AF_INET6 10
+#define ETH_ALEN 6
+#define ETH_P_ARP 0x0806
+#define ETH_P_8021Q 0x8100
+#define ETH_P_IPV6 0x86DD
+#define ETH_P_8021AD 0x88A8
+#define ARPOP_REPLY 2
+#define IPPROTO_HOPOPTS 0
+#define IPPROTO_ROUTING 43
+#define IPPROTO_FRAGMENT 44
+#define IPPROTO_ICMPV6 58
+#define IPPROTO_DSTOPTS 60
+#define IPPROTO_MH 135
+#define TC_ACT_OK 0
+#define CLOCK_MONOTONIC 1
+
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
 
 #include "neighsnoopd_shared.h"
 
-#define ND_NEIGHBOR_ADVERT          136
-#define ND_OPT_MAX_CHAIN            3
-#define ND_OPT_TARGET_LINKADDR      2
+/*
+ * Specialisation knobs, set by userspace from the command line options
+ * before the program is loaded. They live in read-only data, so the verifier
+ * sees them as constants and removes the branches that a variant never
+ * takes: the families that are not snooped, and the VLAN tags that are not
+ * parsed on untagged or single tagged networks.
+ */
+const volatile bool snoop_ipv4 = true;
+const volatile bool snoop_ipv6 = true;
+const volatile __u32 vlan_depth = VLAN_MAX_DEPTH;
+const volatile bool fib_lookup = false; // Resolve the SVI in the TC program
+
+/*
+ * Token bucket rates as the nanoseconds between replies and the burst
+ * tolerance in nanoseconds, see rate_take(). An interval of 0 disables the
+ * bucket.
+ */
+const volatile __u64 mac_interval_ns = 0;
+const volatile __u64 mac_burst_ns = 0;
+const volatile __u64 vlan_interval_ns = 0;
+const volatile __u64 vlan_burst_ns = 0;
+
+const volatile bool hitters = false; // Count the heaviest sources of replies
+
+// Replies staged per CPU and sent in one sample, see reply_stage_push()
+const volatile __u32 batch_replies = 1;
+
+// Longest time a staged reply waits for the others of its sample
+#define REPLY_STAGE_DELAY_NS 1000000
+
+#define PARSE_IPV4 snoop_ipv4
+#define PARSE_IPV6 snoop_ipv6
+#define VLAN_PARSE_DEPTH vlan_depth
 
-struct nd_opt_hdr {
-    __u8 nd_opt_type;
-    __u8 nd_opt_len; // Length in units of 8 octets
-};
+#include "include/xdp/parsing_helpers.h"
 
 struct {
     __uint(type, BPF_MAP_TYPE_RINGBUF);
     __uint(max_entries, 1 << 24);  // 16 MB
 } neighbor_ringbuf SEC(".maps");
 
-// Find ND Option Header of specified type
-static __always_inline int find_nd_opt(struct hdr_cursor *nh,
-                                       void *data_end,
-                                       __u8 next_hdr_type)
+// Read by the load generator to find the saturation point of the ring buffer
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, __u32);
+    __type(value, struct neighbor_stats);
+    __uint(max_entries, 1);
+} neighbor_stats SEC(".maps");
+
+// Interface filter verdicts as a bitmap indexed by ifindex
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __type(key, __u32);
+    __type(value, __u64);
+    __uint(max_entries, IFINDEX_BITMAP_WORDS);
+} filtered_ifindexes SEC(".maps");
+
+// The SVI on the monitored bridge for each VLAN ID
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __type(key, __u32);
+    __type(value, __u32);
+    __uint(max_entries, VLAN_ID_MAX);
+} vlan_svis SEC(".maps");
+
+static __always_inline bool ifindex_is_filtered(__u32 ifindex)
 {
-    for (int i = 0; i < ND_OPT_MAX_CHAIN; ++i) {
-        struct nd_opt_hdr *hdr = nh->pos;
+    __u32 key = ifindex / 64;
+    __u64 *word;
 
-        if ((void *)(hdr + 1) > data_end)
-            return -1;
+    word = bpf_map_lookup_elem(&filtered_ifindexes, &key);
+    if (!word)
+        return false;
 
-        if (((void *)hdr) + hdr->nd_opt_len * 8 > data_end)
-            return -1;
+    return *word & (1ULL << (ifindex % 64));
+}
 
-        switch (hdr->nd_opt_type) {
-            case ND_OPT_TARGET_LINKADDR:
-                return 0;
-            default:
-                nh->pos = ((void *)hdr) + hdr->nd_opt_len * 8;
-        }
+// Replies on a VLAN whose SVI is filtered would be dropped by userspace
+static __always_inline bool vlan_is_filtered(__u16 vlan_id)
+{
+    __u32 key = vlan_id;
+    __u32 *svi;
+
+    if (!vlan_id)
+        return false;
+
+    svi = bpf_map_lookup_elem(&vlan_svis, &key);
+    if (!svi || !*svi)
+        return false;
+
+    return ifindex_is_filtered(*svi);
+}
+
+// The record the parsers fill in, per CPU since programs do not nest
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, __u32);
+    __type(value, struct neighbor_reply);
+    __uint(max_entries, 1);
+} reply_scratch SEC(".maps");
+
+/*
+ * Replies that found the ring buffer full. Userspace drains the map once it
+ * sees the drop counter move, so bursts that overflow the ring buffer do not
+ * leave neighbors uninstalled until they reply again.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, struct neighbor_key);
+    __type(value, struct neighbor_reply);
+    __uint(max_entries, MISSED_REPLIES_MAX);
+} missed_replies SEC(".maps");
+
+/*
+ * Set once a reply is kept in missed_replies and cleared by userspace when a
+ * drain leaves the map empty, so that replies only delete their missed entry
+ * while there can be one.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __type(key, __u32);
+    __type(value, __u32);
+    __uint(max_entries, 1);
+} missed_pending SEC(".maps");
+
+// A sample on its way to the ring buffer, per CPU
+struct reply_sample {
+    __u32 len;
+    __u32 count;
+    __u8 buf[REPLY_STAGE_SIZE] __attribute__((aligned(8)));
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, __u32);
+    __type(value, struct reply_sample);
+    __uint(max_entries, 1);
+} reply_samples SEC(".maps");
+
+/*
+ * The records staged by each CPU. Timers cannot live in per-CPU maps, so it
+ * is an array indexed by CPU, and the lock guards against the timer firing
+ * on another CPU. Only created with --batch, see neighsnoopd.c.
+ */
+struct reply_stage {
+    struct bpf_spin_lock lock;
+    __u32 len;
+    __u32 count;
+    __u32 timer_ready;
+    struct bpf_timer timer;
+    __u8 buf[REPLY_STAGE_SIZE] __attribute__((aligned(8)));
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __type(key, __u32);
+    __type(value, struct reply_stage);
+    __uint(max_entries, 1); // Resized to the number of CPUs
+} reply_stages SEC(".maps");
+
+/*
+ * The parsers fill in a scratch record, which is packed and copied to the
+ * ring buffer once the reply is complete. Unlike a reservation it is still
+ * there when the ring buffer is full.
+ */
+static __always_inline struct neighbor_reply *neighbor_reply_reserve(void)
+{
+    struct neighbor_stats *stats;
+    __u32 key = 0;
+
+    stats = bpf_map_lookup_elem(&neighbor_stats, &key);
+    if (stats)
+        stats->replies++;
+
+    return bpf_map_lookup_elem(&reply_scratch, &key);
+}
+
+// Keeps the replies of a sample that found the ring buffer full
+static __always_inline void reply_sample_missed(struct reply_sample *sample)
+{
+    struct neighbor_reply reply;
+    struct neighbor_key missed;
+    struct neighbor_stats *stats;
+    __u32 *pending;
+    __u64 off = 0;
+    __u32 key = 0;
+
+    stats = bpf_map_lookup_elem(&neighbor_stats, &key);
+    if (stats)
+        stats->ringbuf_drops += sample->count;
+
+    for (int i = 0; i < REPLY_BATCH_MAX; i++) {
+        __u32 len;
+
+        // No record of a full stage starts beyond the last full size one
+        if (off >= sample->len ||
+            off > REPLY_STAGE_SIZE - sizeof(struct reply_record))
+            break;
+
+        __builtin_memset(&reply, 0, sizeof(reply));
+        len = reply_record_decode(sample->buf + off, sample->len - off,
+                                  &reply);
+        if (!len)
+            break;
+        off += len;
+
+        __builtin_memset(&missed, 0, sizeof(missed));
+        missed.ip = reply.ip;
+        missed.vlan_id = reply.vlan_id;
+        bpf_map_update_elem(&missed_replies, &missed, &reply, BPF_ANY);
     }
 
-    return -1;
+    // Only after the inserts, or a drain could clear it past one of them
+    pending = bpf_map_lookup_elem(&missed_pending, &key);
+    if (pending)
+        *pending = 1;
 }
 
-static __always_inline struct neighbor_reply *handle_nd_reply(
-    struct hdr_cursor *nh, void *data_end, struct ethhdr *eth)
+// Sends a sample to userspace, or keeps its replies for a resync
+static __always_inline void reply_sample_send(struct reply_sample *sample)
 {
-    struct neighbor_reply *neighbor_reply = NULL;
-    struct ipv6hdr *ip;
-    struct icmp6hdr *icmp6;
-    struct in6_addr *target_ipv6;
-    struct nd_opt_hdr *nd_opt_hdr;
-    __u8 *target_mac;
-
-    // Parse the IPv6 header
-    if (parse_ip6hdr(nh, data_end, &ip) != IPPROTO_ICMPV6)
-        goto out;
+    __u64 len = sample->len;
 
-    // Check if the message is a Neighbor Advertisement
-    if (parse_icmp6hdr(nh, data_end, &icmp6) != ND_NEIGHBOR_ADVERT)
-        goto out;
+    if (!len || len > REPLY_STAGE_SIZE)
+        return;
 
-    if ((void *)(icmp6 + 1) > data_end)
-        goto out;
-    nh->pos = icmp6 + 1;
+    if (bpf_ringbuf_output(&neighbor_ringbuf, sample->buf, len, 0))
+        reply_sample_missed(sample);
+}
 
-    // Check if the message is long enough to contain the target IPv6 address
-    target_ipv6 = nh->pos;
-    if ((void *)(target_ipv6 + 1) > data_end)
-        goto out;
-    nh->pos = target_ipv6 + 1;
+// Empties a stage into a sample and sends it
+static __always_inline void reply_stage_flush(struct reply_stage *stage)
+{
+    struct reply_sample *sample;
+    __u32 key = 0;
+
+    sample = bpf_map_lookup_elem(&reply_samples, &key);
+    if (!sample)
+        return;
+
+    bpf_spin_lock(&stage->lock);
+    sample->len = stage->len;
+    sample->count = stage->count;
+    __builtin_memcpy(sample->buf, stage->buf, sizeof(sample->buf));
+    stage->len = 0;
+    stage->count = 0;
+    bpf_spin_unlock(&stage->lock);
+
+    reply_sample_send(sample);
+}
 
-    // Parse options to find the Source Link-Layer Address (MAC address)
-    if (find_nd_opt(nh, data_end, ND_OPT_TARGET_LINKADDR)) {
-        target_mac = eth->h_source;
-    } else {
-        nd_opt_hdr = nh->pos;
+static int reply_stage_expired(void *map, __u32 *key,
+                               struct reply_stage *stage)
+{
+    reply_stage_flush(stage);
+    return 0;
+}
 
-        if ((void *)(nd_opt_hdr + 1) > data_end)
-            goto out;
+/*
+ * Stages a record of this CPU. The stage is sent once it holds
+ * batch_replies records, or REPLY_STAGE_DELAY_NS after the first, so a
+ * burst costs one ring buffer sample per batch while a lone reply is only
+ * briefly delayed. Returns false when the record could not be staged.
+ */
+static __always_inline bool reply_stage_push(const struct reply_record *rec,
+                                             __u32 len)
+{
+    __u32 cpu = bpf_get_smp_processor_id();
+    struct reply_stage *stage;
+    bool first, full;
+    __u32 off;
+
+    stage = bpf_map_lookup_elem(&reply_stages, &cpu);
+    if (!stage)
+        return false;
+
+    bpf_spin_lock(&stage->lock);
+    off = stage->len;
+    if (off > REPLY_STAGE_SIZE - sizeof(*rec)) {
+        bpf_spin_unlock(&stage->lock);
+        return false;
+    }
+    __builtin_memcpy(stage->buf + off, rec, sizeof(*rec));
+    stage->len = off + len;
+    first = !stage->count++;
+    full = stage->count >= batch_replies;
+    bpf_spin_unlock(&stage->lock);
+
+    if (full) {
+        reply_stage_flush(stage);
+        return true;
+    }
 
-        target_mac = (void *)(nd_opt_hdr + 1);
+    if (first) {
+        // Initialising twice fails with EBUSY, which leaves the timer as is
+        if (!stage->timer_ready) {
+            bpf_timer_init(&stage->timer, &reply_stages, CLOCK_MONOTONIC);
+            bpf_timer_set_callback(&stage->timer, reply_stage_expired);
+            stage->timer_ready = 1;
+        }
+        bpf_timer_start(&stage->timer, REPLY_STAGE_DELAY_NS, 0);
+    }
+    return true;
+}
 
-        if ((void *)(target_mac + ETH_ALEN) > data_end)
-            goto out;
+/*
+ * Sends a complete reply to userspace, or keeps it for a resync. A missed
+ * reply of the neighbor is superseded by this one, which is kept in its
+ * place should it miss the ring buffer as well.
+ */
+static __always_inline void neighbor_reply_emit(
+    struct neighbor_reply *neighbor_reply)
+{
+    struct reply_sample *sample;
+    struct neighbor_key missed;
+    struct reply_record rec;
+    __u32 *pending;
+    __u32 key = 0;
+    __u32 len;
+
+    pending = bpf_map_lookup_elem(&missed_pending, &key);
+    if (pending && *pending) {
+        __builtin_memset(&missed, 0, sizeof(missed));
+        missed.ip = neighbor_reply->ip;
+        missed.vlan_id = neighbor_reply->vlan_id;
+        bpf_map_delete_elem(&missed_replies, &missed);
     }
 
-    // Add the data to the ringbuffer
-    neighbor_reply = bpf_ringbuf_reserve(&neighbor_ringbuf,
-                                         sizeof(*neighbor_reply), 0);
-    if (!neighbor_reply)
-        goto out;
+    __builtin_memset(&rec, 0, sizeof(rec));
+    len = reply_record_encode(&rec, neighbor_reply);
+    if (batch_replies > 1 && reply_stage_push(&rec, len))
+        return;
+
+    sample = bpf_map_lookup_elem(&reply_samples, &key);
+    if (!sample)
+        return;
+    sample->len = len;
+    sample->count = 1;
+    __builtin_memcpy(sample->buf, &rec, sizeof(rec));
+    reply_sample_send(sample);
+}
 
-    __builtin_memcpy(neighbor_reply->mac, target_mac, ETH_ALEN);
-    __builtin_memcpy(&neighbor_reply->ip, target_ipv6, sizeof(*target_ipv6));
+// Token buckets of the source MAC addresses, the oldest are recycled
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, __u64);
+    __type(value, __u64);
+    __uint(max_entries, RATE_MACS_MAX);
+} rate_macs SEC(".maps");
 
-    neighbor_reply->in_family = AF_INET6;
+// Token buckets of the VLANs, indexed by VLAN ID
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __type(key, __u32);
+    __type(value, __u64);
+    __uint(max_entries, VLAN_ID_MAX);
+} rate_vlans SEC(".maps");
+
+/*
+ * Takes a token from a bucket kept as its theoretical arrival time, the
+ * time at which the bucket is full again (GCRA). A reply conforms unless
+ * the bucket would refill more than burst_ns after now. Updates from other
+ * CPUs may race, which only makes the limit slightly lax.
+ */
+static __always_inline bool rate_take(__u64 *tat, __u64 now,
+                                      __u64 interval_ns, __u64 burst_ns)
+{
+    __u64 t = *tat;
 
-out:
-    return neighbor_reply;
+    if (t > now + burst_ns)
+        return false;
+    *tat = (t > now ? t : now) + interval_ns;
+    return true;
 }
 
-static __always_inline struct neighbor_reply *handle_arp_reply(
-    struct hdr_cursor *nh, void *data_end)
+/*
+ * Returns false for replies over the rate of their source MAC or VLAN. The
+ * source MAC is the one of the Ethernet header, not the one the reply
+ * claims, which a sender chooses freely per reply.
+ */
+static __always_inline bool rate_limit(struct neighbor_reply *neighbor_reply,
+                                       const __u8 *h_source)
 {
-    struct neighbor_reply *neighbor_reply = NULL;
-    struct arphdr *arp;
-    __u8 *sender_ip;
-    __u8 *sender_mac;
+    struct neighbor_stats *stats;
+    __u32 key = 0;
+    __u64 now;
+    __u64 *tat;
+
+    if (!mac_interval_ns && !vlan_interval_ns)
+        return true;
+
+    now = bpf_ktime_get_ns();
+    stats = bpf_map_lookup_elem(&neighbor_stats, &key);
+
+    // The source MAC first, so a flooding host spends no VLAN tokens
+    if (mac_interval_ns) {
+        __u64 mac = 0;
+
+        __builtin_memcpy(&mac, h_source, ETH_ALEN);
+        tat = bpf_map_lookup_elem(&rate_macs, &mac);
+        if (!tat) {
+            __u64 next = now + mac_interval_ns;
+
+            bpf_map_update_elem(&rate_macs, &mac, &next, BPF_ANY);
+        } else if (!rate_take(tat, now, mac_interval_ns, mac_burst_ns)) {
+            if (stats)
+                stats->rate_mac++;
+            return false;
+        }
+    }
 
-    if (nh->pos + sizeof(struct arphdr) > data_end)
-        goto out;
+    if (vlan_interval_ns) {
+        key = neighbor_reply->vlan_id;
+        tat = bpf_map_lookup_elem(&rate_vlans, &key);
+        if (tat && !rate_take(tat, now, vlan_interval_ns, vlan_burst_ns)) {
+            if (stats)
+                stats->rate_vlan++;
+            return false;
+        }
+    }
+    return true;
+}
 
-    arp = nh->pos;
-    if (arp->ar_op != bpf_htons(ARPOP_REPLY))
-        goto out;
+// Rows of the count-min sketch, HITTER_ROWS per kind of key
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, __u32);
+    __type(value, struct hitter_row);
+    __uint(max_entries, HITTER_KINDS * HITTER_ROWS);
+} hitter_sketch SEC(".maps");
 
-    // Extract IPv4 and MAC addresses
-    sender_mac = (__u8 *)(arp + 1);
-    if (sender_mac + 6 > (__u8 *)data_end)
-        goto out;
+// Candidates for the heaviest keys of each kind
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, __u32);
+    __type(value, struct hitter_slots);
+    __uint(max_entries, HITTER_KINDS);
+} hitter_top SEC(".maps");
+
+/*
+ * Counts a key in the sketch and keeps it as a candidate when its estimate
+ * beats the smallest candidate. Userspace merges the CPUs and re-estimates
+ * the candidates from the merged sketch, so the estimates here only need to
+ * rank the keys of this CPU.
+ */
+static __always_inline void hitter_count(__u32 kind,
+                                         const struct hitter_key *key)
+{
+    struct hitter_slots *top;
+    struct hitter_row *row;
+    __u32 est = ~0U;
+    __u32 min = 0;
+    __u32 i;
+
+#pragma unroll
+    for (i = 0; i < HITTER_ROWS; i++) {
+        __u32 idx = kind * HITTER_ROWS + i;
+        __u32 *count;
+
+        row = bpf_map_lookup_elem(&hitter_sketch, &idx);
+        if (!row)
+            return;
+        count = &row->counts[hitter_hash(key, i)];
+        *count += 1;
+        if (*count < est)
+            est = *count;
+    }
 
-    sender_ip = sender_mac + arp->ar_hln;
-    if (sender_ip + 4 > (__u8 *)data_end)
-        goto out;
+    top = bpf_map_lookup_elem(&hitter_top, &kind);
+    if (!top)
+        return;
 
-    // Add the data to the ringbuffer
-    neighbor_reply = bpf_ringbuf_reserve(&neighbor_ringbuf,
-                                         sizeof(*neighbor_reply), 0);
-    if (!neighbor_reply)
-        goto out;
+#pragma unroll
+    for (i = 0; i < HITTER_SLOTS; i++) {
+        if (top->slots[i].key.words[0] == key->words[0] &&
+            top->slots[i].key.words[1] == key->words[1]) {
+            top->slots[i].count = est;
+            return;
+        }
+        if (top->slots[i].count < top->slots[min].count)
+            min = i;
+    }
+
+    if (est > top->slots[min].count) {
+        top->slots[min].key = *key;
+        top->slots[min].count = est;
+    }
+}
 
-    __builtin_memcpy(neighbor_reply->mac, sender_mac, ETH_ALEN);
-    map_ipv4_to_ipv6(&neighbor_reply->ip, *(__be32 *)sender_ip);
+static __always_inline void hitters_count(
+    struct neighbor_reply *neighbor_reply)
+{
+    struct hitter_key key = {};
 
-    neighbor_reply->in_family = AF_INET;
+    __builtin_memcpy(&key, neighbor_reply->mac, ETH_ALEN);
+    hitter_count(HITTER_MAC, &key);
 
-out:
-    return neighbor_reply;
+    __builtin_memcpy(&key, &neighbor_reply->ip, sizeof(key));
+    hitter_count(HITTER_IP, &key);
+
+    key.words[0] = neighbor_reply->vlan_id;
+    key.words[1] = 0;
+    hitter_count(HITTER_VLAN, &key);
 }
 
+#include "neighsnoopd_parse.h"
+
 static __always_inline struct neighbor_reply *handle_neighbor_reply(
-    void *data, void *data_end)
+    void *data, void *data_end, bool is_tc, __u16 tc_vlan_id)
 {
     struct neighbor_reply *neighbor_reply = NULL;
     struct collect_vlans vlans = { 0 };
     struct ethhdr *eth;
     int eth_type;
+    __u16 vlan_id;
     struct hdr_cursor nh;
     nh.pos = data;
 
     eth_type = parse_ethhdr_vlan(&nh, data_end, &eth, &vlans);
-    if (eth_type == bpf_htons(ETH_P_IPV6))
-        neighbor_reply = handle_nd_reply(&nh, data_end, eth);
-    else if (eth_type == bpf_htons(ETH_P_ARP))
-        neighbor_reply = handle_arp_reply(&nh, data_end);
-    else
+
+    // TC sees the VLAN tag in the skb metadata, XDP only in the packet
+    vlan_id = is_tc ? tc_vlan_id : vlans.id[0];
+    if (vlan_is_filtered(vlan_id))
         goto out;
 
+    neighbor_reply = parse_neighbor_reply(&nh, data_end, eth, eth_type);
     if (!neighbor_reply)
         goto out;
 
-    neighbor_reply->vlan_id = vlans.id[0];
+    neighbor_reply->vlan_id = vlan_id;
+
+    // Floods are counted, but dropped here before they reach userspace
+    if (hitters)
+        hitters_count(neighbor_reply);
+    if (!rate_limit(neighbor_reply, eth->h_source))
+        neighbor_reply = NULL;
 
 out:
     return neighbor_reply;
 }
 
+/*
+ * Neighbors whose replies were suppressed because the kernel already has
+ * them with the snooped MAC. Userspace never sees those replies, so refresh.c
+ * reads when they were last seen from here.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, struct neighbor_key);
+    __type(value, __u64);
+    __uint(max_entries, KNOWN_SEEN_MAX);
+} known_seen SEC(".maps");
+
+/*
+ * The BPF backend turns __builtin_memcmp into a call to memcmp, which
+ * libbpf cannot resolve, so addresses are compared by hand.
+ */
+static __always_inline bool ipv6_addr_equal(const __u32 *a, const __u32 *b)
+{
+    return a[0] == b[0] && a[1] == b[1] && a[2] == b[2] && a[3] == b[3];
+}
+
+static __always_inline bool mac_addr_equal(const __u8 *a, const __u8 *b)
+{
+    for (int i = 0; i < ETH_ALEN; i++) {
+        if (a[i] != b[i])
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Resolve the SVI that has the neighbor on link from the FIB. The lookup is
+ * made in the table of the VLAN's SVI, or of the ingress device for untagged
+ * replies, so that SVIs in a VRF resolve in the VRF's table. A route through
+ * a gateway rewrites the destination to the gateway, which means that the
+ * neighbor is not on link. The SVI is left at 0 when userspace has to search
+ * for it itself, e.g. when forwarding is disabled on the device.
+ *
+ * A successful lookup also returns the MAC of the kernel's neighbor entry.
+ * When it matches an IPv4 reply there is nothing to install, and false is
+ * returned to suppress the reply. IPv6 replies are always passed on, as
+ * userspace replaces their entries to bring STALE, DELAY and PROBE entries
+ * back to REACHABLE, and the lookup does not tell the state.
+ */
+static __always_inline bool lookup_svi(struct __sk_buff *skb,
+                                       struct neighbor_reply *neighbor_reply)
+{
+    struct bpf_fib_lookup params = {};
+    struct neighbor_stats *stats;
+    struct neighbor_key seen = {};
+    __u32 key = neighbor_reply->vlan_id;
+    __u64 now;
+    __u32 *svi;
+    long ret;
+
+    params.ifindex = skb->ifindex;
+    if (key) {
+        svi = bpf_map_lookup_elem(&vlan_svis, &key);
+        if (svi && *svi)
+            params.ifindex = *svi;
+    }
+
+    if (neighbor_reply->in_family == AF_INET) {
+        params.family = AF_INET;
+        __builtin_memcpy(&params.ipv4_dst,
+                         &neighbor_reply->ip.in6_u.u6_addr8[12],
+                         sizeof(params.ipv4_dst));
+    } else {
+        params.family = AF_INET6;
+        __builtin_memcpy(params.ipv6_dst, &neighbor_reply->ip,
+                         sizeof(params.ipv6_dst));
+    }
+
+    key = 0;
+    stats = bpf_map_lookup_elem(&neighbor_stats, &key);
+
+    ret = bpf_fib_lookup(skb, &params, sizeof(params), BPF_FIB_LOOKUP_DIRECT);
+    if (ret != BPF_FIB_LKUP_RET_SUCCESS && ret != BPF_FIB_LKUP_RET_NO_NEIGH)
+        goto fallback;
+
+    if (neighbor_reply->in_family == AF_INET) {
+        if (params.ipv4_dst != neighbor_reply->ip.in6_u.u6_addr32[3])
+            goto fallback;
+    } else if (!ipv6_addr_equal(params.ipv6_dst,
+                                neighbor_reply->ip.in6_u.u6_addr32)) {
+        goto fallback;
+    }
+    neighbor_reply->svi_ifindex = params.ifindex;
+
+    if (ret == BPF_FIB_LKUP_RET_NO_NEIGH) {
+        if (stats)
+            stats->fib_no_neigh++;
+        return true;
+    }
+
+    if (!mac_addr_equal(params.dmac, neighbor_reply->mac)) {
+        if (stats)
+            stats->fib_changed++;
+        return true;
+    }
+
+    if (neighbor_reply->in_family != AF_INET) {
+        if (stats)
+            stats->fib_known_ipv6++;
+        return true;
+    }
+
+    if (stats)
+        stats->fib_known++;
+    seen.ip = neighbor_reply->ip;
+    seen.vlan_id = neighbor_reply->vlan_id;
+    now = bpf_ktime_get_ns();
+    bpf_map_update_elem(&known_seen, &seen, &now, BPF_ANY);
+    return false;
+
+fallback:
+    if (stats)
+        stats->fib_fallback++;
+    return true;
+}
+
 SEC("xdp")
 int handle_neighbor_reply_xdp(struct xdp_md *ctx)
 {
@@ -188,15 +702,17 @@ int handle_neighbor_reply_xdp(struct xdp_md *ctx)
     void *data = (void *)(unsigned long long)ctx->data;
 
     struct neighbor_reply *neighbor_reply = handle_neighbor_reply(data,
-                                                                  data_end);
+                                                                  data_end,
+                                                                  false, 0);
 
     if (!neighbor_reply)
         goto out;
 
     neighbor_reply->ingress_ifindex = ctx->ingress_ifindex;
+    neighbor_reply->svi_ifindex = 0;
 
     // Send the data to userspace
-    bpf_ringbuf_submit(neighbor_reply, 0);
+    neighbor_reply_emit(neighbor_reply);
 out:
     return XDP_PASS;
 }
@@ -207,19 +723,24 @@ int handle_neighbor_reply_tc(struct __sk_buff *skb)
     void *data_end = (void *)(unsigned long long)skb->data_end;
     void *data = (void *)(unsigned long long)skb->data;
 
+    __u16 vlan_id = skb->vlan_present ? skb->vlan_tci & VLAN_VID_MASK : 0;
+
     struct neighbor_reply *neighbor_reply = handle_neighbor_reply(data,
-                                                                  data_end);
+                                                                  data_end,
+                                                                  true,
+                                                                  vlan_id);
 
     if (!neighbor_reply)
         goto out;
 
     neighbor_reply->ingress_ifindex = skb->ifindex;
-
-    neighbor_reply->vlan_id = skb->vlan_present ? skb->vlan_tci
-        & VLAN_VID_MASK : 0;
+    neighbor_reply->svi_ifindex = 0;
+    // Already known to the kernel, userspace would only hit EEXIST
+    if (fib_lookup && !lookup_svi(skb, neighbor_reply))
+        goto out;
 
     // Send the data to userspace
-    bpf_ringbuf_submit(neighbor_reply, 0);
+    neighbor_reply_emit(neighbor_reply);
 out:
     return TC_ACT_OK;
 }
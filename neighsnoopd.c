@@ -14,9 +14,11 @@
 #include <signal.h>
 #include <argp.h>
 #include <time.h>
-#include <ifaddrs.h>
 #include <regex.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/utsname.h>
+#include <limits.h>
 
 #include <linux/bpf.h>
 #include <bpf/bpf.h>
@@ -34,33 +36,39 @@
 
 #include "version.in.h"
 
-struct env env = {0};
+struct env env = {
+    .vlan_depth = VLAN_MAX_DEPTH,
+    .damping = {
+        .half_life_s = DAMPING_HALF_LIFE_DEFAULT,
+        .max_suppress_s = DAMPING_MAX_SUPPRESS_DEFAULT,
+        .suppress = DAMPING_SUPPRESS_DEFAULT,
+        .reuse = DAMPING_REUSE_DEFAULT,
+    },
+};
 
+/*
+ * Per event state. Kept small since it lives on the stack for every reply;
+ * strings are only rendered by the log calls that print them.
+ */
 struct lookup_cache {
     struct neighbor_reply *neighbor_reply;
-    __u8 mac_str[MAC_ADDR_STR_LEN];
-    __u32 ifindex;
-    char ifname[IFNAMSIZ];
-    __u32 link_ifindex;
-    char kind[128];
-    char ip_str[INET6_ADDRSTRLEN];
+    struct link_info *link;
     __u32 cidr;
 
     // FDB
     bool is_ext_learned;
-    bool is_macvlan;
-
-    // Debug information for debug mode only
-    struct {
-        char network_str[INET6_ADDRSTRLEN];
-    } debug;
 };
 
 static volatile sig_atomic_t exiting = 0;
-
-static __u32 nlm_seq;
-struct mnl_socket *nl;
-__u32 mnl_portid;
+static volatile sig_atomic_t dump_stats = 0;
+
+// Event sources in the main loop
+enum poll_source {
+    POLL_RINGBUF,
+    POLL_NL_LINK,
+    POLL_NL_NEIGH,
+    POLL_MAX,
+};
 
 const char *argp_program_version = "neighsnoopd v0.9\n"
     "Build date: " __DATE__ " " __TIME__ "\n" \
@@ -70,172 +78,144 @@ const char *argp_program_bug_address =
         "https://github.com/1984hosting/neighsnoopd";
 
 const char argp_program_doc[] =
-    "Listens for ARP and NA replies and adds the neighbor to the Neighbors"
+    "Listens for ARP and NA replies and adds the neighbor to the Neighbors "
     "table.\n";
 
 static const struct argp_option opts[] = {
     { "ipv4", '4', NULL, 0, "Only handle IPv4 ARP Reply packets", 0 },
     { "ipv6", '6', NULL, 0, "Only handle IPv6 NA packets", 0 },
-    { "count", 'c', "NUM", 0, "This option handles a fixed number of ARP or NA"
-      "replies before terminating the program."
+    { "count", 'c', "NUM", 0, "This option handles a fixed number of ARP or NA "
+      "replies before terminating the program. "
       "Use this for debugging purposes only", 0 },
     { "filter", 'f', "REGEXP", 0,
-      "Filters out interfaces with a regular expression exclude from adding to"
+      "Filters out interfaces with a regular expression exclude from adding to "
       "the neighbor cache. Example: -f '^br0|.*-v0^'", 0 },
-    { "macvlan", 'm', NULL, 0, "Disable filtering macvlan devices from being"
+    { "macvlan", 'm', NULL, 0, "Disable filtering macvlan devices from being "
       "added to the neighbor cache.", 0 },
-    { "no-qfilter-present", 'q', NULL, 0, "Do not replace the present Qdisc"
+    { "no-qfilter-present", 'q', NULL, 0, "Do not replace the present Qdisc "
       "filter if it is present on the Ingress device", 0 },
     { "verbose", 'v', NULL, 0, "Verbose debug output", 0 },
-    { "xdp", 'x', NULL, 0, "Attach XDP instead of TC. This option only works"
+    { "xdp", 'x', NULL, 0, "Attach XDP instead of TC. This option only works "
       "on devices with a VLAN header on the packets available to XDP.", 0},
     { "disable_ipv6ll_filter", 'l', NULL, 0,
       "Disable the default IPv6 link-local filter", 0},
+    { "replay", 'r', "FILE", 0, "Replay the ARP and NA replies in a pcap or "
+      "pcapng file through the pipeline and report the throughput instead of "
+      "attaching to the device", 0 },
+    { "replay-bpf", 'R', NULL, 0, "Parse the replayed frames with the XDP "
+      "program through BPF_PROG_TEST_RUN instead of in userspace", 0 },
+    { "dry-run", 'n', NULL, 0, "Log the neighbors that would be added without "
+      "adding them", 0 },
+    { "mock", 'M', "TABLES", 0, "Replay against an in-process netlink mock "
+      "instead of the kernel. TABLES is svis=N,vid=N,macvlans=N,hosts=N,ext=N,"
+      "events=FILE with every key optional, where FILE scripts the neighbor "
+      "notifications", 0 },
+    { "queue-size", 'Q', "NUM", 0, "Replies held in the work queue before "
+      "refreshes of known neighbors are shed. Default: 4096", 0 },
+    { "vlan-depth", 'd', "NUM", 0, "VLAN tags to parse in the packets: 0 on "
+      "untagged networks, 1 with VLANs and 2 with QinQ. The BPF program is "
+      "specialised for it and for --ipv4 and --ipv6. Default: 2", 0 },
+    { "fib", 'F', NULL, 0, "Resolve the SVI of each reply with a FIB lookup "
+      "in the TC program instead of dumping the addresses. Requires "
+      "forwarding on the SVIs, replies the lookup cannot resolve fall back to "
+      "the dump", 0 },
+    { "install", 'I', "MODE", 0, "How neighbors are installed: 'reachable' "
+      "entries that the daemon refreshes while it snoops replies, or "
+      "'managed' entries that the kernel keeps resolved itself. Managed "
+      "requires Linux 5.16. Default: reachable", 0 },
+    { "rate-limit", 'L', "LIMITS", 0, "Drop the replies over token bucket "
+      "rates in BPF. LIMITS is mac=RATE[/BURST],vlan=RATE[/BURST] in replies "
+      "per second for each source MAC address and VLAN, with every key "
+      "optional. BURST defaults to RATE. Default: no limits", 0 },
+    { "hitters", 'H', NULL, 0, "Count the MAC addresses, IP addresses and "
+      "VLANs that send the most replies in BPF, and print the heaviest of "
+      "the last 10 seconds on SIGUSR1", 0 },
+    { "damping", 'D', "PARAMS", 0, "Hold back the MAC address changes of "
+      "neighbors that flap. PARAMS is 'off' or half-life=S,max-suppress=S,"
+      "suppress=N,reuse=N with every key optional, where each change adds a "
+      "penalty of 1000. Default: half-life=30,max-suppress=300,suppress=2000,"
+      "reuse=750", 0 },
+    { "batch", 'B', "NUM", 0, "Stage up to NUM replies per CPU in BPF and "
+      "send them to userspace as one ring buffer sample, delaying a reply by "
+      "at most 1 ms. NUM is 1-8, requires Linux 5.15 above 1. Default: 1",
+      0 },
+    { "pin", 'P', "DIR", 0, "Pin the ring buffer, and the XDP link, under "
+      "DIR on a BPF filesystem and leave the program attached on an orderly "
+      "exit. The next daemon started with the same DIR takes over the ring "
+      "buffer and replaces the program without losing the replies in "
+      "between, also when it is another version. Not with -q", 0 },
     { NULL, 'h', NULL, OPTION_HIDDEN, "Show the full help", 0 },
     {},
 };
 
+// The prefix length is unknown, and left out, when the FIB found the SVI
+static const char *fmt_cidr(__u32 cidr)
+{
+    static char buf[16];
+
+    if (!cidr)
+        return "";
+    snprintf(buf, sizeof(buf), "/%u", cidr);
+    return buf;
+}
+
 static int add_neigh(struct lookup_cache *cache)
 {
     int err = -1; // the default return value is an error
 
     char buf[MNL_SOCKET_BUFFER_SIZE];
     struct nlmsghdr *nlh;
-    struct ndmsg *ndm;
     struct in6_addr *addr = &cache->neighbor_reply->ip;
-    int ret;
+    __u16 flags;
 
-    nlh = mnl_nlmsg_put_header(buf);
-    nlh->nlmsg_type = RTM_NEWNEIGH;
     if (cache->neighbor_reply->in_family == AF_INET6)
-        nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_REPLACE | NLM_F_ACK;
+        flags = NLM_F_CREATE | NLM_F_REPLACE | NLM_F_ACK;
     else
-        nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_ACK | NLM_F_EXCL;
-    nlh->nlmsg_seq = ++nlm_seq;
-
-    ndm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ndm));
-    ndm->ndm_family = cache->neighbor_reply->in_family;
-    ndm->ndm_state = NUD_REACHABLE;
-    ndm->ndm_ifindex = cache->ifindex;
-
-    // Add IP address
-    if (IN6_IS_ADDR_V4MAPPED(addr)) {
-        struct in_addr ipv4_addr;
-        memcpy(&ipv4_addr, &addr->s6_addr[12], sizeof(ipv4_addr));
-        mnl_attr_put(nlh, NDA_DST, sizeof(ipv4_addr), &ipv4_addr);
-    } else {
-        mnl_attr_put(nlh, NDA_DST, sizeof(*addr), addr);
-    }
-
-    // Add MAC address
-    mnl_attr_put(nlh, NDA_LLADDR, sizeof(cache->neighbor_reply->mac),
-                 cache->neighbor_reply->mac);
+        flags = NLM_F_CREATE | NLM_F_ACK | NLM_F_EXCL;
 
-    // Add VLAN information if needed
-    if (cache->neighbor_reply->vlan_id > 0)
-        mnl_attr_put(nlh, NDA_VLAN, sizeof(cache->neighbor_reply->vlan_id),
-                     &cache->neighbor_reply->vlan_id);
+    nlh = nl_put_neigh(buf, RTM_NEWNEIGH, flags, cache->link->ifindex, addr,
+                       cache->neighbor_reply->mac,
+                       cache->neighbor_reply->vlan_id);
+    // The kernel probes managed neighbors itself before they go stale
+    if (env.managed)
+        mnl_attr_put_u32(nlh, NDA_FLAGS_EXT, NTF_EXT_MANAGED);
 
     pr_debug("Requesting to add neighbor:\n");
-    pr_debug("- Interface %d: %s\n", cache->ifindex, cache->ifname);
-    pr_debug("- IP address: %s\n", cache->ip_str);
-    pr_debug("- MAC address: %s\n", cache->mac_str);
-
-    pr_nl("Sending netlink message\n");
-    pr_nl_nlmsg(nlh, nlm_seq);
-
-    // Send Netlink request update neigh table
-    if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0) {
-        pr_err(errno, "mnl_socket_sendto");
-        goto out;
-    }
-
-    // Parse the response
-    ret = mnl_socket_recvfrom(nl, buf, sizeof(buf));
-    if (ret < 0) {
-        pr_err(errno, "mnl_socket_recvfrom");
-        goto out;
+    pr_debug("- Interface %d: %s\n", cache->link->ifindex,
+             cache->link->ifname);
+    pr_debug("- IP address: %s\n", fmt_ip(addr));
+    pr_debug("- MAC address: %s\n", fmt_mac(cache->neighbor_reply->mac));
+
+    if (env.dry_run) {
+        pr_info("Would add MAC: %s IP: %s%s on interface: %s\n",
+                fmt_mac(cache->neighbor_reply->mac), fmt_ip(addr),
+                fmt_cidr(cache->cidr), cache->link->ifname);
+        return 0;
     }
 
-    pr_nl("Received netlink message\n");
-    pr_nl_nlmsg((struct nlmsghdr *)buf, nlm_seq);
-
-    err = mnl_cb_run(buf, ret, nlm_seq, mnl_portid,
-                     NULL, NULL);
-    if (err < MNL_CB_STOP) {
+    // Send Netlink request update neigh table
+    if (nl_request(NL_SOCK_WRITE, nlh, NULL, NULL)) {
         if (errno == EEXIST) {
             pr_debug("Neighbor already exists in the cache\n");
             goto out;
         }
-        pr_err(errno, "Failed to parse Netlink message");
+        pr_err(errno, "Failed to add neighbor");
         goto out;
     }
 
     err = 0; // Success
-    pr_info("Added MAC: %s IP: %s/%d to FDB on interface: %s\n",
-            cache->mac_str, cache->ip_str, cache->cidr, cache->ifname);
+    pr_info("Added MAC: %s IP: %s%s to FDB on interface: %s\n",
+            fmt_mac(cache->neighbor_reply->mac), fmt_ip(addr),
+            fmt_cidr(cache->cidr), cache->link->ifname);
 
 out:
     return err;
 }
 
-static bool filter_interfaces(char *ifname)
-{
-    int ret;
-    if (!env.has_filter)
-        return false;
-
-    ret = regexec(&env.regex_filter, ifname, 0, NULL, 0);
-    if (ret)
-        return false;
-
-    pr_debug("Filtered interface %s using filter: '%s'\n", ifname,
-             env.regexp_filter_ifname);
-    return true;
-}
-
-static int netlink_recv(struct nlmsghdr *nlh, char *buf, size_t buf_size,
-                        mnl_cb_t parse_nlm_func,
-                        struct lookup_cache *cache)
+static bool filter_interfaces(struct link_info *link)
 {
-    int ret;
-
-    pr_nl("sending netlink message\n");
-    pr_nl_nlmsg(nlh, nlm_seq);
-
-    // Send Netlink request to fetch FDB entries
-    if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0) {
-        pr_err(errno, "mnl_socket_sendto");
-        return false;
-    }
-
-    // Parse the response
-    while ((ret = mnl_socket_recvfrom(nl, buf, buf_size)) > 0) {
-        pr_nl("received netlink message\n");
-        pr_nl_nlmsg((struct nlmsghdr *)buf, nlm_seq);
-
-
-        ret = mnl_cb_run(buf, ret, nlm_seq, mnl_portid, parse_nlm_func,
-                         cache);
-
-        if (nlh->nlmsg_type == NLMSG_DONE)
-            break;
-
-        if (nlh->nlmsg_type == NLMSG_ERROR) {
-            struct nlmsgerr *err = (struct nlmsgerr *)NLMSG_DATA(nlh);
-            if (err->error != 0)
-                pr_err(err->error, "Netlink error");
-
-            break;
-        }
-
-        if (ret < MNL_CB_STOP) {
-            pr_err(errno, "Failed to parse Netlink message");
-            break;
-        }
-    }
-
-    return ret;
+    // The verdict is computed once when the interface appears or is renamed
+    return link_cache_is_filtered(link->ifindex);
 }
 
 static int parse_nlm(const struct nlmsghdr *nlh, size_t nlm_len,
@@ -257,112 +237,190 @@ static int parse_nlm(const struct nlmsghdr *nlh, size_t nlm_len,
     return MNL_CB_OK;
 }
 
-// Extract information about an ifindex using Netlink
-static int getlink_parse_attr_cb(const struct nlattr *attr, void *data)
+// Extract information from the FDB using Netlink
+static int getneigh_parse_attr_cb(const struct nlattr *attr, void *data)
 {
     const struct nlattr **tb = data;
     int type = mnl_attr_get_type(attr);
 
     /* skip unsupported attribute in user-space */
-    if (mnl_attr_type_valid(attr, IFLA_MAX) < 0)
+    if (mnl_attr_type_valid(attr, NDA_MAX) < 0)
         return MNL_CB_OK;
 
     switch(type) {
-        case IFLA_LINK:
-            if (mnl_attr_validate(attr, MNL_TYPE_U32) < 0) {
-                pr_err(errno, "mnl_attr_validate");
-                return MNL_CB_ERROR;
-            }
-            break;
-        case IFLA_LINKINFO:
-            if (mnl_attr_validate(attr, MNL_TYPE_NESTED) < 0) {
-                pr_err(errno, "mnl_attr_validate");
-                return MNL_CB_ERROR;
-            }
+    case NDA_DST:
+    case NDA_LLADDR:
+        if (mnl_attr_validate(attr, MNL_TYPE_BINARY) < 0) {
+            pr_err(errno, "mnl_attr_validate");
+            return MNL_CB_ERROR;
+        }
+        break;
+    case NDA_VLAN:
+        if (mnl_attr_validate(attr, MNL_TYPE_U16) < 0) {
+            pr_err(errno, "mnl_attr_validate");
+            return MNL_CB_ERROR;
+        }
+        break;
+    case NDA_MASTER:
+        if (mnl_attr_validate(attr, MNL_TYPE_U32) < 0) {
+            pr_err(errno, "mnl_attr_validate");
+            return MNL_CB_ERROR;
+        }
+        break;
     }
     tb[type] = attr;
     return MNL_CB_OK;
 }
 
-static int getlink_parse_nlm_cb(const struct nlmsghdr *nlh, void *data)
+static int getneigh_parse_nlm_cb(const struct nlmsghdr *nlh, void *data)
 {
-    struct ifinfomsg *ifm = mnl_nlmsg_get_payload(nlh);
     struct lookup_cache *cache = data;
-    struct nlattr *tb[IFLA_MAX + 1] = {};
+    struct ndmsg *ndm = mnl_nlmsg_get_payload(nlh);
+    struct nlattr *tb[NDA_MAX + 1] = {};
+    const __u8 *fdb_mac = NULL;
 
-    if (nlh->nlmsg_type != RTM_NEWLINK) {
+    if (nlh->nlmsg_type != RTM_NEWNEIGH) {
         pr_err(0, "Unexpected Netlink message type %d, expected %d",
-               nlh->nlmsg_type, RTM_NEWLINK);
+               nlh->nlmsg_type, RTM_NEWNEIGH);
         return MNL_CB_STOP;
     }
 
-    int ret = parse_nlm(nlh, sizeof(*ifm), getlink_parse_attr_cb,
-                  (const struct nlattr **) tb, tb);
-    if (ret < 0)
-        return ret;
+    if (mnl_nlmsg_get_payload_len(nlh) < sizeof(*ndm))
+        return MNL_CB_OK;
 
-    // Add attributes to cache
-    if (tb[IFLA_LINK])
-        cache->link_ifindex = mnl_attr_get_u32(tb[IFLA_LINK]);
+    if (parse_nlm(nlh, sizeof(*ndm), getneigh_parse_attr_cb,
+                  (const struct nlattr **) tb, cache) < 0)
+        return MNL_CB_STOP;
+
+    if (tb[NDA_LLADDR] == NULL ||
+        mnl_attr_get_payload_len(tb[NDA_LLADDR]) != ETH_ALEN)
+        return MNL_CB_OK;
 
-    if (tb[IFLA_LINKINFO]) {
-        struct nlattr *link_attr;
-        mnl_attr_for_each_nested(link_attr, tb[IFLA_LINKINFO]) {
-            if (mnl_attr_get_type(link_attr) == IFLA_INFO_KIND) {
+    fdb_mac = mnl_attr_get_payload(tb[NDA_LLADDR]);
+    if (memcmp(fdb_mac, cache->neighbor_reply->mac,
+               sizeof(cache->neighbor_reply->mac)) != 0)
+        return MNL_CB_OK;
 
-                snprintf(cache->kind, sizeof(cache->kind), "%s",
-                         mnl_attr_get_str(link_attr));
-            }
-        }
-    }
+    // Entries in other VLANs belong to other hosts on a VLAN-aware bridge
+    if (tb[NDA_VLAN] && cache->neighbor_reply->vlan_id &&
+        mnl_attr_get_u16(tb[NDA_VLAN]) != cache->neighbor_reply->vlan_id)
+        return MNL_CB_OK;
 
-    if (strcmp(cache->kind, "macvlan") == 0)
-        cache->is_macvlan = true;
+    // Add attributes to cache
+    if (ndm->ndm_flags & NTF_EXT_LEARNED)
+        cache->is_ext_learned = true;
 
     return MNL_CB_OK;
 }
 
-static bool probe_ifindex(struct lookup_cache *cache)
+/*
+ * Look up the single FDB entry for (MAC, VLAN) on the monitored bridge. This
+ * needs RTM_GETNEIGH support for AF_BRIDGE, which was added in Linux 5.0.
+ * Returns 0 on success or -1 with errno set, where ENOENT means that the
+ * bridge has no entry for the MAC.
+ */
+static int probe_fdb_entry(struct lookup_cache *cache)
 {
     char buf[MNL_SOCKET_BUFFER_SIZE];
     struct nlmsghdr *nlh;
-    struct ifinfomsg *ifm;
-    int ret;
+    struct ndmsg *ndm;
 
     nlh = mnl_nlmsg_put_header(buf);
-    nlh->nlmsg_type = RTM_GETLINK;
+    nlh->nlmsg_type = RTM_GETNEIGH;
     nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-    nlh->nlmsg_seq = ++nlm_seq;
 
-    ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(struct ifinfomsg));
-    ifm->ifi_family = AF_UNSPEC;
-    ifm->ifi_index = cache->ifindex;
+    ndm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ndm));
+    ndm->ndm_family = AF_BRIDGE;
+
+    mnl_attr_put(nlh, NDA_LLADDR, sizeof(cache->neighbor_reply->mac),
+                 cache->neighbor_reply->mac);
+    mnl_attr_put_u32(nlh, NDA_MASTER, env.ifidx_mon);
+    if (cache->neighbor_reply->vlan_id > 0)
+        mnl_attr_put_u16(nlh, NDA_VLAN, cache->neighbor_reply->vlan_id);
+
+    return nl_request(NL_SOCK_QUERY, nlh, getneigh_parse_nlm_cb, cache);
+}
+
+/*
+ * Dump the FDB of the monitored bridge. With strict checking the kernel
+ * applies the NDA_MASTER filter, otherwise it dumps every AF_BRIDGE entry
+ * and the callback does the filtering.
+ */
+static int probe_fdb_dump(struct lookup_cache *cache)
+{
+    char buf[MNL_SOCKET_BUFFER_SIZE];
+    struct nlmsghdr *nlh;
+    struct ndmsg *ndm;
+
+    nlh = mnl_nlmsg_put_header(buf);
+    nlh->nlmsg_type = RTM_GETNEIGH;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | NLM_F_DUMP;
+
+    ndm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ndm));
+    ndm->ndm_family = AF_BRIDGE;
+
+    if (nl_strict_chk(NL_SOCK_QUERY))
+        mnl_attr_put_u32(nlh, NDA_MASTER, env.ifidx_mon);
+
+    return nl_request(NL_SOCK_QUERY, nlh, getneigh_parse_nlm_cb, cache);
+}
 
-    ret = netlink_recv(nlh, buf, sizeof(buf), getlink_parse_nlm_cb, cache);
+static bool probe_fdb(struct lookup_cache *cache)
+{
+    static bool has_fdb_get = true;
+
+    // Query the FDB entry for the specified MAC address
+    if (has_fdb_get && nl_strict_chk(NL_SOCK_QUERY)) {
+        if (!probe_fdb_entry(cache))
+            return true;
+
+        if (errno == ENOENT) {
+            pr_debug("MAC address is not in the FDB\n");
+            return true;
+        }
+
+        if (errno != EOPNOTSUPP && errno != EINVAL) {
+            pr_err(errno, "Failed lookup FDB entry");
+            return false;
+        }
+
+        pr_debug("Kernel does not support FDB entry lookups, using dumps\n");
+        has_fdb_get = false;
+    }
 
-    if (ret < 0) {
-        pr_err(errno, "Failed to lookup interface %s", cache->ifname);
+    if (probe_fdb_dump(cache)) {
+        pr_err(errno, "Failed lookup FDB");
         return false;
     }
 
-    pr_debug("Device %d is of type: %s\n", cache->ifindex, strlen(
-                 cache->kind) ? cache->kind : "unknown");
     return true;
 }
 
-// Extract information from the FDB using Netlink
-static int getneigh_parse_attr_cb(const struct nlattr *attr, void *data)
+// Addresses whose subnet holds the neighbor, collected from an address dump
+#define ADDR_MATCH_MAX 16
+
+struct addr_match {
+    const struct in6_addr *ip;
+    int count;
+    struct {
+        __u32 ifindex;
+        __u8 family;
+        __u8 prefixlen;
+    } addrs[ADDR_MATCH_MAX];
+};
+
+static int getaddr_parse_attr_cb(const struct nlattr *attr, void *data)
 {
     const struct nlattr **tb = data;
     int type = mnl_attr_get_type(attr);
 
     /* skip unsupported attribute in user-space */
-    if (mnl_attr_type_valid(attr, NDA_MAX) < 0)
+    if (mnl_attr_type_valid(attr, IFA_MAX) < 0)
         return MNL_CB_OK;
 
     switch(type) {
-    case NDA_DST:
-    case NDA_LLADDR:
+    case IFA_ADDRESS:
+    case IFA_LOCAL:
         if (mnl_attr_validate(attr, MNL_TYPE_BINARY) < 0) {
             pr_err(errno, "mnl_attr_validate");
             return MNL_CB_ERROR;
@@ -373,237 +431,606 @@ static int getneigh_parse_attr_cb(const struct nlattr *attr, void *data)
     return MNL_CB_OK;
 }
 
-static int getneigh_parse_nlm_cb(const struct nlmsghdr *nlh, void *data)
+static int getaddr_parse_nlm_cb(const struct nlmsghdr *nlh, void *data)
 {
-    struct lookup_cache *cache = data;
-    struct ndmsg *ndm = mnl_nlmsg_get_payload(nlh);
-    struct nlattr *tb[NDA_MAX + 1] = {};
-    const __u8 *fdb_mac = NULL;
+    struct addr_match *match = data;
+    struct ifaddrmsg *ifa = mnl_nlmsg_get_payload(nlh);
+    struct nlattr *tb[IFA_MAX + 1] = {};
+    struct in6_addr addr, netmask, network, given_ip_network;
+    const struct nlattr *attr;
+
+    if (nlh->nlmsg_type != RTM_NEWADDR ||
+        mnl_nlmsg_get_payload_len(nlh) < sizeof(*ifa))
+        return MNL_CB_OK;
 
-    if (nlh->nlmsg_type != RTM_NEWNEIGH) {
-        pr_err(0, "Unexpected Netlink message type %d, expected %d",
-               nlh->nlmsg_type, RTM_NEWNEIGH);
+    if (parse_nlm(nlh, sizeof(*ifa), getaddr_parse_attr_cb,
+                  (const struct nlattr **) tb, match) < 0)
         return MNL_CB_STOP;
-    }
 
-    if (parse_nlm(nlh, sizeof(*ndm), getneigh_parse_attr_cb,
-                  (const struct nlattr **) tb, cache) < 0)
-        return MNL_CB_STOP;
+    // IFA_ADDRESS is the peer on point-to-point links
+    attr = tb[IFA_LOCAL] ? tb[IFA_LOCAL] : tb[IFA_ADDRESS];
+    if (!attr)
+        return MNL_CB_OK;
 
-    if (tb[NDA_LLADDR] == NULL)
+    // Map legacy IPv4 addresses to IPv6
+    if (ifa->ifa_family == AF_INET &&
+        mnl_attr_get_payload_len(attr) == sizeof(struct in_addr)) {
+        __be32 addr4;
+        memcpy(&addr4, mnl_attr_get_payload(attr), sizeof(addr4));
+        map_ipv4_to_ipv6(&addr, addr4);
+    } else if (ifa->ifa_family == AF_INET6 &&
+               mnl_attr_get_payload_len(attr) == sizeof(addr)) {
+        memcpy(&addr, mnl_attr_get_payload(attr), sizeof(addr));
+    } else { // Ignore unknown address families
         return MNL_CB_OK;
+    }
 
-    fdb_mac = mnl_attr_get_payload(tb[NDA_LLADDR]);
-    if (memcmp(fdb_mac, cache->neighbor_reply->mac,
-               sizeof(cache->neighbor_reply->mac)) != 0)
+    // Compare the network addresses
+    calculate_netmask(&netmask, ifa->ifa_family, ifa->ifa_prefixlen);
+    calculate_network_address(&addr, &netmask, &network);
+    calculate_network_address(match->ip, &netmask, &given_ip_network);
+    if (!compare_ipv6_addresses(&network, &given_ip_network))
         return MNL_CB_OK;
 
-    // Add attributes to cache
-    if (ndm->ndm_flags & NTF_EXT_LEARNED)
-        cache->is_ext_learned = true;
+    if (match->count == ADDR_MATCH_MAX)
+        return MNL_CB_OK;
 
+    match->addrs[match->count].ifindex = ifa->ifa_index;
+    match->addrs[match->count].family = ifa->ifa_family;
+    match->addrs[match->count].prefixlen = ifa->ifa_prefixlen;
+    match->count++;
     return MNL_CB_OK;
 }
 
-static bool probe_fdb(struct lookup_cache *cache)
+static bool find_ifindex_from_ip(struct lookup_cache *cache)
 {
-    // Query the FDB entries in AF_BRIDGE for the specified MAC address
     char buf[MNL_SOCKET_BUFFER_SIZE];
     struct nlmsghdr *nlh;
-    struct ndmsg *ndm;
-    int ret;
+    struct ifaddrmsg *ifa;
+    struct in6_addr *given_ip = &cache->neighbor_reply->ip;
+    struct in6_addr netmask, network;
+    struct addr_match match = { .ip = given_ip };
+    struct link_info *link = NULL;
+    int i;
 
+    // Dump the addresses of the neighbor's family only
     nlh = mnl_nlmsg_put_header(buf);
-    nlh->nlmsg_type = RTM_GETNEIGH;
-    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | NLM_F_DUMP;
-    nlh->nlmsg_seq = ++nlm_seq;
-
-    ndm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ndm));
-    ndm->ndm_family = AF_BRIDGE;
+    nlh->nlmsg_type = RTM_GETADDR;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
 
-    ret = netlink_recv(nlh, buf, sizeof(buf), getneigh_parse_nlm_cb, cache);
+    ifa = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifa));
+    ifa->ifa_family = IN6_IS_ADDR_V4MAPPED(given_ip) ? AF_INET : AF_INET6;
 
-    if (ret < 0) {
-        pr_err(errno, "Failed lookup FDB");
+    if (nl_request(NL_SOCK_QUERY, nlh, getaddr_parse_nlm_cb, &match)) {
+        pr_err(errno, "Failed to dump addresses");
         return false;
     }
 
-    return true;
-}
-
-static bool find_ifindex_from_ip(struct lookup_cache *cache)
-{
-    struct ifaddrs *ifaddr, *ifa;
-    struct sockaddr_in6 *addr6, *netmask6;
-    struct sockaddr_in *addr4, *netmask4;
-    struct in6_addr addr, netmask;
-    struct in6_addr *given_ip = &cache->neighbor_reply->ip;
-    struct in6_addr given_ip_network, network;
-    const char* matching_ifname = NULL;
-    __u32 matching_ifindex;
-
-    if (getifaddrs(&ifaddr) == -1)
-        goto err1;
-
-    for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
-        struct lookup_cache getlink_cache = *cache;
-        if (ifa->ifa_addr == NULL || ifa->ifa_netmask == NULL)
-            continue;
-
-        // Map legacy IPv4 addresses to IPv6
-        if (ifa->ifa_addr->sa_family == AF_INET) {
-            // Handle IPv4 to IPv6 mapping
-            addr4 = (struct sockaddr_in *)ifa->ifa_addr;
-            netmask4 = (struct sockaddr_in *)ifa->ifa_netmask;
-            map_ipv4_to_ipv6(&addr, addr4->sin_addr.s_addr);
-            map_ipv4_to_ipv6(&netmask, netmask4->sin_addr.s_addr);
-        } else if (ifa->ifa_addr->sa_family == AF_INET6) {
-            // Handle IPv6 addresses
-            addr6 = (struct sockaddr_in6 *)ifa->ifa_addr;
-            netmask6 = (struct sockaddr_in6 *)ifa->ifa_netmask;
-            addr = addr6->sin6_addr;
-            netmask = netmask6->sin6_addr;
-        } else { // Ignore unknown address families
-            continue;
-        }
-
-        // Calculate the network address
-        calculate_network_address(&addr, &netmask, &network);
-        calculate_network_address(given_ip, &netmask, &given_ip_network);
+    // Links are probed after the dump, which holds the query socket
+    for (i = 0; i < match.count; i++) {
+        link = link_cache_get(match.addrs[i].ifindex);
+        if (!link)
+            link = link_cache_probe(match.addrs[i].ifindex);
 
-        // Compare the network addresses
-        if (!compare_ipv6_addresses(&network, &given_ip_network))
+        if (!link || link->link_ifindex == 0)
             continue;
 
-        getlink_cache.ifindex = if_nametoindex(ifa->ifa_name);
-        if (!getlink_cache.ifindex) {
-            pr_err(errno, "if_nametoindex");
-            continue;
-        }
-
-        probe_ifindex(&getlink_cache);
-
-        if (getlink_cache.link_ifindex == 0)
-            continue;
-
-        if (getlink_cache.link_ifindex != env.ifidx_mon) {
+        if (link->link_ifindex != env.ifidx_mon) {
             pr_debug("Skipping interface %d because it isn't directly"
-                     "connected to %d\n", getlink_cache.link_ifindex,
+                     "connected to %d\n", link->link_ifindex,
                      env.ifidx_mon);
             continue;
         }
 
-        matching_ifname = ifa->ifa_name;
-        *cache = getlink_cache;
         break; // Found a matching interface
     }
 
-    if (!matching_ifname) {
-        pr_debug("No interface found for IP: %s\n", cache->ip_str);
-        goto err2;
+    if (i == match.count) {
+        pr_debug("No interface found for IP: %s\n", fmt_ip(given_ip));
+        return false;
     }
 
-    matching_ifindex = if_nametoindex(matching_ifname);
-    if (!matching_ifindex) {
-        pr_err(errno, "if_nametoindex");
-        goto err2;
-    }
+    cache->link = link;
+    cache->cidr = match.addrs[i].prefixlen;
+
+    calculate_netmask(&netmask, match.addrs[i].family, cache->cidr);
+    calculate_network_address(given_ip, &netmask, &network);
+    pr_debug("Found IP: %s in %s/%d on %s linked to %s\n",
+             fmt_ip(given_ip),
+             fmt_ip(&network),
+             cache->cidr,
+             link->ifname,
+             env.ifidx_mon_str);
+    return true;
+}
 
-    memcpy(cache->ifname, matching_ifname, sizeof(cache->ifname));
-    cache->ifindex = matching_ifindex;
+/*
+ * Takes the SVI that the TC program resolved with a FIB lookup, which saves
+ * the address dump. The prefix length is not known on this path.
+ */
+static bool find_ifindex_from_fib(struct lookup_cache *cache)
+{
+    __u32 ifindex = cache->neighbor_reply->svi_ifindex;
+    struct link_info *link;
 
-    cache->cidr = calculate_cidr(&netmask);
+    link = link_cache_get(ifindex);
+    if (!link)
+        link = link_cache_probe(ifindex);
 
-    if (env.debug) {
-        if (format_ip_address(cache->debug.network_str,
-                              sizeof(cache->debug.network_str), &network)) {
-            pr_err(errno, "format_ip_address");
-            goto err2;
-        }
-        pr_debug("Found IP: %s in %s/%d on %s linked to %s\n",
-                 cache->ip_str,
-                 cache->debug.network_str,
-                 cache->cidr,
-                 cache->ifname,
+    if (!link || link->link_ifindex != env.ifidx_mon) {
+        pr_debug("FIB resolved %s to %d, which isn't linked to %s\n",
+                 fmt_ip(&cache->neighbor_reply->ip), ifindex,
                  env.ifidx_mon_str);
+        return false;
     }
+
+    cache->link = link;
+    pr_debug("FIB resolved %s to %s linked to %s\n",
+             fmt_ip(&cache->neighbor_reply->ip), link->ifname,
+             env.ifidx_mon_str);
     return true;
-err2:
-    freeifaddrs(ifaddr);
-err1:
-    return false;
 }
 
-// Callback function to handle data from the ring buffer
-static int handle_neighbor_reply(void *ctx, void *data, size_t data_sz)
+// Looks up and installs a neighbor taken off the work queue
+static int process_neighbor_reply(struct neighbor_reply *neighbor_reply)
 {
-    struct lookup_cache cache = {0};
-    cache.neighbor_reply = (struct neighbor_reply *)data;
+    struct lookup_cache cache = {
+        .neighbor_reply = neighbor_reply,
+    };
+    struct neigh_entry *neigh;
+    __u64 ts;
 
-    if (env.only_ipv6 && cache.neighbor_reply->in_family != AF_INET6)
+    if (damping_hold(neighbor_reply))
         return 1;
-    else if (env.only_ipv4 && cache.neighbor_reply->in_family != AF_INET)
+
+    ts = replay_stage_start();
+    if (neighbor_reply->svi_ifindex ? !find_ifindex_from_fib(&cache) :
+        !find_ifindex_from_ip(&cache)) {
+        pr_debug("No interface mached destination: filtered\n");
         return 1;
+    }
 
-    env.count--;
+    if (filter_interfaces(cache.link)) {
+        pr_debug("Interface '%s' matches regexp filter: filtered\n",
+                 cache.link->ifname);
+        return 1;
+    }
 
-    pr_debug("Received Neighbor Reply\n");
+    if (cache.link->is_macvlan && !env.disable_macvlan_filter) {
+        pr_debug("Interface '%s' is a macvlan: filtered\n",
+                 cache.link->ifname);
+        return 1;
+    }
+    replay_stage_end(REPLAY_STAGE_LOOKUP, &ts);
 
-    mac_to_string(cache.mac_str, cache.neighbor_reply->mac,
-                  sizeof(cache.mac_str));
+    probe_fdb(&cache);
+    replay_stage_end(REPLAY_STAGE_FDB, &ts);
+    if (cache.is_ext_learned) {
+        pr_debug("MAC address is not connected locally: filtered\n");
+        return 1;
+    }
 
-    if (format_ip_address(cache.ip_str, sizeof(cache.ip_str),
-                          &cache.neighbor_reply->ip)) {
-        pr_err(errno, "format_ip_address");
+    pr_debug("MAC is locally connected. Adding neighbor.\n");
+    neigh = neigh_table_get(&neighbor_reply->ip, neighbor_reply->vlan_id,
+                            false);
+    if (add_neigh(&cache)) {
+        /*
+         * A new MAC address that failed to install, such as an IPv4 one
+         * refused with EEXIST, leaves the old one out of date. Refreshing it
+         * would keep the neighbor pointed at it, so leave the kernel to
+         * resolve the neighbor instead.
+         */
+        if (neigh && neigh->installed &&
+            memcmp(neigh->mac, neighbor_reply->mac, sizeof(neigh->mac))) {
+            pr_debug("Neighbor %s moved, no longer refreshing it\n",
+                     fmt_ip(&neighbor_reply->ip));
+            neigh->installed = false;
+        }
         return 1;
     }
+    replay_stage_end(REPLAY_STAGE_INSTALL, &ts);
+
+    /*
+     * Keep the neighbor reachable for as long as it is being snooped, and
+     * remove it again if its MAC address moves to a remote VTEP. Replies
+     * that were filtered leave the installed MAC address as is.
+     */
+    if (neigh) {
+        neigh->known = true;
+        memcpy(neigh->mac, neighbor_reply->mac, sizeof(neigh->mac));
+        refresh_track(neigh, cache.link->ifindex);
+        reconcile_own(neigh, cache.link->ifindex);
+    }
+
+    // Success
+    return 0;
+}
+
+/*
+ * Handles a reply from the ring buffer, the missed replies map or a capture
+ * file. Replies that pass the cheap filters are queued, see workq.c.
+ */
+static int handle_neighbor_reply(void *ctx, void *data, size_t data_sz)
+{
+    struct neighbor_reply *neighbor_reply = data;
+
+    if (env.only_ipv6 && neighbor_reply->in_family != AF_INET6)
+        return 1;
+    else if (env.only_ipv4 && neighbor_reply->in_family != AF_INET)
+        return 1;
+
+    env.count--;
 
-    pr_debug("Received Neighbor Reply MAC: %s - IP: %s\n", cache.mac_str,
-             cache.ip_str);
+    pr_debug("Received Neighbor Reply MAC: %s - IP: %s\n",
+             fmt_mac(neighbor_reply->mac), fmt_ip(&neighbor_reply->ip));
 
     if (!env.disable_ipv6ll_filter &
-        (cache.neighbor_reply->in_family == AF_INET6)) {
-        if (IN6_IS_ADDR_LINKLOCAL(&cache.neighbor_reply->ip)) {
-            pr_debug("Neighbor IP '%s' is IPv6 link-local: filtered\n", cache.ip_str);
+        (neighbor_reply->in_family == AF_INET6)) {
+        if (IN6_IS_ADDR_LINKLOCAL(&neighbor_reply->ip)) {
+            pr_debug("Neighbor IP '%s' is IPv6 link-local: filtered\n",
+                     fmt_ip(&neighbor_reply->ip));
             return 1;
         }
     }
 
-    if (!find_ifindex_from_ip(&cache)) {
-        pr_debug("No interface mached destination: filtered\n");
+    if (workq_push(neighbor_reply)) {
+        pr_debug("Work queue is full: dropped\n");
         return 1;
     }
+    return 0;
+}
 
-    if (filter_interfaces(cache.ifname)) {
-        pr_debug("Interface '%s' matches regexp filter: filtered\n",
-                 cache.ifname);
-        return 1;
+// Callback function to unpack the records of a ring buffer sample
+static int handle_ringbuf_sample(void *ctx, void *data, size_t data_sz)
+{
+    // A malformed sample must not stop the ring buffer from being consumed
+    record_decode(data, data_sz, handle_neighbor_reply, ctx);
+    return 0;
+}
+
+// Handle RTM_NEWLINK and RTM_DELLINK notifications and dump replies
+static int handle_link_event(const struct nlmsghdr *nlh, void *data)
+{
+    if (nlh->nlmsg_type != RTM_NEWLINK && nlh->nlmsg_type != RTM_DELLINK)
+        return MNL_CB_OK;
+
+    return link_cache_update(nlh);
+}
+
+// Handle RTM_NEWNEIGH and RTM_DELNEIGH notifications and dump replies
+static int handle_neigh_event(const struct nlmsghdr *nlh, void *data)
+{
+    struct ndmsg *ndm = mnl_nlmsg_get_payload(nlh);
+    struct nlattr *tb[NDA_MAX + 1] = {};
+    struct in6_addr ip;
+    const struct nlattr *dst;
+    const __u8 *mac = NULL;
+    bool removed;
+
+    if ((nlh->nlmsg_type != RTM_NEWNEIGH && nlh->nlmsg_type != RTM_DELNEIGH) ||
+        mnl_nlmsg_get_payload_len(nlh) < sizeof(*ndm))
+        return MNL_CB_OK;
+
+    pr_debug("Neighbor on %d family %d %s\n", ndm->ndm_ifindex,
+             ndm->ndm_family,
+             nlh->nlmsg_type == RTM_DELNEIGH ? "removed" : "changed");
+
+    if (ndm->ndm_family != AF_INET && ndm->ndm_family != AF_INET6 &&
+        ndm->ndm_family != AF_BRIDGE)
+        return MNL_CB_OK;
+
+    if (mnl_attr_parse(nlh, sizeof(*ndm), getneigh_parse_attr_cb, tb) < 0)
+        return MNL_CB_OK;
+
+    if (tb[NDA_LLADDR] && mnl_attr_get_payload_len(tb[NDA_LLADDR]) == ETH_ALEN)
+        mac = mnl_attr_get_payload(tb[NDA_LLADDR]);
+
+    // A MAC address on the monitored bridge that moved to a remote VTEP
+    if (ndm->ndm_family == AF_BRIDGE) {
+        if (nlh->nlmsg_type == RTM_NEWNEIGH && mac && tb[NDA_MASTER] &&
+            mnl_attr_get_u32(tb[NDA_MASTER]) == (__u32)env.ifidx_mon)
+            reconcile_fdb_event(mac, tb[NDA_VLAN] ?
+                                mnl_attr_get_u16(tb[NDA_VLAN]) : 0,
+                                ndm->ndm_flags & NTF_EXT_LEARNED);
+        return MNL_CB_OK;
     }
 
-    if (cache.is_macvlan && !env.disable_macvlan_filter) {
-        pr_debug("Interface '%s' is a macvlan: filtered\n", cache.ifname);
-        return 1;
+    dst = tb[NDA_DST];
+    if (!dst)
+        return MNL_CB_OK;
+
+    if (ndm->ndm_family == AF_INET &&
+        mnl_attr_get_payload_len(dst) == sizeof(struct in_addr)) {
+        __be32 addr4;
+        memcpy(&addr4, mnl_attr_get_payload(dst), sizeof(addr4));
+        map_ipv4_to_ipv6(&ip, addr4);
+    } else if (ndm->ndm_family == AF_INET6 &&
+               mnl_attr_get_payload_len(dst) == sizeof(ip)) {
+        memcpy(&ip, mnl_attr_get_payload(dst), sizeof(ip));
+    } else {
+        return MNL_CB_OK;
     }
 
-    probe_fdb(&cache);
-    if (cache.is_ext_learned) {
-        pr_debug("MAC address is not connected locally: filtered\n");
-        return 1;
+    // Neighbors that are gone or failed resolution are no longer refreshed
+    removed = nlh->nlmsg_type == RTM_DELNEIGH ||
+        (ndm->ndm_state & NUD_FAILED);
+    if (removed)
+        refresh_forget(&ip, ndm->ndm_ifindex);
+    reconcile_neigh_event(&ip, ndm->ndm_ifindex, removed ? NULL : mac,
+                          ndm->ndm_flags & NTF_EXT_LEARNED);
+    if (nlh->nlmsg_type == RTM_DELNEIGH)
+        neigh_table_forget(&ip, ndm->ndm_ifindex);
+    return MNL_CB_OK;
+}
+
+static int neightbl_parse_attr_cb(const struct nlattr *attr, void *data)
+{
+    const struct nlattr **tb = data;
+    int type = mnl_attr_get_type(attr);
+
+    if (mnl_attr_type_valid(attr, NDTA_MAX) < 0)
+        return MNL_CB_OK;
+
+    if (type == NDTA_PARMS && mnl_attr_validate(attr, MNL_TYPE_NESTED) < 0)
+        return MNL_CB_OK;
+    tb[type] = attr;
+    return MNL_CB_OK;
+}
+
+static int neightbl_parse_parms_cb(const struct nlattr *attr, void *data)
+{
+    const struct nlattr **tb = data;
+    int type = mnl_attr_get_type(attr);
+
+    if (mnl_attr_type_valid(attr, NDTPA_MAX) < 0)
+        return MNL_CB_OK;
+
+    switch (type) {
+    case NDTPA_IFINDEX:
+        if (mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
+            return MNL_CB_OK;
+        break;
+    case NDTPA_BASE_REACHABLE_TIME:
+        if (mnl_attr_validate(attr, MNL_TYPE_U64) < 0)
+            return MNL_CB_OK;
+        break;
     }
+    tb[type] = attr;
+    return MNL_CB_OK;
+}
 
-    pr_debug("MAC is locally connected. Adding neighbor.\n");
-    if (add_neigh(&cache))
-        return 1;
+// Handle RTM_NEWNEIGHTBL dump replies, which carry the reachable times
+static int handle_neightbl_event(const struct nlmsghdr *nlh, void *data)
+{
+    struct ndtmsg *ndtm = mnl_nlmsg_get_payload(nlh);
+    struct nlattr *tb[NDTA_MAX + 1] = {};
+    struct nlattr *parms[NDTPA_MAX + 1] = {};
+    __u32 ifindex = 0;
 
-    // Success
+    if (nlh->nlmsg_type != RTM_NEWNEIGHTBL ||
+        mnl_nlmsg_get_payload_len(nlh) < sizeof(*ndtm))
+        return MNL_CB_OK;
+
+    if (mnl_attr_parse(nlh, sizeof(*ndtm), neightbl_parse_attr_cb, tb) < 0 ||
+        !tb[NDTA_PARMS])
+        return MNL_CB_OK;
+
+    if (mnl_attr_parse_nested(tb[NDTA_PARMS], neightbl_parse_parms_cb,
+                              parms) < 0 ||
+        !parms[NDTPA_BASE_REACHABLE_TIME])
+        return MNL_CB_OK;
+
+    // The table defaults carry no interface index
+    if (parms[NDTPA_IFINDEX])
+        ifindex = mnl_attr_get_u32(parms[NDTPA_IFINDEX]);
+
+    refresh_set_reachable(ndtm->ndtm_family, ifindex,
+                          mnl_attr_get_u64(parms[NDTPA_BASE_REACHABLE_TIME]));
+    return MNL_CB_OK;
+}
+
+/*
+ * Re-dump the state behind a monitor socket through the query socket. This is
+ * used for the initial sync and whenever a monitor socket overruns.
+ */
+static int resync_links(void)
+{
+    char buf[MNL_SOCKET_BUFFER_SIZE];
+    struct nlmsghdr *nlh;
+    struct ifinfomsg *ifm;
+
+    pr_debug("Resynchronizing links\n");
+
+    // Links removed during an overrun must not linger in the cache
+    link_cache_flush();
+
+    nlh = mnl_nlmsg_put_header(buf);
+    nlh->nlmsg_type = RTM_GETLINK;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+
+    ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
+    ifm->ifi_family = AF_UNSPEC;
+
+    if (nl_request(NL_SOCK_QUERY, nlh, handle_link_event, NULL)) {
+        pr_err(errno, "Failed to dump links");
+        return -1;
+    }
+    return 0;
+}
+
+static int resync_neighbors(void)
+{
+    char buf[MNL_SOCKET_BUFFER_SIZE];
+    struct nlmsghdr *nlh;
+    struct ndmsg *ndm;
+
+    pr_debug("Resynchronizing neighbors\n");
+
+    nlh = mnl_nlmsg_put_header(buf);
+    nlh->nlmsg_type = RTM_GETNEIGH;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+
+    ndm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ndm));
+    ndm->ndm_family = AF_UNSPEC;
+
+    if (nl_request(NL_SOCK_QUERY, nlh, handle_neigh_event, NULL)) {
+        pr_err(errno, "Failed to dump neighbors");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Dump the ARP and ND tables for the base reachable times of the SVIs. The
+ * times are kept in the link cache, so this follows every link resync.
+ */
+static int resync_neigh_tables(void)
+{
+    char buf[MNL_SOCKET_BUFFER_SIZE];
+    struct nlmsghdr *nlh;
+    struct ndtmsg *ndtm;
+
+    pr_debug("Resynchronizing neighbor tables\n");
+
+    nlh = mnl_nlmsg_put_header(buf);
+    nlh->nlmsg_type = RTM_GETNEIGHTBL;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+
+    ndtm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ndtm));
+    ndtm->ndtm_family = AF_UNSPEC;
+
+    if (nl_request(NL_SOCK_QUERY, nlh, handle_neightbl_event, NULL)) {
+        pr_err(errno, "Failed to dump neighbor tables, using defaults");
+        return -1;
+    }
     return 0;
 }
 
+static void handle_netlink_monitor(enum nl_sock_role role)
+{
+    mnl_cb_t cb = role == NL_SOCK_MON_LINK ? handle_link_event :
+        handle_neigh_event;
+
+    if (!nl_mon_recv(role, cb, NULL) || errno != ENOBUFS)
+        return;
+
+    // Notifications were lost, so rebuild the state from a fresh dump
+    if (role == NL_SOCK_MON_LINK && !resync_links())
+        resync_neigh_tables();
+    else if (role == NL_SOCK_MON_NEIGH)
+        resync_neighbors();
+}
+
+// The timers of the main loop that replay runs on the capture clock
+static void replay_tick(void)
+{
+    handle_netlink_monitor(NL_SOCK_MON_NEIGH);
+    reconcile_run();
+    damping_run();
+}
+
 static void sig_handler(int sig)
 {
     exiting = true;
 }
 
+static void sig_stats_handler(int sig)
+{
+    dump_stats = true;
+}
+
+static void bpf_print_stats(void)
+{
+    struct neighbor_stats total;
+
+    if (overflow_read_stats(&total)) {
+        pr_err(errno, "Failed to read the BPF counters");
+        return;
+    }
+
+    pr_info("BPF: %llu replies, %llu found the ring buffer full\n",
+            total.replies, total.ringbuf_drops);
+    if (env.fib)
+        pr_info("FIB: %llu known and suppressed, %llu known IPv6 passed on, "
+                "%llu without a neighbor, %llu changed, %llu fallbacks\n",
+                total.fib_known, total.fib_known_ipv6, total.fib_no_neigh,
+                total.fib_changed, total.fib_fallback);
+    if (env.rate_limit.mac_rate || env.rate_limit.vlan_rate)
+        pr_info("Rate limit: %llu over the MAC rate, %llu over the VLAN "
+                "rate\n", total.rate_mac, total.rate_vlan);
+}
+
+// The soonest of the timers of the main loop, or -1 when none is set
+static int poll_timeout(void)
+{
+    int timeouts[] = { refresh_timeout(), overflow_timeout(),
+                       hitters_timeout(), damping_timeout() };
+    int timeout = -1;
+
+    for (size_t i = 0; i < sizeof(timeouts) / sizeof(*timeouts); i++) {
+        if (timeouts[i] >= 0 && (timeout < 0 || timeouts[i] < timeout))
+            timeout = timeouts[i];
+    }
+    return timeout;
+}
+
+/*
+ * Whether a pinned link is an XDP link on the monitored device. A link whose
+ * device went away stays pinned but detached, with an ifindex of 0.
+ */
+static bool xdp_link_usable(struct bpf_link *link)
+{
+    struct bpf_link_info info = {};
+    __u32 len = sizeof(info);
+
+    if (bpf_obj_get_info_by_fd(bpf_link__fd(link), &info, &len))
+        return false;
+    return info.type == BPF_LINK_TYPE_XDP &&
+           info.xdp.ifindex == (__u32)env.ifidx_mon;
+}
+
+/*
+ * Attaches the XDP program. With --pin the link is pinned so that the
+ * program stays attached after the daemon exits, and a link pinned by a
+ * previous daemon on the same device is updated to the new program in
+ * place. Any other pinned link is unpinned, which detaches it, and the
+ * program is attached anew.
+ */
+static struct bpf_link *attach_xdp(struct bpf_program *prog)
+{
+    char path[PATH_MAX];
+    struct bpf_link *link;
+
+    if (!env.pin_dir)
+        return bpf_program__attach_xdp(prog, env.ifidx_mon);
+
+    snprintf(path, sizeof(path), "%s/xdp_link", env.pin_dir);
+    link = bpf_link__open(path);
+    if (link) {
+        if (!xdp_link_usable(link)) {
+            pr_info("Replacing the XDP link pinned at %s, it is not "
+                    "attached to %s\n", path, env.ifidx_mon_str);
+        } else if (!bpf_link__update_program(link, prog)) {
+            pr_info("Took over the XDP link pinned at %s\n", path);
+            return link;
+        } else {
+            pr_err(errno, "Failed to update the XDP link pinned at %s", path);
+        }
+
+        if (bpf_link__unpin(link))
+            pr_err(errno, "Failed to unpin the XDP link at %s", path);
+        bpf_link__destroy(link);
+    }
+
+    link = bpf_program__attach_xdp(prog, env.ifidx_mon);
+    if (link && bpf_link__pin(link, path)) {
+        pr_err(errno, "Failed to pin the XDP link at %s", path);
+        bpf_link__destroy(link);
+        return NULL;
+    }
+    return link;
+}
+
 static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va_list args)
 {
     if (level == LIBBPF_DEBUG && !env.debug)
@@ -611,9 +1038,50 @@ static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va
     return vfprintf(stderr, format, args);
 }
 
+// Parses mac=RATE[/BURST],vlan=RATE[/BURST] of --rate-limit
+static int parse_rate_limit(struct rate_limit *limit, const char *arg)
+{
+    char *const keys[] = { "mac", "vlan", NULL };
+    __u32 *rates[] = { &limit->mac_rate, &limit->vlan_rate };
+    __u32 *bursts[] = { &limit->mac_burst, &limit->vlan_burst };
+    char *opts = strdup(arg);
+    char *subopts = opts;
+    char *value, *end;
+    int err = 0;
+
+    if (!opts)
+        return -1;
+
+    while (*subopts) {
+        int key = getsubopt(&subopts, keys, &value);
+        unsigned long rate, burst;
+
+        if (key < 0 || !value) {
+            err = -1;
+            break;
+        }
+
+        rate = strtoul(value, &end, 0);
+        burst = rate;
+        if (*end == '/')
+            burst = strtoul(end + 1, &end, 0);
+        // The rate is kept as nanoseconds between replies
+        if (*end || !rate || !burst || rate > 1000000000 ||
+            burst > 1000000000) {
+            err = -1;
+            break;
+        }
+        *rates[key] = rate;
+        *bursts[key] = burst;
+    }
+    free(opts);
+    return err;
+}
+
 static error_t parse_arg(int key, char *arg, struct argp_state *state)
 {
     static int pos_args;
+    char *end;
 
     switch (key) {
         case 'h':
@@ -669,6 +1137,79 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
         case 'x':
             env.is_xdp = true;
             break;
+        case 'r':
+            env.replay_file = arg;
+            break;
+        case 'R':
+            env.replay_bpf = true;
+            break;
+        case 'n':
+            env.dry_run = true;
+            break;
+        case 'Q':
+            env.queue_size = strtoul(arg, NULL, 0);
+            if (env.queue_size < 4 || env.queue_size > (1 << 20)) {
+                fprintf(stderr, "Invalid queue size: %s\n", arg);
+                argp_usage(state);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'd':
+            env.vlan_depth = strtoul(arg, &end, 0);
+            if (*end || env.vlan_depth > VLAN_MAX_DEPTH) {
+                fprintf(stderr, "Invalid VLAN depth: %s\n", arg);
+                argp_usage(state);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'F':
+            env.fib = true;
+            break;
+        case 'I':
+            if (!strcmp(arg, "managed")) {
+                env.managed = true;
+            } else if (strcmp(arg, "reachable")) {
+                fprintf(stderr, "Invalid install mode: %s\n", arg);
+                argp_usage(state);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'L':
+            if (parse_rate_limit(&env.rate_limit, arg)) {
+                fprintf(stderr, "Invalid rate limit: %s\n", arg);
+                argp_usage(state);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'H':
+            env.hitters = true;
+            break;
+        case 'B':
+            env.batch = strtoul(arg, NULL, 0);
+            if (env.batch < 1 || env.batch > REPLY_BATCH_MAX) {
+                fprintf(stderr, "Invalid batch size: %s\n", arg);
+                argp_usage(state);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'P':
+            env.pin_dir = arg;
+            break;
+        case 'D':
+            if (damping_parse_config(&env.damping, arg)) {
+                fprintf(stderr, "Invalid damping parameters: %s\n", arg);
+                argp_usage(state);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'M':
+            if (nl_mock_parse_config(&env.mock_config, arg)) {
+                fprintf(stderr, "Invalid mock tables: %s\n", arg);
+                argp_usage(state);
+                exit(EXIT_FAILURE);
+            }
+            env.mock = true;
+            break;
         case ARGP_KEY_NO_ARGS:
             fprintf(stderr, "Missing network device <IFNAME_MON>\n");
             argp_usage(state);
@@ -679,14 +1220,35 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
                 argp_usage(state);
                 exit(EXIT_FAILURE);
             }
-            env.ifidx_mon = if_nametoindex(arg);
+            strncpy(env.ifidx_mon_str, arg, sizeof(env.ifidx_mon_str) - 1);
+            pos_args++;
+            break;
+        case ARGP_KEY_END:
+            if (env.fib && env.is_xdp) {
+                fprintf(stderr, "--fib can only be used with TC\n");
+                argp_usage(state);
+                exit(EXIT_FAILURE);
+            }
+            // Taking over the pinned TC filter replaces it
+            if (env.pin_dir && env.fail_on_qfilter_present) {
+                fprintf(stderr, "--pin can not be used with -q\n");
+                argp_usage(state);
+                exit(EXIT_FAILURE);
+            }
+            if (env.mock && !env.replay_file) {
+                fprintf(stderr, "--mock can only be used with --replay\n");
+                argp_usage(state);
+                exit(EXIT_FAILURE);
+            }
+            // The mock creates the device, see main()
+            if (env.mock || !pos_args)
+                break;
+            env.ifidx_mon = if_nametoindex(env.ifidx_mon_str);
             if (!env.ifidx_mon) {
                 perror("Invalid network device");
                 argp_usage(state);
                 exit(EXIT_FAILURE);
             }
-            strncpy(env.ifidx_mon_str, arg, sizeof(env.ifidx_mon_str));
-            pos_args++;
             break;
         default:
             return ARGP_ERR_UNKNOWN;
@@ -694,6 +1256,20 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
     return 0;
 }
 
+/*
+ * Older kernels ignore the NDA_FLAGS_EXT attribute instead of rejecting it,
+ * which would leave the neighbors to go stale, so check the release.
+ */
+static bool kernel_has_managed_neighbors(void)
+{
+    struct utsname uts;
+    int major, minor;
+
+    if (uname(&uts) || sscanf(uts.release, "%d.%d", &major, &minor) != 2)
+        return false;
+    return major > 5 || (major == 5 && minor >= 16);
+}
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-function"
 // This function is references by argp and not from this code
@@ -707,6 +1283,7 @@ static void short_usage(FILE *fp, struct argp_state *state)
 int main(int argc, char **argv)
 {
     struct neighsnoopd_bpf *skel;
+    bool keep_attached = false;
     int err;
     static const struct argp argp = {
         .options = opts,
@@ -715,8 +1292,6 @@ int main(int argc, char **argv)
         .args_doc = "<IFNAME_MON>",
     };
 
-    nlm_seq = time(NULL);
-
     err = argp_parse(&argp, argc, argv, 0, NULL, NULL);
     if (err)
         goto cleanup1;
@@ -732,18 +1307,50 @@ int main(int argc, char **argv)
 
     libbpf_set_print(libbpf_print_fn);
 
-    nl = mnl_socket_open(NETLINK_ROUTE);
-    if (nl == NULL) {
-        err = errno;
-        perror("mnl_socket_open");
+    if (env.managed && !env.mock && !kernel_has_managed_neighbors()) {
+        pr_info("The kernel has no managed neighbors, installing reachable "
+                "neighbors instead\n");
+        env.managed = false;
+    }
+
+    if (workq_init(env.queue_size ? env.queue_size : WORKQ_SIZE_DEFAULT,
+                   process_neighbor_reply)) {
+        pr_err(errno, "Failed to allocate the work queue");
+        err = EXIT_FAILURE;
+        goto cleanup1;
+    }
+    damping_init(process_neighbor_reply);
+
+    if (env.mock) {
+        env.ifidx_mon = nl_mock_setup(&env.mock_config, env.ifidx_mon_str);
+        if (env.ifidx_mon < 0) {
+            pr_err(errno, "Failed to set up the netlink mock");
+            err = EXIT_FAILURE;
+            goto cleanup1;
+        }
+    }
+
+    if (nl_open_sockets()) {
+        err = EXIT_FAILURE;
         goto cleanup1;
     }
-    mnl_portid = mnl_socket_get_portid(nl);
-    pr_nl("MNL port ID: %d\n", mnl_portid);
 
-    if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0) {
-        err = -errno;
-        perror("mnl_socket_bind");
+    if (resync_links() || resync_neighbors()) {
+        err = EXIT_FAILURE;
+        goto cleanup2;
+    }
+    resync_neigh_tables();
+
+    if (env.replay_file && signal(SIGINT, sig_handler) == SIG_ERR) {
+        err = errno;
+        perror("Can't set signal handler");
+        goto cleanup2;
+    }
+
+    // Userspace replay runs the pipeline without loading BPF
+    if (env.replay_file && !env.replay_bpf) {
+        err = replay_run(env.replay_file, handle_neighbor_reply, replay_tick,
+                         -1, -1, &exiting) ? EXIT_FAILURE : 0;
         goto cleanup2;
     }
 
@@ -755,6 +1362,58 @@ int main(int argc, char **argv)
         goto cleanup2;
     }
 
+    // The verifier prunes the branches the options rule out
+    skel->rodata->snoop_ipv4 = !env.only_ipv6;
+    skel->rodata->snoop_ipv6 = !env.only_ipv4;
+    skel->rodata->vlan_depth = env.vlan_depth;
+    // TC gets the outer tag from the skb metadata instead of the packet
+    if (!env.is_xdp && !env.replay_file && env.vlan_depth)
+        skel->rodata->vlan_depth--;
+    skel->rodata->fib_lookup = env.fib;
+    skel->rodata->hitters = env.hitters;
+
+    // A burst of N replies may arrive N - 1 intervals early
+    if (env.rate_limit.mac_rate) {
+        skel->rodata->mac_interval_ns = 1000000000ULL /
+            env.rate_limit.mac_rate;
+        skel->rodata->mac_burst_ns = skel->rodata->mac_interval_ns *
+            (env.rate_limit.mac_burst - 1);
+    }
+    if (env.rate_limit.vlan_rate) {
+        skel->rodata->vlan_interval_ns = 1000000000ULL /
+            env.rate_limit.vlan_rate;
+        skel->rodata->vlan_burst_ns = skel->rodata->vlan_interval_ns *
+            (env.rate_limit.vlan_burst - 1);
+    }
+
+    // Test runs read the ring buffer after each frame, so replay unbatched
+    if (env.batch > 1 && !env.replay_file) {
+        skel->rodata->batch_replies = env.batch;
+        bpf_map__set_max_entries(skel->maps.reply_stages,
+                                 libbpf_num_possible_cpus());
+    } else {
+        // Its timers need Linux 5.15, and the verifier prunes the stage
+        bpf_map__set_autocreate(skel->maps.reply_stages, false);
+    }
+
+    /*
+     * Reuse the ring buffer a previous daemon pinned. Its program keeps
+     * writing to it until it is replaced below, and record.c reads the
+     * records of any ABI version.
+     */
+    if (env.pin_dir && !env.replay_file) {
+        char path[PATH_MAX];
+
+        snprintf(path, sizeof(path), "%s/neighbor_ringbuf", env.pin_dir);
+        if (!access(path, F_OK))
+            pr_info("Taking over the ring buffer pinned at %s\n", path);
+        if (bpf_map__set_pin_path(skel->maps.neighbor_ringbuf, path)) {
+            pr_err(errno, "Failed to pin the ring buffer at %s", path);
+            err = EXIT_FAILURE;
+            goto cleanup2;
+        }
+    }
+
     err = neighsnoopd_bpf__load(skel);
     if (err) {
         perror("Failed to load BPF skeleton\n");
@@ -762,6 +1421,26 @@ int main(int argc, char **argv)
         goto cleanup2;
     }
 
+    // Let the BPF program drop replies for filtered interfaces
+    if (link_cache_attach_bpf(bpf_map__fd(skel->maps.filtered_ifindexes),
+                              bpf_map__fd(skel->maps.vlan_svis))) {
+        err = EXIT_FAILURE;
+        goto cleanup3;
+    }
+
+    // Sightings of the replies that the FIB lookup suppresses
+    if (env.fib)
+        refresh_attach_bpf(bpf_map__fd(skel->maps.known_seen));
+
+    // Replay through the XDP program, which sees VLAN tags in the packet
+    if (env.replay_file) {
+        err = replay_run(env.replay_file, handle_neighbor_reply, replay_tick,
+                         bpf_program__fd(skel->progs.handle_neighbor_reply_xdp),
+                         bpf_map__fd(skel->maps.neighbor_ringbuf),
+                         &exiting) ? EXIT_FAILURE : 0;
+        goto cleanup3;
+    }
+
     // XDP
     struct bpf_link *xdp_link;
 
@@ -781,8 +1460,7 @@ int main(int argc, char **argv)
     bool hook_created = false;
     if (env.is_xdp) {
         // attach xdp program to interface
-        xdp_link = bpf_program__attach_xdp(
-            skel->progs.handle_neighbor_reply_xdp, env.ifidx_mon);
+        xdp_link = attach_xdp(skel->progs.handle_neighbor_reply_xdp);
         if (!xdp_link) {
             perror("Failed to attach XDP hook");
             goto cleanup3;
@@ -813,36 +1491,151 @@ int main(int argc, char **argv)
         bpf_object__find_map_by_name(skel->obj, "neighbor_ringbuf");
 
     struct ring_buffer *rb = ring_buffer__new(bpf_map__fd(ringbuf_map),
-                                              handle_neighbor_reply, NULL, NULL);
+                                              handle_ringbuf_sample, NULL,
+                                              NULL);
     if (!rb) {
         fprintf(stderr, "Failed to create ring buffer");
         goto cleanup5;
     }
 
-    if (signal(SIGINT, sig_handler) == SIG_ERR) {
+    // Replies that find the ring buffer full are recovered from a map
+    if (overflow_attach(bpf_map__fd(skel->maps.neighbor_stats),
+                        bpf_map__fd(skel->maps.missed_replies),
+                        bpf_map__fd(skel->maps.missed_pending),
+                        handle_neighbor_reply)) {
+        err = errno;
+        pr_err(errno, "Failed to watch the ring buffer drops");
+        goto cleanup6;
+    }
+
+    if (env.hitters && hitters_attach(bpf_map__fd(skel->maps.hitter_sketch),
+                                      bpf_map__fd(skel->maps.hitter_top))) {
+        err = errno;
+        pr_err(errno, "Failed to read the heavy hitters");
+        goto cleanup6;
+    }
+
+    if (signal(SIGINT, sig_handler) == SIG_ERR ||
+        signal(SIGUSR1, sig_stats_handler) == SIG_ERR) {
         err = errno;
         perror("Can't set signal handler");
         goto cleanup6;
     }
 
+    // Wait on the ring buffer and the netlink monitor sockets together
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        err = errno;
+        perror("epoll_create1");
+        goto cleanup6;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.u32 = POLL_RINGBUF;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ring_buffer__epoll_fd(rb), &ev)) {
+        err = errno;
+        perror("epoll_ctl ring buffer");
+        goto cleanup7;
+    }
+    ev.data.u32 = POLL_NL_LINK;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, nl_sock_fd(NL_SOCK_MON_LINK), &ev)) {
+        err = errno;
+        perror("epoll_ctl link monitor");
+        goto cleanup7;
+    }
+    ev.data.u32 = POLL_NL_NEIGH;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, nl_sock_fd(NL_SOCK_MON_NEIGH), &ev)) {
+        err = errno;
+        perror("epoll_ctl neighbor monitor");
+        goto cleanup7;
+    }
+
     // Main loop
+    bool failed = false;
     while (!exiting) {
-        int err = ring_buffer__poll(rb, -1);
-        if (err < 0) {
-            fprintf(stderr, "Error polling ring buffer");
+        struct epoll_event events[POLL_MAX];
+        int n;
+
+        if (dump_stats) {
+            dump_stats = false;
+            bpf_print_stats();
+            record_print_stats();
+            workq_print_stats();
+            refresh_print_stats();
+            reconcile_print_stats();
+            overflow_print_stats();
+            hitters_print_stats();
+            damping_print_stats();
+        }
+
+        // Only block while there is no queued work, refresh or poll due
+        n = epoll_wait(epoll_fd, events, POLL_MAX,
+                       workq_depth() ? 0 : poll_timeout());
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            failed = true;
             break;
         }
-        if (env.has_count && env.count == 0)
+
+        for (int i = 0; i < n; i++) {
+            switch (events[i].data.u32) {
+            case POLL_RINGBUF:
+                if (ring_buffer__consume(rb) < 0)
+                    fprintf(stderr, "Error consuming ring buffer");
+                break;
+            case POLL_NL_LINK:
+                handle_netlink_monitor(NL_SOCK_MON_LINK);
+                break;
+            case POLL_NL_NEIGH:
+                handle_netlink_monitor(NL_SOCK_MON_NEIGH);
+                break;
+            }
+        }
+
+        // The ring buffer is drained first, so the queue sees all pressure
+        overflow_run();
+        workq_run(WORKQ_BATCH);
+        refresh_run();
+        reconcile_run();
+        hitters_run();
+        damping_run();
+        if (env.has_count && env.count <= 0 && !workq_depth())
             break;
     }
     err = 0;
+    // Only an orderly shutdown leaves the program to the next daemon
+    keep_attached = env.pin_dir && !failed;
+    bpf_print_stats();
+    record_print_stats();
+    workq_print_stats();
+    refresh_print_stats();
+    reconcile_print_stats();
+    overflow_print_stats();
+    hitters_print_stats();
+    damping_print_stats();
 
     // Cleanup
+cleanup7:
+    close(epoll_fd);
 cleanup6:
     ring_buffer__free(rb);
     close(bpf_map__fd(ringbuf_map));
 cleanup5:
     tc_opts.flags = tc_opts.prog_fd = tc_opts.prog_id = 0;
+    // The next daemon replaces the program, see --pin
+    if (keep_attached) {
+        pr_info("Leaving the program attached, pinned under %s\n",
+                env.pin_dir);
+        goto cleanup3;
+    }
+    if (env.is_xdp && env.pin_dir) {
+        pr_debug("Unpinning the XDP link\n");
+        if (bpf_link__unpin(xdp_link))
+            perror("Failed to unpin the XDP link");
+        bpf_link__destroy(xdp_link);
+    }
     if (!env.is_xdp) {
         pr_debug("Detaching the TC hook\n");
         err = bpf_tc_detach(&tc_hook, &tc_opts);
@@ -859,7 +1652,13 @@ cleanup4:
 cleanup3:
     neighsnoopd_bpf__destroy(skel);
 cleanup2:
-    mnl_socket_close(nl);
+    nl_close_sockets();
+    refresh_free();
+    reconcile_free();
+    overflow_free();
+    hitters_free();
+    damping_free();
+    workq_free();
 cleanup1:
     return -err;
 }
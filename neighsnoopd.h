@@ -9,6 +9,8 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <signal.h>
+#include <sys/types.h>
 #include <linux/types.h>
 #include <net/if.h>
 #include <netinet/in.h>
@@ -18,6 +20,138 @@
 
 #define MAC_ADDR_STR_LEN 18
 
+// Netlink receive buffer, large enough for a full dump message
+#define NL_RECV_BUFFER_SIZE 32768
+
+// Socket receive buffer sizes set with SO_RCVBUFFORCE
+#define NL_RCVBUF_REQUEST (4 * 1024 * 1024)
+#define NL_RCVBUF_MONITOR (32 * 1024 * 1024)
+
+// Room for a neighbor request built by nl_put_neigh()
+#define NL_NEIGH_MSG_MAX 128
+
+// Managed neighbors are from Linux 5.16, define them for older headers
+#ifndef NTF_EXT_MANAGED
+#define NDA_FLAGS_EXT 15
+#define NTF_EXT_MANAGED (1 << 0)
+#endif
+
+enum nl_sock_role {
+    NL_SOCK_QUERY,     // Synchronous requests and dumps
+    NL_SOCK_WRITE,     // Neighbor table updates
+    NL_SOCK_MON_LINK,  // RTNLGRP_LINK notifications
+    NL_SOCK_MON_NEIGH, // RTNLGRP_NEIGH notifications
+    NL_SOCK_MAX,
+};
+
+// Transport under the netlink sockets, the kernel or the mock in nlmock.c
+struct nl_transport {
+    const char *name;
+    int (*open)(enum nl_sock_role role);
+    void (*close)(enum nl_sock_role role);
+    int (*fd)(enum nl_sock_role role);
+    ssize_t (*send)(enum nl_sock_role role, const void *buf, size_t len);
+    ssize_t (*recv)(enum nl_sock_role role, void *buf, size_t len);
+};
+
+// Synthetic tables served by the mock transport
+struct nl_mock_config {
+    int svis;      // SVIs on the bridge, with VLAN IDs from first_vid
+    int first_vid;
+    int macvlans;  // Macvlans on the bridge
+    int hosts;     // FDB entries per SVI
+    int ext_every; // Every ext_every-th FDB entry is extern_learn, 0 for none
+    char *events;  // File of notifications to send, see nlmock.c
+};
+
+// Cached link attributes, see links.c
+struct link_info {
+    __u32 ifindex;
+    char ifname[IF_NAMESIZE];
+    char kind[32];
+    __u32 link_ifindex;
+    __u32 master;
+    __u16 vlan_id; // VLAN ID of VLAN devices
+    bool is_macvlan;
+    bool is_vrf;
+    __u32 base_reachable_ms[2]; // ARP and ND, 0 for the table default
+};
+
+// Neighbors seen by the daemon, see neighs.c
+struct neigh_entry {
+    struct in6_addr ip;
+    __u16 vlan_id;
+    __u8 mac[6];         // MAC address of the last installed reply
+    __u8 pending_mac[6]; // MAC address of the newest queued reply
+    __u16 pending;       // Replies queued for the neighbor
+    __u32 gen;           // Generation of the newest queued reply
+    bool used;
+    bool known;          // A reply has been installed
+    bool installed;      // Installed and kept reachable, see refresh.c
+    __u32 ifindex;       // SVI the neighbor is installed on, indexed
+    __u64 seen;          // Refresh clock tick of the newest reply with mac
+    __u64 asserted;      // Refresh clock tick of the last install or refresh
+    __u64 expires;       // Refresh clock tick of the scheduled refresh
+    bool owned;          // Installed by the daemon, see reconcile.c
+    __u8 owned_mac[6];   // MAC address the daemon installed
+    bool damped;         // Damping has seen a reply, see damping.c
+    __u8 damped_mac[6];  // MAC address of the last reply damping saw
+    bool suppressed;     // Moves of the binding are held back
+    __u32 penalty;       // Flap penalty as of penalty_ms
+    __u64 penalty_ms;
+};
+
+// Work queue classes in priority order, see workq.c
+enum workq_class {
+    WORKQ_CHANGE,
+    WORKQ_NEW,
+    WORKQ_REFRESH,
+    WORKQ_CLASS_MAX,
+};
+
+#define WORKQ_SIZE_DEFAULT 4096
+#define WORKQ_BATCH 64 // Replies processed between ring buffer polls
+
+// A captured frame, see pcap.c
+struct pcap_frame {
+    const __u8 *data;
+    __u32 len;
+    __u64 ts_ns;
+};
+
+struct pcap_file;
+
+// Pipeline stages timed in replay mode, see replay.c
+enum replay_stage {
+    REPLAY_STAGE_PARSE,
+    REPLAY_STAGE_LOOKUP,
+    REPLAY_STAGE_FDB,
+    REPLAY_STAGE_INSTALL,
+    REPLAY_STAGE_MAX,
+};
+
+// Token bucket rates in replies per second, a rate of 0 disables the bucket
+struct rate_limit {
+    __u32 mac_rate;
+    __u32 mac_burst;
+    __u32 vlan_rate;
+    __u32 vlan_burst;
+};
+
+// Flap damping of neighbors, see damping.c
+struct damping_config {
+    bool disabled;
+    __u32 half_life_s;
+    __u32 max_suppress_s;
+    __u32 suppress; // Penalty above which moves are held back
+    __u32 reuse;    // Penalty below which they are let through again
+};
+
+#define DAMPING_HALF_LIFE_DEFAULT 30
+#define DAMPING_MAX_SUPPRESS_DEFAULT 300
+#define DAMPING_SUPPRESS_DEFAULT 2000
+#define DAMPING_REUSE_DEFAULT 750
+
 struct env {
     int ifidx_mon;
     char ifidx_mon_str[IF_NAMESIZE];
@@ -35,17 +169,156 @@ struct env {
     int count;
     bool netlink;
     bool disable_ipv6ll_filter;
+    char *replay_file;
+    bool replay_bpf;
+    bool dry_run;
+    bool mock;
+    struct nl_mock_config mock_config;
+    __u32 queue_size;
+    __u32 vlan_depth; // VLAN tags parsed in the packet
+    bool fib; // Resolve the SVI with a FIB lookup in the TC program
+    bool managed; // Install NTF_EXT_MANAGED neighbors the kernel refreshes
+    struct rate_limit rate_limit;
+    bool hitters; // Count the heaviest sources of replies in BPF
+    struct damping_config damping;
+    __u32 batch; // Replies staged per CPU for each ring buffer sample
+    char *pin_dir; // Where the ring buffer and XDP link are pinned
 };
 
 void mac_to_string(__u8 *buffer, const __u8 *mac, size_t buffer_size);
 void calculate_network_address(const struct in6_addr *ip,
                                const struct in6_addr *netmask,
                                struct in6_addr *network);
+void calculate_netmask(struct in6_addr *netmask, int family, int prefixlen);
 int compare_ipv6_addresses(const struct in6_addr *addr1,
                            const struct in6_addr *addr2);
 int format_ip_address(char *buf, size_t size,
                              const struct in6_addr *addr);
 int calculate_cidr(const struct in6_addr *addr);
+const char *fmt_mac(const __u8 *mac);
+const char *fmt_ip(const struct in6_addr *addr);
+__u64 now_ms(void);
+void now_ms_set(__u64 ms);
+void now_ms_reset(void);
+
+// Netlink sockets
+void nl_set_transport(const struct nl_transport *ops);
+void nl_sock_set_portid(enum nl_sock_role role, __u32 portid);
+int nl_open_sockets(void);
+void nl_close_sockets(void);
+int nl_sock_fd(enum nl_sock_role role);
+bool nl_strict_chk(enum nl_sock_role role);
+int nl_request(enum nl_sock_role role, struct nlmsghdr *nlh,
+               mnl_cb_t parse_nlm_func, void *data);
+int nl_mon_recv(enum nl_sock_role role, mnl_cb_t parse_nlm_func, void *data);
+typedef void (*nl_batch_err_t)(int index, int error, void *data);
+int nl_request_batch(enum nl_sock_role role, void *buf, size_t len,
+                     int count, nl_batch_err_t err_func, void *data);
+struct nlmsghdr *nl_put_neigh(void *buf, __u16 type, __u16 flags,
+                              __u32 ifindex, const struct in6_addr *ip,
+                              const __u8 *mac, __u16 vlan_id);
+
+// Mock netlink transport
+int nl_mock_setup(const struct nl_mock_config *config, const char *bridge);
+int nl_mock_parse_config(struct nl_mock_config *config, const char *arg);
+
+// Link cache
+struct link_info *link_cache_get(__u32 ifindex);
+struct link_info *link_cache_probe(__u32 ifindex);
+__u32 link_cache_vrf(const struct link_info *link);
+int link_cache_update(const struct nlmsghdr *nlh);
+void link_cache_flush(void);
+bool link_cache_is_filtered(__u32 ifindex);
+int link_cache_attach_bpf(int filter_map_fd, int vlan_map_fd);
+
+// Neighbor table
+struct neigh_entry *neigh_table_get(const struct in6_addr *ip, __u16 vlan_id,
+                                    bool create);
+void neigh_table_link(struct neigh_entry *neigh, __u32 ifindex);
+struct neigh_entry *neigh_table_find(const struct in6_addr *ip,
+                                     __u32 ifindex);
+void neigh_table_forget(const struct in6_addr *ip, __u32 ifindex);
+__u32 neigh_table_count(void);
+void neigh_table_free(void);
+
+// Work queue
+struct neighbor_reply;
+typedef int (*workq_handler_t)(struct neighbor_reply *reply);
+int workq_init(__u32 size, workq_handler_t handler);
+void workq_free(void);
+int workq_push(const struct neighbor_reply *reply);
+int workq_run(int budget);
+__u32 workq_depth(void);
+__u32 workq_capacity(void);
+void workq_print_stats(void);
+
+// Refresh of installed neighbors
+__u64 refresh_clock(void);
+void refresh_track(struct neigh_entry *neigh, __u32 ifindex);
+void refresh_forget(const struct in6_addr *ip, __u32 ifindex);
+void refresh_set_reachable(int family, __u32 ifindex, __u64 ms);
+void refresh_attach_bpf(int map_fd);
+void refresh_run(void);
+int refresh_timeout(void);
+void refresh_free(void);
+void refresh_print_stats(void);
+
+// Reconciliation of installed neighbors with the FDB
+void reconcile_own(struct neigh_entry *neigh, __u32 ifindex);
+void reconcile_neigh_event(const struct in6_addr *ip, __u32 ifindex,
+                           const __u8 *mac, bool ext_learned);
+void reconcile_fdb_event(const __u8 *mac, __u16 vlan_id, bool ext_learned);
+int reconcile_run(void);
+void reconcile_free(void);
+void reconcile_print_stats(void);
+
+// Capture files
+struct pcap_file *pcap_open(const char *path);
+int pcap_next(struct pcap_file *pcap, struct pcap_frame *frame);
+void pcap_rewind(struct pcap_file *pcap);
+void pcap_close(struct pcap_file *pcap);
+
+// Replay
+typedef int (*replay_handler_t)(void *ctx, void *data, size_t data_sz);
+typedef void (*replay_tick_t)(void);
+int replay_run(const char *path, replay_handler_t handler, replay_tick_t tick,
+               int prog_fd, int ringbuf_fd,
+               const volatile sig_atomic_t *exiting);
+__u64 replay_stage_start(void);
+void replay_stage_end(enum replay_stage stage, __u64 *start);
+
+// Ring buffer records
+int record_decode(const void *data, size_t data_sz, replay_handler_t handler,
+                  void *ctx);
+void record_print_stats(void);
+
+// Recovery of replies that found the ring buffer full
+struct neighbor_stats;
+int overflow_attach(int stats_map_fd, int missed_map_fd,
+                    int pending_map_fd, replay_handler_t handler);
+int overflow_read_stats(struct neighbor_stats *total);
+void overflow_run(void);
+int overflow_timeout(void);
+void overflow_free(void);
+void overflow_print_stats(void);
+
+// Heavy hitters among the sources of replies
+struct hitter;
+int hitters_attach(int sketch_map_fd, int top_map_fd);
+void hitters_run(void);
+int hitters_top(int kind, struct hitter *top);
+int hitters_timeout(void);
+void hitters_free(void);
+void hitters_print_stats(void);
+
+// Flap damping of neighbors
+int damping_parse_config(struct damping_config *config, const char *arg);
+void damping_init(workq_handler_t handler);
+bool damping_hold(const struct neighbor_reply *reply);
+void damping_run(void);
+int damping_timeout(void);
+void damping_free(void);
+void damping_print_stats(void);
 
 // Print functions
 void __pr_std(FILE * file, const char *format, ...);
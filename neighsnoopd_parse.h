@@ -0,0 +1,186 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is> */
+/* SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com> */
+/* SPDX-FileContributor: Freysteinn Alfredsson <freysteinn@freysteinn.com> */
+/* SPDX-FileContributor: Julius Thor Bess Rikardsson <juliusbess@gmail.com> */
+
+/*
+ * ARP reply and Neighbor Advertisement parsers shared by the BPF program and
+ * the userspace replay mode, so that both parse frames with the same code.
+ *
+ * The includer provides neighbor_reply_reserve(), which returns the record
+ * to fill in: a ring buffer reservation in BPF and a plain buffer in
+ * userspace. It may also define PARSE_IPV4 and PARSE_IPV6, and
+ * VLAN_PARSE_DEPTH from parsing_helpers.h, to specialise the parser; the BPF
+ * program binds them to const volatile knobs.
+ */
+
+#ifndef NEIGHSNOOPD_PARSE_H_
+#define NEIGHSNOOPD_PARSE_H_
+
+#ifndef __VMLINUX_H__
+#include <linux/if_arp.h>
+#include <linux/if_ether.h>
+#endif
+
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+
+#include "neighsnoopd_shared.h"
+
+#include "include/xdp/parsing_helpers.h"
+
+#ifndef PARSE_IPV4
+#define PARSE_IPV4 1
+#endif
+
+#ifndef PARSE_IPV6
+#define PARSE_IPV6 1
+#endif
+
+#define ND_NEIGHBOR_ADVERT          136
+#define ND_OPT_MAX_CHAIN            3
+#define ND_OPT_TARGET_LINKADDR      2
+
+// vmlinux.h has the kernel's definition
+#ifndef __VMLINUX_H__
+struct nd_opt_hdr {
+    __u8 nd_opt_type;
+    __u8 nd_opt_len; // Length in units of 8 octets
+};
+#endif
+
+// Find ND Option Header of specified type
+static __always_inline int find_nd_opt(struct hdr_cursor *nh,
+                                       void *data_end,
+                                       __u8 next_hdr_type)
+{
+    for (int i = 0; i < ND_OPT_MAX_CHAIN; ++i) {
+        struct nd_opt_hdr *hdr = nh->pos;
+
+        if ((void *)(hdr + 1) > data_end)
+            return -1;
+
+        if (((void *)hdr) + hdr->nd_opt_len * 8 > data_end)
+            return -1;
+
+        switch (hdr->nd_opt_type) {
+            case ND_OPT_TARGET_LINKADDR:
+                return 0;
+            default:
+                nh->pos = ((void *)hdr) + hdr->nd_opt_len * 8;
+        }
+    }
+
+    return -1;
+}
+
+static __always_inline struct neighbor_reply *handle_nd_reply(
+    struct hdr_cursor *nh, void *data_end, struct ethhdr *eth)
+{
+    struct neighbor_reply *neighbor_reply = NULL;
+    struct ipv6hdr *ip;
+    struct icmp6hdr *icmp6;
+    struct in6_addr *target_ipv6;
+    struct nd_opt_hdr *nd_opt_hdr;
+    __u8 *target_mac;
+
+    // Parse the IPv6 header
+    if (parse_ip6hdr(nh, data_end, &ip) != IPPROTO_ICMPV6)
+        goto out;
+
+    // Check if the message is a Neighbor Advertisement
+    if (parse_icmp6hdr(nh, data_end, &icmp6) != ND_NEIGHBOR_ADVERT)
+        goto out;
+
+    if ((void *)(icmp6 + 1) > data_end)
+        goto out;
+    nh->pos = icmp6 + 1;
+
+    // Check if the message is long enough to contain the target IPv6 address
+    target_ipv6 = nh->pos;
+    if ((void *)(target_ipv6 + 1) > data_end)
+        goto out;
+    nh->pos = target_ipv6 + 1;
+
+    // Parse options to find the Source Link-Layer Address (MAC address)
+    if (find_nd_opt(nh, data_end, ND_OPT_TARGET_LINKADDR)) {
+        target_mac = eth->h_source;
+    } else {
+        nd_opt_hdr = nh->pos;
+
+        if ((void *)(nd_opt_hdr + 1) > data_end)
+            goto out;
+
+        target_mac = (void *)(nd_opt_hdr + 1);
+
+        if ((void *)(target_mac + ETH_ALEN) > data_end)
+            goto out;
+    }
+
+    // Add the data to the ringbuffer
+    neighbor_reply = neighbor_reply_reserve();
+    if (!neighbor_reply)
+        goto out;
+
+    __builtin_memcpy(neighbor_reply->mac, target_mac, ETH_ALEN);
+    __builtin_memcpy(&neighbor_reply->ip, target_ipv6, sizeof(*target_ipv6));
+
+    neighbor_reply->in_family = AF_INET6;
+
+out:
+    return neighbor_reply;
+}
+
+static __always_inline struct neighbor_reply *handle_arp_reply(
+    struct hdr_cursor *nh, void *data_end)
+{
+    struct neighbor_reply *neighbor_reply = NULL;
+    struct arphdr *arp;
+    __be32 sender_ip;
+    __u8 *sender_mac;
+
+    if (nh->pos + sizeof(struct arphdr) > data_end)
+        goto out;
+
+    arp = nh->pos;
+    if (arp->ar_op != bpf_htons(ARPOP_REPLY))
+        goto out;
+
+    // Only Ethernet and IPv4 addresses are neighbors of the SVIs
+    if (arp->ar_hln != ETH_ALEN || arp->ar_pln != sizeof(sender_ip))
+        goto out;
+
+    // Extract IPv4 and MAC addresses
+    sender_mac = (__u8 *)(arp + 1);
+    if (sender_mac + ETH_ALEN + sizeof(sender_ip) > (__u8 *)data_end)
+        goto out;
+
+    // Add the data to the ringbuffer
+    neighbor_reply = neighbor_reply_reserve();
+    if (!neighbor_reply)
+        goto out;
+
+    // The sender address is only 2-byte aligned behind the MAC address
+    __builtin_memcpy(&sender_ip, sender_mac + ETH_ALEN, sizeof(sender_ip));
+    __builtin_memcpy(neighbor_reply->mac, sender_mac, ETH_ALEN);
+    map_ipv4_to_ipv6(&neighbor_reply->ip, sender_ip);
+
+    neighbor_reply->in_family = AF_INET;
+
+out:
+    return neighbor_reply;
+}
+
+static __always_inline struct neighbor_reply *parse_neighbor_reply(
+    struct hdr_cursor *nh, void *data_end, struct ethhdr *eth, int eth_type)
+{
+    if (PARSE_IPV6 && eth_type == bpf_htons(ETH_P_IPV6))
+        return handle_nd_reply(nh, data_end, eth);
+    else if (PARSE_IPV4 && eth_type == bpf_htons(ETH_P_ARP))
+        return handle_arp_reply(nh, data_end);
+    return NULL;
+}
+
+#endif // NEIGHSNOOPD_PARSE_H_
@@ -7,22 +7,252 @@
 #ifndef NEIGHSNOOPD_SHARED_H_
 #define NEIGHSNOOPD_SHARED_H_
 
+// The filtered interface bitmap in BPF covers ifindexes 0-65535
+#define IFINDEX_BITMAP_WORDS 1024
+#define IFINDEX_BITMAP_BITS (IFINDEX_BITMAP_WORDS * 64)
+
+#define VLAN_ID_MAX 4096
+
+// VLAN tags parsed in the packet at most, two for QinQ
+#define VLAN_MAX_DEPTH 2
+
+// A parsed reply, sent to userspace packed as a struct reply_record
 struct neighbor_reply {
     __be16 vlan_id;
     struct in6_addr ip;
     __u8 in_family;
     __u8 mac[6];
     __u32 ingress_ifindex;
+    __u32 svi_ifindex; // SVI resolved by a FIB lookup in BPF, or 0
+};
+
+/*
+ * Records of the ring buffer, see record.c. A sample holds one record, or
+ * up to REPLY_BATCH_MAX when the BPF program stages them per CPU.
+ *
+ * Every record starts with the ABI version of the program that wrote it,
+ * its type and its length, so that a daemon can take over a ring buffer
+ * pinned by a program of another version, see --pin. A new version may add
+ * types and append fields to the end of a type, but never changes the
+ * fields before them. A consumer reads the fields it knows from records of
+ * newer versions, reads records of older versions with the lengths of
+ * those versions, and skips the types it does not know by their length.
+ */
+#define REPLY_ABI_VERSION 1
+
+enum reply_record_type {
+    REPLY_RECORD_IPV4 = 1,
+    REPLY_RECORD_IPV6 = 2,
+};
+
+struct reply_record_hdr {
+    __u8 version; // REPLY_ABI_VERSION of the writer
+    __u8 type;
+    __u16 len;    // Of the whole record, a multiple of 4
+};
+
+struct reply_record {
+    struct reply_record_hdr hdr;
+    __u32 ingress_ifindex;
+    __u32 svi_ifindex;
+    __u16 vlan_id;
+    __u8 mac[6];
+    __u8 ip[16]; // Only the first 4 bytes in a REPLY_RECORD_IPV4
+};
+
+#define REPLY_RECORD_IPV4_LEN (sizeof(struct reply_record) - 12)
+#define REPLY_RECORD_IPV6_LEN sizeof(struct reply_record)
+
+#define REPLY_BATCH_MAX 8
+#define REPLY_STAGE_SIZE (REPLY_BATCH_MAX * sizeof(struct reply_record))
+
+// Per-CPU counters kept by the BPF program
+struct neighbor_stats {
+    __u64 replies;       // Parsed replies
+    __u64 ringbuf_drops; // Replies that found the ring buffer full
+
+    // Verdicts of the FIB lookup in TC
+    __u64 fib_known;     // Kernel neighbor has the MAC already, suppressed
+    __u64 fib_known_ipv6; // Same, but IPv6 and passed on to be refreshed
+    __u64 fib_no_neigh;  // SVI resolved, no kernel neighbor yet
+    __u64 fib_changed;   // Kernel neighbor has another MAC
+    __u64 fib_fallback;  // Not on link or not resolved, userspace searches
+
+    // Replies over the token bucket rates
+    __u64 rate_mac;      // Over the rate of the source MAC address
+    __u64 rate_vlan;     // Over the rate of the VLAN
+};
+
+// Neighbor key of the replies that BPF keeps in hash maps
+struct neighbor_key {
+    struct in6_addr ip;
+    __u32 vlan_id;
+};
+
+// As many as the neighbor table of the daemon tracks
+#define KNOWN_SEEN_MAX (1 << 17)
+
+// Replies kept in BPF while the ring buffer is full
+#define MISSED_REPLIES_MAX (1 << 14)
+
+// Source MAC addresses with a token bucket
+#define RATE_MACS_MAX (1 << 16)
+
+/*
+ * Count-min sketch of the heaviest sources of replies, see hitters.c. Each
+ * kind of key has HITTER_ROWS rows of HITTER_WIDTH counters and a table of
+ * HITTER_SLOTS candidates, all per CPU, so the memory is fixed.
+ */
+#define HITTER_ROWS 4
+#define HITTER_WIDTH 1024
+#define HITTER_SLOTS 16
+
+enum hitter_kind {
+    HITTER_MAC,
+    HITTER_IP,
+    HITTER_VLAN,
+    HITTER_KINDS,
+};
+
+// MAC addresses and VLAN IDs are zero padded to the size of an IP address
+struct hitter_key {
+    __u64 words[2];
+};
+
+struct hitter_row {
+    __u32 counts[HITTER_WIDTH];
 };
 
+struct hitter_slots {
+    struct {
+        struct hitter_key key;
+        __u32 count;
+    } slots[HITTER_SLOTS];
+};
+
+// The heaviest keys of a window as userspace ranks them
+#define HITTERS_TOP 10
+
+struct hitter {
+    struct hitter_key key;
+    __u64 count;
+};
+
+// The splitmix64 finalizer, every bit of h moves every bit of the result
+static inline __u64 hitter_mix(__u64 h)
+{
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+/*
+ * Index of a key in a row of the sketch, seeded per row. Both words are
+ * mixed in full, as IPv4-mapped addresses differ only in the upper half of
+ * the second one.
+ */
+static inline __u32 hitter_hash(const struct hitter_key *key, __u32 row)
+{
+    __u64 h = hitter_mix(key->words[0] ^ (0x9e3779b97f4a7c15ULL * (row + 1)));
+
+    return hitter_mix(h ^ key->words[1]) & (HITTER_WIDTH - 1);
+}
+
 /*
  * Maps an IPv4 address into an IPv6 address according to RFC 4291 sec 2.5.5.2
  */
-static void map_ipv4_to_ipv6(struct in6_addr *ipv6, __be32 ipv4)
+static inline void map_ipv4_to_ipv6(struct in6_addr *ipv6, __be32 ipv4)
 {
     __builtin_memset(((__u8 *)ipv6), 0x00, 10);
     __builtin_memset(((__u8 *)ipv6) + 10, 0xff, 2);
     ((__u32 *)ipv6)[3] = ipv4;
 }
 
+// Packs a reply into a record, returns the length of the record
+static inline __u32 reply_record_encode(struct reply_record *rec,
+                                        const struct neighbor_reply *reply)
+{
+    const __u8 *ip = (const __u8 *)&reply->ip;
+
+    rec->hdr.version = REPLY_ABI_VERSION;
+    rec->ingress_ifindex = reply->ingress_ifindex;
+    rec->svi_ifindex = reply->svi_ifindex;
+    rec->vlan_id = reply->vlan_id;
+    __builtin_memcpy(rec->mac, reply->mac, sizeof(rec->mac));
+
+    if (reply->in_family == AF_INET) {
+        rec->hdr.type = REPLY_RECORD_IPV4;
+        rec->hdr.len = REPLY_RECORD_IPV4_LEN;
+        __builtin_memcpy(rec->ip, ip + 12, 4);
+    } else {
+        rec->hdr.type = REPLY_RECORD_IPV6;
+        rec->hdr.len = REPLY_RECORD_IPV6_LEN;
+        __builtin_memcpy(rec->ip, ip, 16);
+    }
+    return rec->hdr.len;
+}
+
+/*
+ * The length of a type in an ABI version, or 0 for a type that the version
+ * does not have. Newer versions than this build knows are read as the
+ * newest one it knows, whose fields they begin with.
+ */
+static inline __u32 reply_record_type_len(__u32 version, __u32 type)
+{
+    if (version > REPLY_ABI_VERSION)
+        version = REPLY_ABI_VERSION;
+
+    // Version 1 is the first, add a case when a version changes a type
+    switch (type) {
+    case REPLY_RECORD_IPV4:
+        return REPLY_RECORD_IPV4_LEN;
+    case REPLY_RECORD_IPV6:
+        return REPLY_RECORD_IPV6_LEN;
+    }
+    return 0;
+}
+
+/*
+ * Unpacks the record at the start of len bytes. Returns the length of the
+ * record, or 0 when it is malformed. A record of an unknown type leaves the
+ * family of the reply at 0.
+ */
+static inline __u32 reply_record_decode(const void *data, __u32 len,
+                                        struct neighbor_reply *reply)
+{
+    const struct reply_record *rec = data;
+    __u32 rec_len, type_len;
+
+    if (len < sizeof(rec->hdr))
+        return 0;
+    rec_len = rec->hdr.len;
+    if (!rec->hdr.version || rec_len < sizeof(rec->hdr) || rec_len % 4 ||
+        rec_len > len)
+        return 0;
+
+    reply->in_family = 0;
+    type_len = reply_record_type_len(rec->hdr.version, rec->hdr.type);
+    if (!type_len)
+        return rec_len;
+    if (rec_len < type_len)
+        return 0;
+
+    reply->ingress_ifindex = rec->ingress_ifindex;
+    reply->svi_ifindex = rec->svi_ifindex;
+    reply->vlan_id = rec->vlan_id;
+    __builtin_memcpy(reply->mac, rec->mac, sizeof(reply->mac));
+
+    if (rec->hdr.type == REPLY_RECORD_IPV4) {
+        __be32 ipv4;
+
+        __builtin_memcpy(&ipv4, rec->ip, sizeof(ipv4));
+        map_ipv4_to_ipv6(&reply->ip, ipv4);
+        reply->in_family = AF_INET;
+    } else {
+        __builtin_memcpy(&reply->ip, rec->ip, sizeof(reply->ip));
+        reply->in_family = AF_INET6;
+    }
+    return rec_len;
+}
+
 #endif // NEIGHSNOOPD_SHARED_H_
@@ -0,0 +1,402 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is> */
+/* SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com> */
+/* SPDX-FileContributor: Freysteinn Alfredsson <freysteinn@freysteinn.com> */
+/* SPDX-FileContributor: Julius Thor Bess Rikardsson <juliusbess@gmail.com> */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include <libmnl/libmnl.h>
+#include <linux/if_ether.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "neighsnoopd.h"
+
+extern struct env env;
+
+#ifndef NETLINK_GET_STRICT_CHK
+#define NETLINK_GET_STRICT_CHK 12
+#endif
+
+/*
+ * Each socket has a single role so that dump replies, ACKs and multicast
+ * notifications never share a receive queue. The monitor sockets get large
+ * receive buffers to absorb notification bursts, and report ENOBUFS when they
+ * overrun so that the caller can resynchronize its state.
+ */
+static struct nl_sock {
+    const char *name;
+    struct mnl_socket *mnl;
+    __u32 portid;
+    __u32 seq;
+    unsigned int group; // Multicast group, 0 for request sockets
+    int rcvbuf;
+    bool strict_chk; // Kernel validates and filters requests strictly
+} nl_socks[NL_SOCK_MAX] = {
+    [NL_SOCK_QUERY] = {
+        .name = "query",
+        .rcvbuf = NL_RCVBUF_REQUEST,
+        .strict_chk = true,
+    },
+    [NL_SOCK_WRITE] = {
+        .name = "write",
+        .rcvbuf = NL_RCVBUF_REQUEST,
+    },
+    [NL_SOCK_MON_LINK] = {
+        .name = "link monitor",
+        .group = RTNLGRP_LINK,
+        .rcvbuf = NL_RCVBUF_MONITOR,
+    },
+    [NL_SOCK_MON_NEIGH] = {
+        .name = "neighbor monitor",
+        .group = RTNLGRP_NEIGH,
+        .rcvbuf = NL_RCVBUF_MONITOR,
+    },
+};
+
+static int nl_set_rcvbuf(struct nl_sock *sock)
+{
+    int fd = mnl_socket_get_fd(sock->mnl);
+    int size = sock->rcvbuf;
+
+    // SO_RCVBUFFORCE ignores rmem_max but requires CAP_NET_ADMIN
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) == 0)
+        return 0;
+
+    pr_debug("SO_RCVBUFFORCE failed on the %s socket, using SO_RCVBUF\n",
+             sock->name);
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+        pr_err(errno, "setsockopt SO_RCVBUF");
+        return -1;
+    }
+    return 0;
+}
+
+static int nl_kernel_open(enum nl_sock_role role)
+{
+    struct nl_sock *sock = &nl_socks[role];
+    int fd;
+    int off = 0;
+    int on = 1;
+
+    sock->mnl = mnl_socket_open(NETLINK_ROUTE);
+    if (!sock->mnl) {
+        pr_err(errno, "mnl_socket_open");
+        return -1;
+    }
+
+    if (mnl_socket_bind(sock->mnl, 0, MNL_SOCKET_AUTOPID) < 0) {
+        pr_err(errno, "mnl_socket_bind");
+        return -1;
+    }
+    sock->portid = mnl_socket_get_portid(sock->mnl);
+    sock->seq = time(NULL);
+    pr_nl("MNL %s socket port ID: %d\n", sock->name, sock->portid);
+
+    if (nl_set_rcvbuf(sock))
+        return -1;
+
+    // Strict checking enables kernel-side dump filters (Linux 4.20)
+    if (sock->strict_chk &&
+        mnl_socket_setsockopt(sock->mnl, NETLINK_GET_STRICT_CHK,
+                              &on, sizeof(on)) < 0) {
+        pr_debug("Strict checking is not supported on the %s socket\n",
+                 sock->name);
+        sock->strict_chk = false;
+    }
+
+    if (!sock->group)
+        return 0;
+
+    if (mnl_socket_setsockopt(sock->mnl, NETLINK_ADD_MEMBERSHIP,
+                              &sock->group, sizeof(sock->group)) < 0) {
+        pr_err(errno, "Failed to join netlink group %d", sock->group);
+        return -1;
+    }
+
+    // Monitors must see overruns, since they are the resync trigger
+    if (mnl_socket_setsockopt(sock->mnl, NETLINK_NO_ENOBUFS,
+                              &off, sizeof(off)) < 0) {
+        pr_err(errno, "setsockopt NETLINK_NO_ENOBUFS");
+        return -1;
+    }
+
+    // Notifications are drained from the main loop without blocking
+    fd = mnl_socket_get_fd(sock->mnl);
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        pr_err(errno, "fcntl O_NONBLOCK");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void nl_kernel_close(enum nl_sock_role role)
+{
+    if (!nl_socks[role].mnl)
+        return;
+    mnl_socket_close(nl_socks[role].mnl);
+    nl_socks[role].mnl = NULL;
+}
+
+static int nl_kernel_fd(enum nl_sock_role role)
+{
+    return mnl_socket_get_fd(nl_socks[role].mnl);
+}
+
+static ssize_t nl_kernel_send(enum nl_sock_role role, const void *buf,
+                              size_t len)
+{
+    return mnl_socket_sendto(nl_socks[role].mnl, buf, len);
+}
+
+static ssize_t nl_kernel_recv(enum nl_sock_role role, void *buf, size_t len)
+{
+    return mnl_socket_recvfrom(nl_socks[role].mnl, buf, len);
+}
+
+static const struct nl_transport nl_kernel_transport = {
+    .name = "kernel",
+    .open = nl_kernel_open,
+    .close = nl_kernel_close,
+    .fd = nl_kernel_fd,
+    .send = nl_kernel_send,
+    .recv = nl_kernel_recv,
+};
+
+static const struct nl_transport *transport = &nl_kernel_transport;
+
+// Replaces the kernel transport, must be called before nl_open_sockets()
+void nl_set_transport(const struct nl_transport *ops)
+{
+    transport = ops;
+}
+
+int nl_open_sockets(void)
+{
+    pr_debug("Opening netlink sockets on the %s transport\n",
+             transport->name);
+
+    for (int i = 0; i < NL_SOCK_MAX; i++) {
+        if (transport->open(i)) {
+            nl_close_sockets();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void nl_close_sockets(void)
+{
+    for (int i = 0; i < NL_SOCK_MAX; i++)
+        transport->close(i);
+}
+
+int nl_sock_fd(enum nl_sock_role role)
+{
+    return transport->fd(role);
+}
+
+// Lets a transport without real sockets hand out its own port IDs
+void nl_sock_set_portid(enum nl_sock_role role, __u32 portid)
+{
+    nl_socks[role].portid = portid;
+    nl_socks[role].seq = time(NULL);
+}
+
+bool nl_strict_chk(enum nl_sock_role role)
+{
+    return nl_socks[role].strict_chk;
+}
+
+/*
+ * Sends a request on a request socket and runs the callback on every reply
+ * until the kernel acknowledges the request or finishes the dump.
+ * Returns 0 on success or -1 with errno set.
+ */
+int nl_request(enum nl_sock_role role, struct nlmsghdr *nlh,
+               mnl_cb_t parse_nlm_func, void *data)
+{
+    struct nl_sock *sock = &nl_socks[role];
+    char buf[NL_RECV_BUFFER_SIZE];
+    int ret;
+
+    nlh->nlmsg_seq = ++sock->seq;
+
+    pr_nl("Sending netlink message on the %s socket\n", sock->name);
+    pr_nl_nlmsg(nlh, sock->seq);
+
+    if (transport->send(role, nlh, nlh->nlmsg_len) < 0) {
+        pr_err(errno, "Failed to send on the %s socket", sock->name);
+        return -1;
+    }
+
+    do {
+        ret = transport->recv(role, buf, sizeof(buf));
+        if (ret < 0) {
+            pr_err(errno, "Failed to receive on the %s socket", sock->name);
+            return -1;
+        }
+
+        pr_nl("Received netlink message on the %s socket\n", sock->name);
+        pr_nl_nlmsg((struct nlmsghdr *)buf, sock->seq);
+
+        ret = mnl_cb_run(buf, ret, sock->seq, sock->portid, parse_nlm_func,
+                         data);
+    } while (ret > MNL_CB_STOP);
+
+    return ret < MNL_CB_STOP ? -1 : 0;
+}
+
+/*
+ * Drains all pending notifications from a monitor socket. Returns -1 with
+ * errno set to ENOBUFS when the socket overran and notifications were lost.
+ */
+int nl_mon_recv(enum nl_sock_role role, mnl_cb_t parse_nlm_func, void *data)
+{
+    struct nl_sock *sock = &nl_socks[role];
+    char buf[NL_RECV_BUFFER_SIZE];
+    bool overrun = false;
+    int ret;
+
+    for (;;) {
+        ret = transport->recv(role, buf, sizeof(buf));
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == ENOBUFS) {
+                pr_info("Netlink %s socket overrun\n", sock->name);
+                overrun = true;
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            pr_err(errno, "Failed to receive on the %s socket", sock->name);
+            return -1;
+        }
+
+        pr_nl("Received netlink notification on the %s socket\n",
+              sock->name);
+        pr_nl_nlmsg((struct nlmsghdr *)buf, 0);
+
+        // Notifications carry sequence number and port ID 0
+        if (mnl_cb_run(buf, ret, 0, 0, parse_nlm_func, data) < MNL_CB_STOP)
+            pr_err(errno, "Failed to parse netlink notification");
+    }
+
+    if (overrun) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Builds a neighbor request for ip on ifindex in buf, which must have room
+ * for NL_NEIGH_MSG_MAX bytes. The VLAN is only added when it is set.
+ */
+struct nlmsghdr *nl_put_neigh(void *buf, __u16 type, __u16 flags,
+                              __u32 ifindex, const struct in6_addr *ip,
+                              const __u8 *mac, __u16 vlan_id)
+{
+    struct nlmsghdr *nlh;
+    struct ndmsg *ndm;
+
+    nlh = mnl_nlmsg_put_header(buf);
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+
+    ndm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ndm));
+    ndm->ndm_family = IN6_IS_ADDR_V4MAPPED(ip) ? AF_INET : AF_INET6;
+    ndm->ndm_state = NUD_REACHABLE;
+    ndm->ndm_ifindex = ifindex;
+
+    if (IN6_IS_ADDR_V4MAPPED(ip))
+        mnl_attr_put(nlh, NDA_DST, sizeof(struct in_addr), &ip->s6_addr[12]);
+    else
+        mnl_attr_put(nlh, NDA_DST, sizeof(*ip), ip);
+
+    if (mac)
+        mnl_attr_put(nlh, NDA_LLADDR, ETH_ALEN, mac);
+
+    if (vlan_id > 0)
+        mnl_attr_put(nlh, NDA_VLAN, sizeof(vlan_id), &vlan_id);
+
+    return nlh;
+}
+
+/*
+ * Sends the count requests in buf as one datagram, so that the kernel
+ * handles the whole batch in a single system call. Only the last request
+ * asks for an ACK, which marks the end of the batch, while the others only
+ * report errors. err_func is called with the index of every failed request.
+ * Returns 0 when the batch was acknowledged or -1 with errno set.
+ */
+int nl_request_batch(enum nl_sock_role role, void *buf, size_t len,
+                     int count, nl_batch_err_t err_func, void *data)
+{
+    struct nl_sock *sock = &nl_socks[role];
+    char rbuf[NL_RECV_BUFFER_SIZE];
+    struct nlmsghdr *nlh = buf;
+    int remaining = len;
+    __u32 first_seq = sock->seq + 1;
+    __u32 last_seq = sock->seq + count;
+    bool done = false;
+    int ret;
+
+    if (count <= 0)
+        return 0;
+
+    for (int i = 0; i < count && mnl_nlmsg_ok(nlh, remaining); i++) {
+        nlh->nlmsg_seq = ++sock->seq;
+        if (i == count - 1)
+            nlh->nlmsg_flags |= NLM_F_ACK;
+        else
+            nlh->nlmsg_flags &= ~NLM_F_ACK;
+        nlh = mnl_nlmsg_next(nlh, &remaining);
+    }
+
+    if (sock->seq != last_seq) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pr_nl("Sending a batch of %d netlink messages on the %s socket\n", count,
+          sock->name);
+
+    if (transport->send(role, buf, len) < 0) {
+        pr_err(errno, "Failed to send on the %s socket", sock->name);
+        return -1;
+    }
+
+    while (!done) {
+        ret = transport->recv(role, rbuf, sizeof(rbuf));
+        if (ret < 0) {
+            pr_err(errno, "Failed to receive on the %s socket", sock->name);
+            return -1;
+        }
+
+        for (nlh = (struct nlmsghdr *)rbuf; mnl_nlmsg_ok(nlh, ret);
+             nlh = mnl_nlmsg_next(nlh, &ret)) {
+            struct nlmsgerr *err = mnl_nlmsg_get_payload(nlh);
+
+            if (nlh->nlmsg_type != NLMSG_ERROR ||
+                nlh->nlmsg_pid != sock->portid ||
+                mnl_nlmsg_get_payload_len(nlh) < sizeof(*err) ||
+                err->msg.nlmsg_seq - first_seq >= (__u32)count)
+                continue;
+
+            if (err->error && err_func)
+                err_func(err->msg.nlmsg_seq - first_seq, -err->error, data);
+            if (err->msg.nlmsg_seq == last_seq)
+                done = true;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,788 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is> */
+/* SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com> */
+/* SPDX-FileContributor: Freysteinn Alfredsson <freysteinn@freysteinn.com> */
+/* SPDX-FileContributor: Julius Thor Bess Rikardsson <juliusbess@gmail.com> */
+
+/*
+ * In-process rtnetlink server used in place of the kernel to benchmark and
+ * regression test the userspace pipeline without privileges or kernel lock
+ * contention. It answers RTM_GETLINK, RTM_GETADDR and RTM_GETNEIGH requests
+ * from synthetic tables, acknowledges RTM_NEWNEIGH and RTM_DELNEIGH and has
+ * no neighbor table parameters to dump.
+ *
+ * The tables follow the tests/testbed layout: a bridge with SVIs for VLANs
+ * first_vid and up, each with 10.<vid / 256>.<vid % 256>.1/24 and
+ * fd00:<vid>::1/64, macvlans mv<i> with 172.16.<i>.1/24, and for every SVI
+ * an FDB entry 02:00:<vid>:<host> per host.
+ *
+ * An events file scripts the notifications of the neighbor monitor socket,
+ * one per line and in order of time:
+ *
+ *   TIME neigh IFNAME IP MAC        a reachable neighbor set by someone else
+ *   TIME fdb MAC VLAN local|ext     an FDB entry on the bridge port
+ *
+ * TIME is in milliseconds on the clock of now_ms(), which is the capture
+ * clock during a replay, and a notification is received once it is due.
+ * Notifications leave the synthetic tables as they are.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include <libmnl/libmnl.h>
+#include <linux/if_link.h>
+#include <linux/neighbour.h>
+#include <linux/rtnetlink.h>
+
+#include "neighsnoopd.h"
+#include "neighsnoopd_shared.h"
+
+extern struct env env;
+
+#define MOCK_MSG_MAX 1024 // Room reserved for each reply message
+#define MOCK_NEIGH_SLOTS (1 << 16)
+#define MOCK_PORTID_BASE 4096
+
+struct mock_link {
+    __u32 ifindex;
+    char ifname[IF_NAMESIZE];
+    const char *kind;
+    __u32 link_ifindex;
+    __u32 master;
+    __u16 vlan_id;
+};
+
+struct mock_addr {
+    __u32 ifindex;
+    __u8 family;
+    __u8 prefixlen;
+    __u8 addr[16];
+};
+
+// Replies waiting to be received on a socket
+struct mock_queue {
+    char *buf;
+    size_t len;
+    size_t pos;
+    size_t cap;
+};
+
+// Installed neighbors, to answer NLM_F_EXCL like the kernel
+struct mock_neigh {
+    bool used;
+    bool deleted; // Kept as a tombstone for the probing of the slots
+    __u8 family;
+    __u8 addr[16];
+};
+
+struct mock_event {
+    __u64 ms;
+    bool fdb;
+    bool ext_learned;
+    __u8 family;
+    __u32 ifindex;
+    __u16 vlan_id;
+    __u8 addr[16];
+    __u8 mac[6];
+};
+
+static struct nl_mock_config cfg;
+static struct mock_link *links;
+static int n_links;
+static struct mock_addr *addrs;
+static int n_addrs;
+static __u32 bridge_ifindex;
+static __u32 port_ifindex;
+static struct mock_queue queues[NL_SOCK_MAX];
+static struct mock_neigh *neighs;
+static struct mock_event *events;
+static int n_events;
+static int next_event;
+
+static __u32 mock_portid(enum nl_sock_role role)
+{
+    return MOCK_PORTID_BASE + role;
+}
+
+static struct nlmsghdr *mock_put(struct mock_queue *q,
+                                 const struct nlmsghdr *req, __u16 type,
+                                 __u16 flags)
+{
+    struct nlmsghdr *nlh;
+
+    if (q->cap - q->len < MOCK_MSG_MAX) {
+        size_t cap = q->cap ? q->cap * 2 : MNL_SOCKET_BUFFER_SIZE;
+        char *buf = realloc(q->buf, cap);
+
+        if (!buf)
+            return NULL;
+        q->buf = buf;
+        q->cap = cap;
+    }
+
+    nlh = mnl_nlmsg_put_header(q->buf + q->len);
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = flags;
+    nlh->nlmsg_seq = req->nlmsg_seq;
+    return nlh;
+}
+
+static void mock_commit(struct mock_queue *q, struct nlmsghdr *nlh)
+{
+    q->len += NLMSG_ALIGN(nlh->nlmsg_len);
+}
+
+static void mock_put_error(struct mock_queue *q, const struct nlmsghdr *req,
+                           int error)
+{
+    struct nlmsghdr *nlh = mock_put(q, req, NLMSG_ERROR, 0);
+    struct nlmsgerr *err;
+
+    if (!nlh)
+        return;
+    err = mnl_nlmsg_put_extra_header(nlh, sizeof(*err));
+    err->error = error;
+    memcpy(&err->msg, req, sizeof(*req));
+    mock_commit(q, nlh);
+}
+
+static void mock_put_done(struct mock_queue *q, const struct nlmsghdr *req)
+{
+    struct nlmsghdr *nlh = mock_put(q, req, NLMSG_DONE, NLM_F_MULTI);
+
+    if (!nlh)
+        return;
+    mnl_nlmsg_put_extra_header(nlh, sizeof(int));
+    mock_commit(q, nlh);
+}
+
+// Ends a reply: dumps with NLMSG_DONE, other requests with an optional ACK
+static void mock_put_end(struct mock_queue *q, const struct nlmsghdr *req)
+{
+    // NLM_F_REPLACE on new requests shares a bit with NLM_F_DUMP
+    if ((req->nlmsg_flags & NLM_F_DUMP) == NLM_F_DUMP)
+        mock_put_done(q, req);
+    else if (req->nlmsg_flags & NLM_F_ACK)
+        mock_put_error(q, req, 0);
+}
+
+static void mock_put_link(struct mock_queue *q, const struct nlmsghdr *req,
+                          const struct mock_link *link)
+{
+    struct nlmsghdr *nlh = mock_put(q, req, RTM_NEWLINK,
+                                    req->nlmsg_flags & NLM_F_DUMP ?
+                                    NLM_F_MULTI : 0);
+    struct nlattr *linkinfo, *data;
+    struct ifinfomsg *ifm;
+
+    if (!nlh)
+        return;
+
+    ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
+    ifm->ifi_family = AF_UNSPEC;
+    ifm->ifi_index = link->ifindex;
+    ifm->ifi_flags = IFF_UP | IFF_RUNNING;
+
+    mnl_attr_put_strz(nlh, IFLA_IFNAME, link->ifname);
+    if (link->link_ifindex)
+        mnl_attr_put_u32(nlh, IFLA_LINK, link->link_ifindex);
+    if (link->master)
+        mnl_attr_put_u32(nlh, IFLA_MASTER, link->master);
+
+    if (link->kind) {
+        linkinfo = mnl_attr_nest_start(nlh, IFLA_LINKINFO);
+        mnl_attr_put_strz(nlh, IFLA_INFO_KIND, link->kind);
+        if (link->vlan_id) {
+            data = mnl_attr_nest_start(nlh, IFLA_INFO_DATA);
+            mnl_attr_put_u16(nlh, IFLA_VLAN_ID, link->vlan_id);
+            mnl_attr_nest_end(nlh, data);
+        }
+        mnl_attr_nest_end(nlh, linkinfo);
+    }
+    mock_commit(q, nlh);
+}
+
+static void mock_getlink(struct mock_queue *q, const struct nlmsghdr *req)
+{
+    const struct ifinfomsg *ifm = mnl_nlmsg_get_payload(req);
+
+    if (req->nlmsg_flags & NLM_F_DUMP) {
+        for (int i = 0; i < n_links; i++)
+            mock_put_link(q, req, &links[i]);
+        mock_put_done(q, req);
+        return;
+    }
+
+    for (int i = 0; i < n_links; i++) {
+        if (links[i].ifindex == (__u32)ifm->ifi_index) {
+            mock_put_link(q, req, &links[i]);
+            mock_put_end(q, req);
+            return;
+        }
+    }
+    mock_put_error(q, req, -ENODEV);
+}
+
+static void mock_getaddr(struct mock_queue *q, const struct nlmsghdr *req)
+{
+    const struct ifaddrmsg *req_ifa = mnl_nlmsg_get_payload(req);
+
+    for (int i = 0; i < n_addrs; i++) {
+        const struct mock_addr *addr = &addrs[i];
+        size_t len = addr->family == AF_INET ? 4 : 16;
+        struct ifaddrmsg *ifa;
+        struct nlmsghdr *nlh;
+
+        if (req_ifa->ifa_family && req_ifa->ifa_family != addr->family)
+            continue;
+
+        nlh = mock_put(q, req, RTM_NEWADDR, NLM_F_MULTI);
+        if (!nlh)
+            return;
+        ifa = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifa));
+        ifa->ifa_family = addr->family;
+        ifa->ifa_prefixlen = addr->prefixlen;
+        ifa->ifa_index = addr->ifindex;
+        mnl_attr_put(nlh, IFA_ADDRESS, len, addr->addr);
+        if (addr->family == AF_INET)
+            mnl_attr_put(nlh, IFA_LOCAL, len, addr->addr);
+        mock_commit(q, nlh);
+    }
+    mock_put_done(q, req);
+}
+
+static void mock_put_fdb_entry(struct mock_queue *q,
+                               const struct nlmsghdr *req, const __u8 *mac,
+                               __u16 vid, bool ext_learned)
+{
+    struct nlmsghdr *nlh = mock_put(q, req, RTM_NEWNEIGH,
+                                    req->nlmsg_flags & NLM_F_DUMP ?
+                                    NLM_F_MULTI : 0);
+    struct ndmsg *ndm;
+
+    if (!nlh)
+        return;
+
+    ndm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ndm));
+    ndm->ndm_family = AF_BRIDGE;
+    ndm->ndm_ifindex = port_ifindex;
+    ndm->ndm_state = NUD_NOARP;
+    ndm->ndm_flags = NTF_MASTER;
+    if (ext_learned)
+        ndm->ndm_flags |= NTF_EXT_LEARNED;
+
+    mnl_attr_put(nlh, NDA_LLADDR, 6, mac);
+    mnl_attr_put_u16(nlh, NDA_VLAN, vid);
+    mnl_attr_put_u32(nlh, NDA_MASTER, bridge_ifindex);
+    mock_commit(q, nlh);
+}
+
+static void mock_put_fdb(struct mock_queue *q, const struct nlmsghdr *req,
+                         int svi, int host)
+{
+    __u16 vid = cfg.first_vid + svi;
+    __u8 mac[6] = { 0x02, 0x00, vid >> 8, vid & 0xff, host >> 8, host & 0xff };
+
+    mock_put_fdb_entry(q, req, mac, vid, cfg.ext_every &&
+                       host % cfg.ext_every == cfg.ext_every - 1);
+}
+
+static int mock_neigh_attr_cb(const struct nlattr *attr, void *data)
+{
+    const struct nlattr **tb = data;
+
+    if (mnl_attr_type_valid(attr, NDA_MAX) < 0)
+        return MNL_CB_OK;
+    tb[mnl_attr_get_type(attr)] = attr;
+    return MNL_CB_OK;
+}
+
+static void mock_getneigh(struct mock_queue *q, const struct nlmsghdr *req)
+{
+    const struct ndmsg *ndm = mnl_nlmsg_get_payload(req);
+    struct nlattr *tb[NDA_MAX + 1] = {};
+    const __u8 *mac;
+    int svi, host;
+
+    // Only the FDB is modelled, the neighbor tables start out empty
+    if (ndm->ndm_family != AF_BRIDGE) {
+        mock_put_end(q, req);
+        return;
+    }
+
+    if (req->nlmsg_flags & NLM_F_DUMP) {
+        for (svi = 0; svi < cfg.svis; svi++)
+            for (host = 0; host < cfg.hosts; host++)
+                mock_put_fdb(q, req, svi, host);
+        mock_put_done(q, req);
+        return;
+    }
+
+    // The MAC encodes the entry, so single lookups need no search
+    mnl_attr_parse(req, sizeof(*ndm), mock_neigh_attr_cb, tb);
+    if (!tb[NDA_LLADDR] || mnl_attr_get_payload_len(tb[NDA_LLADDR]) != 6) {
+        mock_put_error(q, req, -EINVAL);
+        return;
+    }
+
+    mac = mnl_attr_get_payload(tb[NDA_LLADDR]);
+    svi = (mac[2] << 8 | mac[3]) - cfg.first_vid;
+    host = mac[4] << 8 | mac[5];
+    if (mac[0] != 0x02 || mac[1] != 0x00 || svi < 0 || svi >= cfg.svis ||
+        host >= cfg.hosts ||
+        (tb[NDA_VLAN] &&
+         mnl_attr_get_u16(tb[NDA_VLAN]) != cfg.first_vid + svi)) {
+        mock_put_error(q, req, -ENOENT);
+        return;
+    }
+
+    mock_put_fdb(q, req, svi, host);
+    mock_put_end(q, req);
+}
+
+static struct mock_neigh *mock_neigh_slot(__u8 family, const __u8 *addr)
+{
+    __u32 hash = 2166136261u ^ family;
+
+    for (int i = 0; i < 16; i++)
+        hash = (hash ^ addr[i]) * 16777619u;
+
+    for (__u32 i = 0; i < MOCK_NEIGH_SLOTS; i++) {
+        struct mock_neigh *neigh = &neighs[(hash + i) % MOCK_NEIGH_SLOTS];
+
+        if (!neigh->used || (neigh->family == family &&
+                             memcmp(neigh->addr, addr, 16) == 0))
+            return neigh;
+    }
+    return NULL;
+}
+
+static void mock_newneigh(struct mock_queue *q, const struct nlmsghdr *req)
+{
+    const struct ndmsg *ndm = mnl_nlmsg_get_payload(req);
+    struct nlattr *tb[NDA_MAX + 1] = {};
+    struct mock_neigh *neigh;
+    __u8 addr[16] = {};
+    size_t len;
+
+    mnl_attr_parse(req, sizeof(*ndm), mock_neigh_attr_cb, tb);
+    if (!tb[NDA_DST] || !tb[NDA_LLADDR]) {
+        mock_put_error(q, req, -EINVAL);
+        return;
+    }
+
+    len = mnl_attr_get_payload_len(tb[NDA_DST]);
+    memcpy(addr, mnl_attr_get_payload(tb[NDA_DST]),
+           len < sizeof(addr) ? len : sizeof(addr));
+
+    neigh = mock_neigh_slot(ndm->ndm_family, addr);
+    if (neigh && neigh->used && !neigh->deleted &&
+        (req->nlmsg_flags & NLM_F_EXCL)) {
+        mock_put_error(q, req, -EEXIST);
+        return;
+    }
+
+    if (neigh) {
+        neigh->used = true;
+        neigh->deleted = false;
+        neigh->family = ndm->ndm_family;
+        memcpy(neigh->addr, addr, sizeof(addr));
+    }
+    mock_put_end(q, req);
+}
+
+static void mock_delneigh(struct mock_queue *q, const struct nlmsghdr *req)
+{
+    const struct ndmsg *ndm = mnl_nlmsg_get_payload(req);
+    struct nlattr *tb[NDA_MAX + 1] = {};
+    struct mock_neigh *neigh;
+    __u8 addr[16] = {};
+    size_t len;
+
+    mnl_attr_parse(req, sizeof(*ndm), mock_neigh_attr_cb, tb);
+    if (!tb[NDA_DST]) {
+        mock_put_error(q, req, -EINVAL);
+        return;
+    }
+
+    len = mnl_attr_get_payload_len(tb[NDA_DST]);
+    memcpy(addr, mnl_attr_get_payload(tb[NDA_DST]),
+           len < sizeof(addr) ? len : sizeof(addr));
+
+    neigh = mock_neigh_slot(ndm->ndm_family, addr);
+    if (!neigh || !neigh->used || neigh->deleted) {
+        mock_put_error(q, req, -ENOENT);
+        return;
+    }
+    neigh->deleted = true;
+    mock_put_end(q, req);
+}
+
+// Queues the notifications of the events file that are due
+static void mock_send_events(struct mock_queue *q)
+{
+    const struct nlmsghdr req = { 0 };
+    __u64 now = now_ms();
+
+    for (; next_event < n_events && events[next_event].ms <= now;
+         next_event++) {
+        const struct mock_event *event = &events[next_event];
+        struct nlmsghdr *nlh;
+        struct ndmsg *ndm;
+
+        if (event->fdb) {
+            mock_put_fdb_entry(q, &req, event->mac, event->vlan_id,
+                               event->ext_learned);
+            continue;
+        }
+
+        nlh = mock_put(q, &req, RTM_NEWNEIGH, 0);
+        if (!nlh)
+            return;
+        ndm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ndm));
+        ndm->ndm_family = event->family;
+        ndm->ndm_ifindex = event->ifindex;
+        ndm->ndm_state = NUD_REACHABLE;
+        mnl_attr_put(nlh, NDA_DST, event->family == AF_INET ? 4 : 16,
+                     event->addr);
+        mnl_attr_put(nlh, NDA_LLADDR, sizeof(event->mac), event->mac);
+        mock_commit(q, nlh);
+    }
+}
+
+static int mock_open(enum nl_sock_role role)
+{
+    nl_sock_set_portid(role, mock_portid(role));
+    return 0;
+}
+
+static void mock_close(enum nl_sock_role role)
+{
+    free(queues[role].buf);
+    memset(&queues[role], 0, sizeof(queues[role]));
+}
+
+// There is nothing to poll, the mock only serves synchronous requests
+static int mock_fd(enum nl_sock_role role)
+{
+    return -1;
+}
+
+static ssize_t mock_send(enum nl_sock_role role, const void *buf, size_t len)
+{
+    const struct nlmsghdr *req = buf;
+    struct mock_queue *q = &queues[role];
+    int remaining = len;
+    size_t start;
+
+    if (!mnl_nlmsg_ok(req, remaining)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Requests are synchronous, so a drained queue can start over
+    if (q->pos == q->len)
+        q->pos = q->len = 0;
+    start = q->len;
+
+    // A datagram may carry a batch of requests, handled in order
+    while (mnl_nlmsg_ok(req, remaining)) {
+        switch (req->nlmsg_type) {
+        case RTM_GETLINK:
+            mock_getlink(q, req);
+            break;
+        case RTM_GETADDR:
+            mock_getaddr(q, req);
+            break;
+        case RTM_GETNEIGH:
+            mock_getneigh(q, req);
+            break;
+        case RTM_NEWNEIGH:
+            mock_newneigh(q, req);
+            break;
+        case RTM_DELNEIGH:
+            mock_delneigh(q, req);
+            break;
+        case RTM_GETNEIGHTBL:
+            // The kernel defaults apply to every mock SVI
+            mock_put_end(q, req);
+            break;
+        default:
+            mock_put_error(q, req, -EOPNOTSUPP);
+            break;
+        }
+        req = mnl_nlmsg_next(req, &remaining);
+    }
+
+    // Replies are addressed to the socket that sent the request
+    for (size_t pos = start; pos < q->len;) {
+        struct nlmsghdr *nlh = (struct nlmsghdr *)(q->buf + pos);
+
+        nlh->nlmsg_pid = mock_portid(role);
+        pos += NLMSG_ALIGN(nlh->nlmsg_len);
+    }
+    return len;
+}
+
+// Hands out whole queued messages, like a datagram per kernel skb
+static ssize_t mock_recv(enum nl_sock_role role, void *buf, size_t len)
+{
+    struct mock_queue *q = &queues[role];
+    size_t n = 0;
+
+    if (role == NL_SOCK_MON_NEIGH)
+        mock_send_events(q);
+
+    if (q->pos == q->len) {
+        q->pos = q->len = 0;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    while (q->pos + n < q->len) {
+        struct nlmsghdr *nlh = (struct nlmsghdr *)(q->buf + q->pos + n);
+        size_t msg_len = NLMSG_ALIGN(nlh->nlmsg_len);
+
+        if (n + msg_len > len)
+            break;
+        n += msg_len;
+    }
+
+    memcpy(buf, q->buf + q->pos, n);
+    q->pos += n;
+    return n;
+}
+
+static const struct nl_transport nl_mock_transport = {
+    .name = "mock",
+    .open = mock_open,
+    .close = mock_close,
+    .fd = mock_fd,
+    .send = mock_send,
+    .recv = mock_recv,
+};
+
+static void mock_add_addr(__u32 ifindex, __u8 family, __u8 prefixlen,
+                          const char *addr)
+{
+    struct mock_addr *a = &addrs[n_addrs++];
+
+    a->ifindex = ifindex;
+    a->family = family;
+    a->prefixlen = prefixlen;
+    inet_pton(family, addr, a->addr);
+}
+
+static __u32 mock_ifindex(const char *ifname)
+{
+    for (int i = 0; i < n_links; i++)
+        if (!strcmp(links[i].ifname, ifname))
+            return links[i].ifindex;
+    return 0;
+}
+
+// Parses a line of the events file, returns 0 or -1 when it is invalid
+static int mock_parse_event(struct mock_event *event, const char *line)
+{
+    char kind[8], arg1[24], arg2[INET6_ADDRSTRLEN], arg3[24];
+    unsigned long long ms;
+    __u8 *mac = event->mac;
+    int n;
+
+    n = sscanf(line, "%llu %7s %23s %45s %23s", &ms, kind, arg1, arg2, arg3);
+    if (n < 4)
+        return -1;
+    memset(event, 0, sizeof(*event));
+    event->ms = ms;
+
+    if (!strcmp(kind, "fdb")) {
+        event->fdb = true;
+        event->vlan_id = strtoul(arg2, NULL, 0);
+        if (n != 5 || (strcmp(arg3, "local") && strcmp(arg3, "ext")))
+            return -1;
+        event->ext_learned = !strcmp(arg3, "ext");
+        return sscanf(arg1, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &mac[0],
+                      &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]) == 6 ?
+            0 : -1;
+    }
+
+    if (strcmp(kind, "neigh") || n != 5)
+        return -1;
+    event->ifindex = mock_ifindex(arg1);
+    event->family = strchr(arg2, ':') ? AF_INET6 : AF_INET;
+    if (!event->ifindex || inet_pton(event->family, arg2, event->addr) != 1)
+        return -1;
+    return sscanf(arg3, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &mac[0], &mac[1],
+                  &mac[2], &mac[3], &mac[4], &mac[5]) == 6 ? 0 : -1;
+}
+
+// Loads the events file, returns 0 or -1 with errno set
+static int mock_load_events(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    char line[256];
+    int cap = 0;
+
+    if (!file)
+        return -1;
+
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#' || line[strspn(line, " \t\n")] == '\0')
+            continue;
+
+        if (n_events == cap) {
+            struct mock_event *grown;
+
+            cap = cap ? cap * 2 : 64;
+            grown = realloc(events, cap * sizeof(*grown));
+            if (!grown)
+                goto err;
+            events = grown;
+        }
+
+        if (mock_parse_event(&events[n_events], line) ||
+            (n_events && events[n_events].ms < events[n_events - 1].ms)) {
+            fprintf(stderr, "Invalid mock event in %s: %s", path, line);
+            errno = EINVAL;
+            goto err;
+        }
+        n_events++;
+    }
+    fclose(file);
+    return 0;
+err:
+    fclose(file);
+    return -1;
+}
+
+/*
+ * Parses "svis=N,vid=N,macvlans=N,hosts=N,ext=N,events=FILE" where every key
+ * is optional. Returns 0 on success or -1 on an unknown key or bad value.
+ */
+int nl_mock_parse_config(struct nl_mock_config *config, const char *arg)
+{
+    char *const keys[] = { "svis", "vid", "macvlans", "hosts", "ext",
+                           "events", NULL };
+    int *fields[] = { &config->svis, &config->first_vid, &config->macvlans,
+                      &config->hosts, &config->ext_every };
+    char *opts = strdup(arg);
+    char *subopts = opts;
+    char *value;
+    int err = 0;
+
+    *config = (struct nl_mock_config) {
+        .svis = 4,
+        .first_vid = 100,
+        .macvlans = 2,
+        .hosts = 64,
+        .ext_every = 4,
+    };
+
+    if (!opts)
+        return -1;
+
+    while (*subopts) {
+        int key = getsubopt(&subopts, keys, &value);
+
+        if (key < 0 || !value) {
+            err = -1;
+            break;
+        }
+        if (!strcmp(keys[key], "events")) {
+            free(config->events);
+            config->events = strdup(value);
+            continue;
+        }
+        *fields[key] = strtol(value, NULL, 0);
+    }
+    free(opts);
+
+    if (config->svis < 0 || config->first_vid < 1 ||
+        config->first_vid + config->svis > VLAN_ID_MAX ||
+        config->macvlans < 0 || config->macvlans > 255 ||
+        config->hosts < 0 || config->hosts > 0xffff || config->ext_every < 0)
+        err = -1;
+    return err;
+}
+
+/*
+ * Builds the synthetic tables and switches the netlink sockets to the mock
+ * transport. Returns the ifindex of the bridge, or -1 with errno set.
+ */
+int nl_mock_setup(const struct nl_mock_config *config, const char *bridge)
+{
+    char addr[INET6_ADDRSTRLEN];
+    __u32 ifindex = 1;
+
+    cfg = *config;
+    links = calloc(cfg.svis + cfg.macvlans + 2, sizeof(*links));
+    addrs = calloc(2 * cfg.svis + cfg.macvlans, sizeof(*addrs));
+    neighs = calloc(MOCK_NEIGH_SLOTS, sizeof(*neighs));
+    if (!links || !addrs || !neighs) {
+        free(links);
+        free(addrs);
+        free(neighs);
+        return -1;
+    }
+
+    bridge_ifindex = ifindex++;
+    links[n_links++] = (struct mock_link) {
+        .ifindex = bridge_ifindex,
+        .kind = "bridge",
+    };
+    snprintf(links[0].ifname, IF_NAMESIZE, "%s", bridge);
+
+    port_ifindex = ifindex++;
+    links[n_links] = (struct mock_link) {
+        .ifindex = port_ifindex,
+        .kind = "veth",
+        .master = bridge_ifindex,
+    };
+    snprintf(links[n_links++].ifname, IF_NAMESIZE, "port0");
+
+    for (int i = 0; i < cfg.svis; i++) {
+        __u16 vid = cfg.first_vid + i;
+        struct mock_link *link = &links[n_links++];
+
+        *link = (struct mock_link) {
+            .ifindex = ifindex++,
+            .kind = "vlan",
+            .link_ifindex = bridge_ifindex,
+            .vlan_id = vid,
+        };
+        snprintf(link->ifname, IF_NAMESIZE, "%.9s.%d", bridge, vid);
+
+        snprintf(addr, sizeof(addr), "10.%d.%d.1", vid >> 8, vid & 0xff);
+        mock_add_addr(link->ifindex, AF_INET, 24, addr);
+        snprintf(addr, sizeof(addr), "fd00:%x::1", vid);
+        mock_add_addr(link->ifindex, AF_INET6, 64, addr);
+    }
+
+    for (int i = 1; i <= cfg.macvlans; i++) {
+        struct mock_link *link = &links[n_links++];
+
+        *link = (struct mock_link) {
+            .ifindex = ifindex++,
+            .kind = "macvlan",
+            .link_ifindex = bridge_ifindex,
+        };
+        snprintf(link->ifname, IF_NAMESIZE, "mv%d", i);
+
+        snprintf(addr, sizeof(addr), "172.16.%d.1", i);
+        mock_add_addr(link->ifindex, AF_INET, 24, addr);
+    }
+
+    if (cfg.events && mock_load_events(cfg.events))
+        return -1;
+
+    pr_debug("Mock netlink: %d links, %d addresses, %d FDB entries, "
+             "%d events\n", n_links, n_addrs, cfg.svis * cfg.hosts,
+             n_events);
+
+    nl_set_transport(&nl_mock_transport);
+    return bridge_ifindex;
+}
@@ -0,0 +1,236 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is> */
+/* SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com> */
+/* SPDX-FileContributor: Freysteinn Alfredsson <freysteinn@freysteinn.com> */
+/* SPDX-FileContributor: Julius Thor Bess Rikardsson <juliusbess@gmail.com> */
+
+/*
+ * Recovery of the replies that found the ring buffer full. The BPF program
+ * counts them and keeps the newest reply of each neighbor in the
+ * missed_replies LRU map instead. The counters are polled every
+ * OVERFLOW_POLL_MS, and once the drop counter has moved the map is drained
+ * into the work queue, at most OVERFLOW_BUDGET replies and the room left in
+ * the queue per pass, so that a large backlog neither stalls the main loop
+ * nor is shed by the queue. While the missed_pending flag is set, a reply
+ * that reaches the ring buffer removes the entry of its neighbor, so a drain
+ * never installs a MAC address older than one already delivered. The flag
+ * is cleared when a drain leaves the map empty. The work queue then
+ * classifies and coalesces the replies like any other.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "neighsnoopd.h"
+#include "neighsnoopd_shared.h"
+
+extern struct env env;
+
+#define OVERFLOW_POLL_MS 1000
+#define OVERFLOW_BUDGET 1024
+
+struct overflow_stats {
+    __u64 drops;     // Drops seen in the BPF counters
+    __u64 resyncs;   // Passes that drained the map
+    __u64 recovered; // Replies taken from the map
+};
+
+static int stats_fd = -1;
+static int missed_fd = -1;
+static int pending_fd = -1;
+static replay_handler_t overflow_handler;
+static struct neighbor_stats *percpu;
+static int n_cpus;
+static __u64 last_poll_ms;
+static bool draining;
+static struct overflow_stats stats;
+
+/*
+ * Watch the counters in the neighbor_stats map and drain the missed_replies
+ * map through handler. Returns 0 on success or -1 with errno set.
+ */
+int overflow_attach(int stats_map_fd, int missed_map_fd,
+                    int pending_map_fd, replay_handler_t handler)
+{
+    struct neighbor_stats total;
+
+    n_cpus = libbpf_num_possible_cpus();
+    if (n_cpus <= 0) {
+        errno = -n_cpus;
+        return -1;
+    }
+    percpu = calloc(n_cpus, sizeof(*percpu));
+    if (!percpu)
+        return -1;
+
+    stats_fd = stats_map_fd;
+    missed_fd = missed_map_fd;
+    pending_fd = pending_map_fd;
+    overflow_handler = handler;
+
+    if (overflow_read_stats(&total))
+        return -1;
+    stats.drops = total.ringbuf_drops;
+    last_poll_ms = now_ms();
+    return 0;
+}
+
+// Sums the per-CPU counters of the BPF program
+int overflow_read_stats(struct neighbor_stats *total)
+{
+    __u32 key = 0;
+
+    memset(total, 0, sizeof(*total));
+    if (stats_fd < 0 || bpf_map_lookup_elem(stats_fd, &key, percpu))
+        return -1;
+
+    for (int i = 0; i < n_cpus; i++) {
+        total->replies += percpu[i].replies;
+        total->ringbuf_drops += percpu[i].ringbuf_drops;
+        total->fib_known += percpu[i].fib_known;
+        total->fib_known_ipv6 += percpu[i].fib_known_ipv6;
+        total->fib_no_neigh += percpu[i].fib_no_neigh;
+        total->fib_changed += percpu[i].fib_changed;
+        total->fib_fallback += percpu[i].fib_fallback;
+        total->rate_mac += percpu[i].rate_mac;
+        total->rate_vlan += percpu[i].rate_vlan;
+    }
+    return 0;
+}
+
+// Takes a missed reply out of the map. Returns 0 or -errno.
+static int overflow_take(const struct neighbor_key *key,
+                         struct neighbor_reply *reply)
+{
+    if (!bpf_map_lookup_and_delete_elem(missed_fd, key, reply))
+        return 0;
+    // Hash maps gained lookup and delete in Linux 5.14
+    if (errno != EOPNOTSUPP && errno != EINVAL)
+        return -errno;
+    if (bpf_map_lookup_elem(missed_fd, key, reply) ||
+        bpf_map_delete_elem(missed_fd, key))
+        return -errno;
+    return 0;
+}
+
+/*
+ * Clears the pending flag of an empty map. The BPF program sets the flag
+ * after it inserts, so a reply missed meanwhile is seen by the second look
+ * at the map and the flag is set again. Returns 1 if the map holds replies
+ * again, 0 if the flag was cleared or -errno.
+ */
+static int overflow_settle(void)
+{
+    struct neighbor_key next;
+    __u32 pending = 0;
+    __u32 key = 0;
+
+    if (bpf_map_update_elem(pending_fd, &key, &pending, BPF_ANY))
+        return -errno;
+    if (bpf_map_get_next_key(missed_fd, NULL, &next))
+        return 0;
+
+    pending = 1;
+    if (bpf_map_update_elem(pending_fd, &key, &pending, BPF_ANY))
+        return -errno;
+    return 1;
+}
+
+// Moves missed replies to the handler while the work queue has room
+static void overflow_drain(void)
+{
+    int budget = workq_capacity() - workq_depth();
+    struct neighbor_reply reply;
+    struct neighbor_key key;
+    bool empty = false;
+    int err = 0;
+    int n;
+
+    if (budget > OVERFLOW_BUDGET)
+        budget = OVERFLOW_BUDGET;
+
+    for (n = 0; n < budget; n++) {
+        // Every entry is deleted, so the first key is always a new one
+        if (bpf_map_get_next_key(missed_fd, NULL, &key)) {
+            empty = true;
+            break;
+        }
+        err = overflow_take(&key, &reply);
+        // A newer reply of the neighbor reached the ring buffer meanwhile
+        if (err == -ENOENT)
+            continue;
+        if (err) {
+            pr_err(-err, "Failed to recover a missed reply");
+            break;
+        }
+
+        stats.recovered++;
+        overflow_handler(NULL, &reply, sizeof(reply));
+    }
+
+    // After an error the rest waits for the next drop
+    draining = !err && n == budget;
+    if (!err && empty) {
+        err = overflow_settle();
+        if (err < 0)
+            pr_err(-err, "Failed to clear the missed replies flag");
+        draining = err > 0;
+    }
+    if (n)
+        pr_debug("Recovered %d replies that found the ring buffer full\n", n);
+}
+
+// Polls the drop counter when it is due and drains the map after drops
+void overflow_run(void)
+{
+    struct neighbor_stats total;
+    __u64 now;
+
+    if (missed_fd < 0)
+        return;
+
+    now = now_ms();
+    if (!draining && now - last_poll_ms < OVERFLOW_POLL_MS)
+        return;
+    last_poll_ms = now;
+
+    if (!overflow_read_stats(&total) && total.ringbuf_drops != stats.drops) {
+        pr_info("%llu replies found the ring buffer full, resynchronizing\n",
+                total.ringbuf_drops - stats.drops);
+        stats.drops = total.ringbuf_drops;
+        stats.resyncs++;
+        draining = true;
+    }
+
+    if (draining)
+        overflow_drain();
+}
+
+// Milliseconds until the next poll of the drop counter
+int overflow_timeout(void)
+{
+    __u64 now = now_ms();
+
+    if (missed_fd < 0)
+        return -1;
+    if (draining || now - last_poll_ms >= OVERFLOW_POLL_MS)
+        return 0;
+    return OVERFLOW_POLL_MS - (now - last_poll_ms);
+}
+
+void overflow_free(void)
+{
+    free(percpu);
+    percpu = NULL;
+    stats_fd = missed_fd = pending_fd = -1;
+}
+
+void overflow_print_stats(void)
+{
+    pr_info("Overflow: %llu drops, %llu resyncs, %llu replies recovered\n",
+            stats.drops, stats.resyncs, stats.recovered);
+}
@@ -0,0 +1,294 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is> */
+/* SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com> */
+/* SPDX-FileContributor: Freysteinn Alfredsson <freysteinn@freysteinn.com> */
+/* SPDX-FileContributor: Julius Thor Bess Rikardsson <juliusbess@gmail.com> */
+
+/*
+ * Minimal reader for pcap and pcapng capture files with Ethernet frames.
+ * The whole file is read into memory so that frames can be replayed at full
+ * speed without I/O in the loop.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <byteswap.h>
+
+#include "neighsnoopd.h"
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_SPB 0x00000003
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_OPT_IF_TSRESOL 9
+#define PCAPNG_MAX_IFACES 64
+#define LINKTYPE_ETHERNET 1
+
+struct pcap_file {
+    __u8 *data;
+    size_t size;
+    size_t pos;
+    bool is_ng;
+    bool swapped;
+    __u64 ts_scale; // Nanoseconds per timestamp unit for classic pcap
+    __u32 n_ifaces;
+    struct {
+        __u16 linktype;
+        __u64 ts_units; // Timestamp units per second
+    } ifaces[PCAPNG_MAX_IFACES];
+};
+
+static __u32 pcap_u32(const struct pcap_file *pcap, const __u8 *p)
+{
+    __u32 v;
+
+    memcpy(&v, p, sizeof(v));
+    return pcap->swapped ? bswap_32(v) : v;
+}
+
+static __u16 pcap_u16(const struct pcap_file *pcap, const __u8 *p)
+{
+    __u16 v;
+
+    memcpy(&v, p, sizeof(v));
+    return pcap->swapped ? bswap_16(v) : v;
+}
+
+static int pcap_read_file(struct pcap_file *pcap, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    long size;
+
+    if (!file)
+        return -1;
+
+    if (fseek(file, 0, SEEK_END) || (size = ftell(file)) < 0 ||
+        fseek(file, 0, SEEK_SET))
+        goto err;
+
+    pcap->data = malloc(size ? size : 1);
+    if (!pcap->data)
+        goto err;
+
+    if (fread(pcap->data, 1, size, file) != (size_t)size)
+        goto err;
+
+    pcap->size = size;
+    fclose(file);
+    return 0;
+err:
+    fclose(file);
+    return -1;
+}
+
+static int pcap_open_classic(struct pcap_file *pcap)
+{
+    __u32 magic;
+
+    if (pcap->size < 24) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memcpy(&magic, pcap->data, sizeof(magic));
+    if (magic == bswap_32(PCAP_MAGIC_US) || magic == bswap_32(PCAP_MAGIC_NS)) {
+        pcap->swapped = true;
+        magic = bswap_32(magic);
+    }
+    if (magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (pcap_u32(pcap, pcap->data + 20) != LINKTYPE_ETHERNET) {
+        errno = EPROTONOSUPPORT;
+        return -1;
+    }
+
+    pcap->ts_scale = magic == PCAP_MAGIC_NS ? 1 : 1000;
+    pcap->pos = 24;
+    return 0;
+}
+
+struct pcap_file *pcap_open(const char *path)
+{
+    struct pcap_file *pcap = calloc(1, sizeof(*pcap));
+    __u32 magic;
+
+    if (!pcap)
+        return NULL;
+
+    if (pcap_read_file(pcap, path))
+        goto err;
+
+    if (pcap->size >= 4) {
+        memcpy(&magic, pcap->data, sizeof(magic));
+        pcap->is_ng = magic == PCAPNG_SHB;
+    }
+
+    // pcapng sections are parsed as blocks by pcap_next()
+    if (!pcap->is_ng && pcap_open_classic(pcap))
+        goto err;
+
+    return pcap;
+err:
+    pcap_close(pcap);
+    return NULL;
+}
+
+void pcap_close(struct pcap_file *pcap)
+{
+    if (!pcap)
+        return;
+    free(pcap->data);
+    free(pcap);
+}
+
+void pcap_rewind(struct pcap_file *pcap)
+{
+    pcap->pos = pcap->is_ng ? 0 : 24;
+    if (pcap->is_ng)
+        pcap->n_ifaces = 0;
+}
+
+static int pcap_next_classic(struct pcap_file *pcap, struct pcap_frame *frame)
+{
+    const __u8 *hdr = pcap->data + pcap->pos;
+    __u32 caplen;
+
+    if (pcap->pos == pcap->size)
+        return 0;
+
+    if (pcap->size - pcap->pos < 16)
+        goto err;
+
+    caplen = pcap_u32(pcap, hdr + 8);
+    if (caplen > pcap->size - pcap->pos - 16)
+        goto err;
+
+    frame->data = hdr + 16;
+    frame->len = caplen;
+    frame->ts_ns = pcap_u32(pcap, hdr) * 1000000000ULL +
+        pcap_u32(pcap, hdr + 4) * pcap->ts_scale;
+    pcap->pos += 16 + caplen;
+    return 1;
+err:
+    errno = EINVAL;
+    return -1;
+}
+
+static void pcapng_parse_idb(struct pcap_file *pcap, const __u8 *body,
+                             __u32 body_len)
+{
+    __u32 iface = pcap->n_ifaces;
+    __u32 pos = 8;
+
+    if (iface >= PCAPNG_MAX_IFACES || body_len < 8)
+        return;
+
+    pcap->ifaces[iface].linktype = pcap_u16(pcap, body);
+    pcap->ifaces[iface].ts_units = 1000000;
+
+    // Options are (code, length, value padded to 32 bits)
+    while (pos + 4 <= body_len) {
+        __u16 code = pcap_u16(pcap, body + pos);
+        __u16 len = pcap_u16(pcap, body + pos + 2);
+
+        if (code == 0 || pos + 4 + len > body_len)
+            break;
+
+        if (code == PCAPNG_OPT_IF_TSRESOL && len >= 1) {
+            __u8 resol = body[pos + 4];
+            __u64 units = 1;
+
+            for (int i = 0; i < (resol & 0x7f) && i < 63; i++)
+                units *= resol & 0x80 ? 2 : 10;
+            pcap->ifaces[iface].ts_units = units;
+        }
+        pos += 4 + ((len + 3) & ~3);
+    }
+
+    pcap->n_ifaces++;
+}
+
+static int pcap_next_ng(struct pcap_file *pcap, struct pcap_frame *frame)
+{
+    while (pcap->pos < pcap->size) {
+        const __u8 *block = pcap->data + pcap->pos;
+        const __u8 *body = block + 8;
+        __u32 type, len, body_len;
+
+        if (pcap->size - pcap->pos < 12)
+            goto err;
+
+        memcpy(&type, block, sizeof(type));
+        if (type == PCAPNG_SHB) {
+            __u32 bom;
+
+            memcpy(&bom, body, sizeof(bom));
+            if (bom != PCAPNG_BYTE_ORDER_MAGIC &&
+                bom != bswap_32(PCAPNG_BYTE_ORDER_MAGIC))
+                goto err;
+            pcap->swapped = bom != PCAPNG_BYTE_ORDER_MAGIC;
+            pcap->n_ifaces = 0; // Interfaces are scoped to a section
+        }
+        type = pcap_u32(pcap, block);
+        len = pcap_u32(pcap, block + 4);
+        if (len < 12 || len % 4 || len > pcap->size - pcap->pos)
+            goto err;
+        body_len = len - 12;
+        pcap->pos += len;
+
+        if (type == PCAPNG_IDB) {
+            pcapng_parse_idb(pcap, body, body_len);
+        } else if (type == PCAPNG_EPB && body_len >= 20) {
+            __u32 iface = pcap_u32(pcap, body);
+            __u64 ts = (__u64)pcap_u32(pcap, body + 4) << 32 |
+                pcap_u32(pcap, body + 8);
+            __u32 caplen = pcap_u32(pcap, body + 12);
+
+            if (iface >= pcap->n_ifaces || caplen > body_len - 20)
+                goto err;
+            if (pcap->ifaces[iface].linktype != LINKTYPE_ETHERNET)
+                continue;
+
+            frame->data = body + 20;
+            frame->len = caplen;
+            frame->ts_ns = ts / pcap->ifaces[iface].ts_units * 1000000000ULL +
+                ts % pcap->ifaces[iface].ts_units * 1000000000ULL /
+                pcap->ifaces[iface].ts_units;
+            return 1;
+        } else if (type == PCAPNG_SPB && body_len >= 4) {
+            __u32 origlen = pcap_u32(pcap, body);
+
+            if (pcap->n_ifaces == 0 ||
+                pcap->ifaces[0].linktype != LINKTYPE_ETHERNET)
+                continue;
+
+            frame->data = body + 4;
+            frame->len = origlen < body_len - 4 ? origlen : body_len - 4;
+            frame->ts_ns = 0; // Simple packet blocks have no timestamp
+            return 1;
+        }
+    }
+    return 0;
+err:
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * Returns 1 and fills the frame, 0 at the end of the file, or -1 with errno
+ * set on a malformed file. Frame data stays valid until pcap_close().
+ */
+int pcap_next(struct pcap_file *pcap, struct pcap_frame *frame)
+{
+    if (pcap->is_ng)
+        return pcap_next_ng(pcap, frame);
+    return pcap_next_classic(pcap, frame);
+}
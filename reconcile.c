@@ -0,0 +1,304 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is> */
+/* SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com> */
+/* SPDX-FileContributor: Freysteinn Alfredsson <freysteinn@freysteinn.com> */
+/* SPDX-FileContributor: Julius Thor Bess Rikardsson <juliusbess@gmail.com> */
+
+/*
+ * Reconciliation of the neighbors the daemon installed with the bridge FDB.
+ * A neighbor is only installed while its MAC address is learned on a local
+ * port, and when the MAC moves behind a remote VTEP the bridge replaces the
+ * FDB entry with an NTF_EXT_LEARNED one. The neighbors installed for the MAC
+ * would then keep pointing at a local binding until they age out, so they
+ * are deleted as soon as the FDB notification arrives. The EVPN control
+ * plane installs its own neighbors for remote hosts.
+ *
+ * Only neighbors the daemon owns are deleted. A neighbor is owned once the
+ * daemon's own request installed it, and ownership is given up when the
+ * kernel removes the neighbor or another writer changes its MAC address or
+ * marks it as externally learned. Owned neighbors are indexed by MAC address
+ * to find them from FDB notifications, and the deletions are collected while
+ * the notifications are handled and sent in netlink batches of
+ * RECONCILE_BATCH requests from the main loop.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libmnl/libmnl.h>
+#include <linux/rtnetlink.h>
+
+#include "neighsnoopd.h"
+
+extern struct env env;
+
+#define OWNER_BUCKETS (1 << 12)
+#define RECONCILE_BATCH 64
+
+struct owner {
+    struct in6_addr ip;
+    __u16 vlan_id;
+    __u8 mac[6];
+    __u32 ifindex;
+    struct owner *next;
+};
+
+struct reconcile_delete {
+    struct in6_addr ip;
+    __u32 ifindex;
+};
+
+struct reconcile_stats {
+    __u64 owned;   // Ownerships taken of neighbors the daemon installed
+    __u64 moved;   // Owned neighbors whose MAC moved to a remote VTEP
+    __u64 deleted; // Deleted after a move
+    __u64 failed;  // Deletions the kernel rejected
+    __u64 lost;    // Taken over or removed by someone else
+    __u64 batches;
+};
+
+static struct owner *owners[OWNER_BUCKETS];
+static __u32 owners_count;
+static struct reconcile_delete *deletes;
+static __u32 deletes_len;
+static __u32 deletes_cap;
+static struct reconcile_stats stats;
+
+static __u32 owner_hash(const __u8 *mac)
+{
+    __u64 h = 0;
+
+    memcpy(&h, mac, 6);
+    h *= 0x9e3779b97f4a7c15ULL;
+    return (h >> 32) & (OWNER_BUCKETS - 1);
+}
+
+static struct owner **owner_find(const __u8 *mac, const struct in6_addr *ip,
+                                 __u16 vlan_id)
+{
+    struct owner **pos = &owners[owner_hash(mac)];
+
+    while (*pos && ((*pos)->vlan_id != vlan_id ||
+                    memcmp(&(*pos)->ip, ip, sizeof(*ip))))
+        pos = &(*pos)->next;
+    return pos;
+}
+
+static void owner_remove(struct neigh_entry *neigh)
+{
+    struct owner **pos = owner_find(neigh->owned_mac, &neigh->ip,
+                                    neigh->vlan_id);
+    struct owner *owner = *pos;
+
+    neigh->owned = false;
+    if (!owner)
+        return;
+    *pos = owner->next;
+    free(owner);
+    owners_count--;
+}
+
+// Takes ownership of a neighbor that the daemon just installed on ifindex
+void reconcile_own(struct neigh_entry *neigh, __u32 ifindex)
+{
+    struct owner *owner;
+
+    if (env.dry_run)
+        return;
+
+    if (neigh->owned) {
+        if (!memcmp(neigh->owned_mac, neigh->mac, sizeof(neigh->mac))) {
+            owner = *owner_find(neigh->mac, &neigh->ip, neigh->vlan_id);
+            if (owner) {
+                owner->ifindex = ifindex;
+                return;
+            }
+        }
+        owner_remove(neigh);
+    }
+
+    owner = calloc(1, sizeof(*owner));
+    if (!owner) {
+        pr_err(errno, "Failed to track the ownership of %s",
+               fmt_ip(&neigh->ip));
+        return;
+    }
+    owner->ip = neigh->ip;
+    owner->vlan_id = neigh->vlan_id;
+    owner->ifindex = ifindex;
+    memcpy(owner->mac, neigh->mac, sizeof(owner->mac));
+    owner->next = owners[owner_hash(owner->mac)];
+    owners[owner_hash(owner->mac)] = owner;
+    owners_count++;
+
+    neigh->owned = true;
+    memcpy(neigh->owned_mac, neigh->mac, sizeof(neigh->mac));
+    stats.owned++;
+}
+
+/*
+ * Handles a notification of a neighbor on ifindex. mac is NULL when the
+ * neighbor was removed. Ownership is given up unless the neighbor still has
+ * the MAC address the daemon installed.
+ */
+void reconcile_neigh_event(const struct in6_addr *ip, __u32 ifindex,
+                           const __u8 *mac, bool ext_learned)
+{
+    struct neigh_entry *neigh = neigh_table_find(ip, ifindex);
+
+    if (!neigh || !neigh->owned)
+        return;
+
+    if (mac && !ext_learned &&
+        !memcmp(mac, neigh->owned_mac, sizeof(neigh->owned_mac)))
+        return;
+
+    // Refreshing it would overwrite the other writer's entry
+    pr_debug("Neighbor %s on %d is no longer owned\n", fmt_ip(ip), ifindex);
+    owner_remove(neigh);
+    neigh->installed = false;
+    stats.lost++;
+}
+
+static int reconcile_queue(const struct owner *owner)
+{
+    if (deletes_len == deletes_cap) {
+        __u32 cap = deletes_cap ? deletes_cap * 2 : RECONCILE_BATCH;
+        struct reconcile_delete *grown;
+
+        grown = realloc(deletes, cap * sizeof(*grown));
+        if (!grown)
+            return -1;
+        deletes = grown;
+        deletes_cap = cap;
+    }
+
+    deletes[deletes_len].ip = owner->ip;
+    deletes[deletes_len].ifindex = owner->ifindex;
+    deletes_len++;
+    return 0;
+}
+
+/*
+ * Handles a notification of an FDB entry on the monitored bridge. When the
+ * MAC address became externally learned, the owned neighbors with it are
+ * queued for deletion. A VLAN of 0 on either side matches any VLAN, like the
+ * FDB probe does.
+ */
+void reconcile_fdb_event(const __u8 *mac, __u16 vlan_id, bool ext_learned)
+{
+    struct owner **pos = &owners[owner_hash(mac)];
+
+    if (!ext_learned)
+        return;
+
+    while (*pos) {
+        struct owner *owner = *pos;
+        struct neigh_entry *neigh;
+
+        if (memcmp(owner->mac, mac, sizeof(owner->mac)) ||
+            (vlan_id && owner->vlan_id && owner->vlan_id != vlan_id)) {
+            pos = &owner->next;
+            continue;
+        }
+
+        pr_info("MAC %s moved to a remote VTEP, deleting neighbor %s\n",
+                fmt_mac(mac), fmt_ip(&owner->ip));
+        if (reconcile_queue(owner)) {
+            pr_err(errno, "Failed to queue the deletion of %s",
+                   fmt_ip(&owner->ip));
+            pos = &owner->next;
+            continue;
+        }
+        stats.moved++;
+
+        // The neighbor is neither refreshed nor owned from here on
+        neigh = neigh_table_get(&owner->ip, owner->vlan_id, false);
+        if (neigh) {
+            neigh->owned = false;
+            neigh->installed = false;
+        }
+        *pos = owner->next;
+        free(owner);
+        owners_count--;
+    }
+}
+
+struct reconcile_batch {
+    struct reconcile_delete *deletes;
+    int failed;
+};
+
+static void reconcile_batch_err(int index, int error, void *data)
+{
+    struct reconcile_batch *batch = data;
+
+    // Someone else removed the neighbor first
+    if (error == ENOENT)
+        return;
+
+    pr_err(error, "Failed to delete neighbor %s",
+           fmt_ip(&batch->deletes[index].ip));
+    batch->failed++;
+}
+
+// Sends the queued deletions, returns the number of deletions sent
+int reconcile_run(void)
+{
+    char buf[RECONCILE_BATCH * NL_NEIGH_MSG_MAX];
+    __u32 done = 0;
+
+    while (done < deletes_len) {
+        struct reconcile_batch batch = { .deletes = &deletes[done] };
+        int count = 0;
+        size_t len = 0;
+
+        while (count < RECONCILE_BATCH && done + count < deletes_len) {
+            struct reconcile_delete *del = &deletes[done + count];
+            struct nlmsghdr *nlh;
+
+            nlh = nl_put_neigh(buf + len, RTM_DELNEIGH, 0, del->ifindex,
+                               &del->ip, NULL, 0);
+            len += NLMSG_ALIGN(nlh->nlmsg_len);
+            count++;
+        }
+
+        if (nl_request_batch(NL_SOCK_WRITE, buf, len, count,
+                             reconcile_batch_err, &batch)) {
+            pr_err(errno, "Failed to send a batch of %d deletions", count);
+            batch.failed = count;
+        }
+        stats.deleted += count - batch.failed;
+        stats.failed += batch.failed;
+        stats.batches++;
+        done += count;
+    }
+
+    deletes_len = 0;
+    return done;
+}
+
+void reconcile_free(void)
+{
+    for (int i = 0; i < OWNER_BUCKETS; i++) {
+        while (owners[i]) {
+            struct owner *next = owners[i]->next;
+
+            free(owners[i]);
+            owners[i] = next;
+        }
+    }
+    owners_count = 0;
+    free(deletes);
+    deletes = NULL;
+    deletes_len = deletes_cap = 0;
+}
+
+void reconcile_print_stats(void)
+{
+    pr_info("Reconcile: %u owned of %llu taken, %llu moved, %llu deleted, "
+            "%llu failed, %llu lost in %llu batches\n", owners_count,
+            stats.owned, stats.moved, stats.deleted, stats.failed,
+            stats.lost, stats.batches);
+}
@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is> */
+/* SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com> */
+/* SPDX-FileContributor: Freysteinn Alfredsson <freysteinn@freysteinn.com> */
+/* SPDX-FileContributor: Julius Thor Bess Rikardsson <juliusbess@gmail.com> */
+
+/*
+ * Decoding of the ring buffer samples. The BPF program packs each reply into
+ * a struct reply_record and, with --batch, sends the records a CPU staged as
+ * one sample. The records of a sample are unpacked here into the struct
+ * neighbor_reply the rest of the daemon works with, and handed to the
+ * handler one at a time. Records of types this build does not know are
+ * skipped by their length, and a malformed record ends its sample.
+ *
+ * A ring buffer pinned with --pin outlives the daemon, so the records may
+ * come from a program of another ABI version, before the new daemon has
+ * replaced it or while a pinned program keeps running. Their version is
+ * logged once whenever it changes, and they are read by the rules in
+ * neighsnoopd_shared.h.
+ */
+
+#include "neighsnoopd.h"
+#include "neighsnoopd_shared.h"
+
+extern struct env env;
+
+struct record_stats {
+    __u64 samples;
+    __u64 records;
+    __u64 unknown;   // Records of types this build does not know
+    __u64 malformed; // Samples with a record that overran them
+    __u64 older;     // Records of an older ABI version
+    __u64 newer;     // Records of a newer ABI version, read in part
+};
+
+static struct record_stats stats;
+static __u8 last_version = REPLY_ABI_VERSION;
+
+static void record_count_version(__u8 version)
+{
+    if (version < REPLY_ABI_VERSION)
+        stats.older++;
+    else if (version > REPLY_ABI_VERSION)
+        stats.newer++;
+
+    if (version == last_version)
+        return;
+    last_version = version;
+    pr_info("Reading records of ABI version %u, the daemon has version %u\n",
+            version, REPLY_ABI_VERSION);
+}
+
+/*
+ * Hands every record of a sample to the handler as a struct neighbor_reply.
+ * Returns the number of records handled, or -1 when the sample is malformed
+ * after those.
+ */
+int record_decode(const void *data, size_t data_sz, replay_handler_t handler,
+                  void *ctx)
+{
+    const __u8 *pos = data;
+    const __u8 *end = pos + data_sz;
+    int n = 0;
+
+    stats.samples++;
+    while (pos < end) {
+        struct neighbor_reply reply = { 0 };
+        __u32 len;
+
+        len = reply_record_decode(pos, end - pos, &reply);
+        if (!len) {
+            pr_debug("Malformed record at %zu of a %zu byte sample\n",
+                     (size_t)(pos - (const __u8 *)data), data_sz);
+            stats.malformed++;
+            return -1;
+        }
+        record_count_version(((const struct reply_record_hdr *)pos)->version);
+        pos += len;
+
+        if (!reply.in_family) {
+            stats.unknown++;
+            continue;
+        }
+
+        stats.records++;
+        n++;
+        handler(ctx, &reply, sizeof(reply));
+    }
+    return n;
+}
+
+void record_print_stats(void)
+{
+    pr_info("Records: %llu in %llu samples, %.2f per sample, %llu unknown, "
+            "%llu malformed\n", stats.records, stats.samples,
+            stats.samples ? (double)stats.records / stats.samples : 0,
+            stats.unknown, stats.malformed);
+    if (stats.older || stats.newer)
+        pr_info("Records of other ABI versions than %u: %llu older, "
+                "%llu newer\n", REPLY_ABI_VERSION, stats.older, stats.newer);
+}
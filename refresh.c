@@ -0,0 +1,418 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is> */
+/* SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com> */
+/* SPDX-FileContributor: Freysteinn Alfredsson <freysteinn@freysteinn.com> */
+/* SPDX-FileContributor: Julius Thor Bess Rikardsson <juliusbess@gmail.com> */
+
+/*
+ * Proactive refresh of installed neighbors. The kernel moves a neighbor that
+ * was added as NUD_REACHABLE to NUD_STALE once its reachable time has passed,
+ * and the next packet to it then waits for ARP or ND resolution. Neighbors
+ * that are still being snooped are re-asserted as NUD_REACHABLE shortly
+ * before that happens, and the others are left to age out. Only replies
+ * with the installed MAC address count, so that a neighbor that moved is
+ * not held at its old one.
+ *
+ * The kernel draws the reachable time from half to one and a half times the
+ * base_reachable_time of the SVI, so refreshes are due at three eighths of
+ * it to stay ahead of the shortest draw. The deadlines live in a
+ * hierarchical timer wheel, and the neighbors that are due are re-asserted
+ * in netlink batches of REFRESH_BATCH requests.
+ *
+ * Wheel slots hold neighbor keys rather than pointers, since the neighbor
+ * table moves its entries when it grows. A neighbor that is rescheduled or
+ * forgotten leaves its old timer behind, which is discarded when it expires
+ * because its deadline no longer matches the neighbor's.
+ *
+ * With --fib the BPF program suppresses replies for neighbors the kernel
+ * already has with the same MAC, and records when it saw them in a map
+ * instead. Those sightings count as well when deciding whether to refresh.
+ *
+ * Neighbors installed with --install managed are kept resolved by the kernel
+ * and are only marked as installed, so that their replies are coalesced.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <bpf/bpf.h>
+#include <libmnl/libmnl.h>
+#include <linux/rtnetlink.h>
+
+#include "neighsnoopd.h"
+#include "neighsnoopd_shared.h"
+
+extern struct env env;
+
+#define WHEEL_TICK_MS 250
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4 // 64^4 ticks of 250 ms is about 48 days
+
+#define REFRESH_BATCH 64
+#define BASE_REACHABLE_MS_DEFAULT 30000
+
+struct wheel_timer {
+    struct in6_addr ip;
+    __u16 vlan_id;
+    __u64 expires;
+};
+
+struct wheel_slot {
+    struct wheel_timer *timers;
+    __u32 len;
+    __u32 cap;
+};
+
+struct refresh_batch {
+    char buf[REFRESH_BATCH * NL_NEIGH_MSG_MAX];
+    size_t len;
+    int count;
+    struct wheel_timer keys[REFRESH_BATCH];
+};
+
+struct refresh_stats {
+    __u64 refreshed; // Re-asserted as reachable
+    __u64 expired;   // No longer snooped and left to age out
+    __u64 failed;    // Rejected by the kernel
+    __u64 batches;
+};
+
+static struct wheel_slot wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static __u64 wheel_tick; // The next tick to run
+static __u32 wheel_timers;
+static struct refresh_batch batch;
+static struct refresh_stats stats;
+static int known_seen_fd = -1;
+
+// Defaults of the ARP and ND tables, per SVI values are in the link cache
+static __u32 base_reachable_ms[2] = {
+    BASE_REACHABLE_MS_DEFAULT,
+    BASE_REACHABLE_MS_DEFAULT,
+};
+
+__u64 refresh_clock(void)
+{
+    return now_ms() / WHEEL_TICK_MS;
+}
+
+// Reads the sightings of the replies that BPF suppressed from map_fd
+void refresh_attach_bpf(int map_fd)
+{
+    known_seen_fd = map_fd;
+}
+
+// Takes the last sighting of a neighbor whose replies BPF suppressed
+static void refresh_seen_in_bpf(struct neigh_entry *neigh)
+{
+    struct neighbor_key key = {
+        .ip = neigh->ip,
+        .vlan_id = neigh->vlan_id,
+    };
+    __u64 ns, seen;
+
+    if (known_seen_fd < 0 || bpf_map_lookup_elem(known_seen_fd, &key, &ns))
+        return;
+
+    // bpf_ktime_get_ns() is on the monotonic clock as well
+    seen = ns / 1000000 / WHEEL_TICK_MS;
+    if (seen > neigh->seen)
+        neigh->seen = seen;
+}
+
+static int wheel_add(const struct in6_addr *ip, __u16 vlan_id, __u64 expires)
+{
+    struct wheel_slot *slot;
+    __u64 at, delta;
+    int level = 0;
+
+    // An empty wheel is not run, so it catches up without running ticks
+    if (!wheel_timers && wheel_tick < refresh_clock())
+        wheel_tick = refresh_clock();
+
+    // Timers beyond the top level are placed there and cascaded again
+    at = expires > wheel_tick ? expires : wheel_tick;
+    delta = at - wheel_tick;
+    if (delta >> (WHEEL_BITS * WHEEL_LEVELS)) {
+        delta = (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        at = wheel_tick + delta;
+    }
+
+    while (level < WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * (level + 1)))
+        level++;
+    slot = &wheel[level][(at >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+    if (slot->len == slot->cap) {
+        __u32 cap = slot->cap ? slot->cap * 2 : 16;
+        struct wheel_timer *timers;
+
+        timers = realloc(slot->timers, cap * sizeof(*timers));
+        if (!timers)
+            return -1;
+        slot->timers = timers;
+        slot->cap = cap;
+    }
+
+    slot->timers[slot->len].ip = *ip;
+    slot->timers[slot->len].vlan_id = vlan_id;
+    slot->timers[slot->len].expires = expires;
+    slot->len++;
+    wheel_timers++;
+    return 0;
+}
+
+// Moves the timers of the current slot of a level down to the lower levels
+static void wheel_cascade(int level)
+{
+    struct wheel_slot *slot;
+    struct wheel_slot due;
+
+    slot = &wheel[level][(wheel_tick >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    due = *slot;
+    memset(slot, 0, sizeof(*slot));
+    wheel_timers -= due.len;
+
+    for (__u32 i = 0; i < due.len; i++) {
+        if (wheel_add(&due.timers[i].ip, due.timers[i].vlan_id,
+                      due.timers[i].expires))
+            pr_err(errno, "Failed to cascade a refresh timer");
+    }
+    free(due.timers);
+}
+
+static __u32 refresh_interval(const struct neigh_entry *neigh)
+{
+    int family = !IN6_IS_ADDR_V4MAPPED(&neigh->ip);
+    struct link_info *link = link_cache_get(neigh->ifindex);
+    __u64 ms = base_reachable_ms[family];
+
+    if (link && link->base_reachable_ms[family])
+        ms = link->base_reachable_ms[family];
+
+    ms = ms * 3 / 8 / WHEEL_TICK_MS;
+    return ms ? ms : 1;
+}
+
+static void refresh_schedule(struct neigh_entry *neigh, __u64 now)
+{
+    neigh->asserted = now;
+    neigh->expires = now + refresh_interval(neigh);
+    if (wheel_add(&neigh->ip, neigh->vlan_id, neigh->expires)) {
+        pr_err(errno, "Failed to schedule the refresh of %s",
+               fmt_ip(&neigh->ip));
+        neigh->installed = false;
+    }
+}
+
+// Starts refreshing a neighbor that was just installed on ifindex
+void refresh_track(struct neigh_entry *neigh, __u32 ifindex)
+{
+    // A dry run installs nothing that could go stale
+    if (env.dry_run)
+        return;
+
+    neigh->installed = true;
+    neigh_table_link(neigh, ifindex);
+
+    // The kernel keeps managed neighbors resolved without any refreshes
+    if (env.managed)
+        return;
+    refresh_schedule(neigh, refresh_clock());
+}
+
+// Stops refreshing a neighbor the kernel removed or failed to resolve
+void refresh_forget(const struct in6_addr *ip, __u32 ifindex)
+{
+    struct neigh_entry *neigh = neigh_table_find(ip, ifindex);
+
+    if (!neigh || !neigh->installed)
+        return;
+
+    pr_debug("Neighbor %s was removed from %d, no longer refreshing it\n",
+             fmt_ip(ip), ifindex);
+    neigh->installed = false;
+}
+
+void refresh_set_reachable(int family, __u32 ifindex, __u64 ms)
+{
+    struct link_info *link;
+    int i = family == AF_INET6;
+
+    if (family != AF_INET && family != AF_INET6)
+        return;
+    if (ms > UINT32_MAX)
+        ms = UINT32_MAX;
+
+    if (!ifindex) {
+        base_reachable_ms[i] = ms;
+        return;
+    }
+
+    link = link_cache_get(ifindex);
+    if (link)
+        link->base_reachable_ms[i] = ms;
+}
+
+// The next snooped reply installs the neighbor again through the work queue
+static void refresh_fail(int index)
+{
+    struct wheel_timer *key = &batch.keys[index];
+    struct neigh_entry *neigh;
+
+    neigh = neigh_table_get(&key->ip, key->vlan_id, false);
+    if (neigh)
+        neigh->installed = false;
+    stats.failed++;
+}
+
+static void refresh_batch_err(int index, int error, void *data)
+{
+    pr_err(error, "Failed to refresh neighbor %s",
+           fmt_ip(&batch.keys[index].ip));
+    refresh_fail(index);
+}
+
+static void refresh_flush(void)
+{
+    __u64 now = refresh_clock();
+
+    if (!batch.count)
+        return;
+
+    if (nl_request_batch(NL_SOCK_WRITE, batch.buf, batch.len, batch.count,
+                         refresh_batch_err, NULL)) {
+        pr_err(errno, "Failed to send a batch of %d refreshes", batch.count);
+        for (int i = 0; i < batch.count; i++)
+            refresh_fail(i);
+    }
+    stats.batches++;
+
+    for (int i = 0; i < batch.count; i++) {
+        struct neigh_entry *neigh = neigh_table_get(&batch.keys[i].ip,
+                                                    batch.keys[i].vlan_id,
+                                                    false);
+        if (!neigh || !neigh->installed)
+            continue;
+        refresh_schedule(neigh, now);
+        stats.refreshed++;
+    }
+
+    batch.len = 0;
+    batch.count = 0;
+}
+
+static void refresh_queue(struct neigh_entry *neigh)
+{
+    nl_put_neigh(batch.buf + batch.len, RTM_NEWNEIGH,
+                 NLM_F_CREATE | NLM_F_REPLACE, neigh->ifindex, &neigh->ip,
+                 neigh->mac, neigh->vlan_id);
+    batch.len += NLMSG_ALIGN(((struct nlmsghdr *)(batch.buf +
+                                                  batch.len))->nlmsg_len);
+    batch.keys[batch.count].ip = neigh->ip;
+    batch.keys[batch.count].vlan_id = neigh->vlan_id;
+    batch.count++;
+
+    if (batch.count == REFRESH_BATCH)
+        refresh_flush();
+}
+
+static void wheel_expire(struct wheel_slot *slot)
+{
+    struct wheel_slot due = *slot;
+
+    memset(slot, 0, sizeof(*slot));
+    wheel_timers -= due.len;
+
+    for (__u32 i = 0; i < due.len; i++) {
+        struct wheel_timer *timer = &due.timers[i];
+        struct neigh_entry *neigh;
+
+        neigh = neigh_table_get(&timer->ip, timer->vlan_id, false);
+        if (!neigh || !neigh->installed || neigh->expires != timer->expires)
+            continue;
+
+        // Only neighbors that replied since the last refresh are kept
+        if (neigh->seen <= neigh->asserted)
+            refresh_seen_in_bpf(neigh);
+        if (neigh->seen <= neigh->asserted) {
+            pr_debug("Neighbor %s is no longer snooped, leaving it to age "
+                     "out\n", fmt_ip(&neigh->ip));
+            neigh->installed = false;
+            stats.expired++;
+            continue;
+        }
+
+        neigh->expires = 0; // In flight until the batch is acknowledged
+        refresh_queue(neigh);
+    }
+
+    // Keep the allocation for the next round of the slot
+    if (!slot->timers) {
+        due.len = 0;
+        *slot = due;
+    } else {
+        free(due.timers);
+    }
+}
+
+// Runs the ticks that have passed and refreshes the neighbors that are due
+void refresh_run(void)
+{
+    __u64 now = refresh_clock();
+
+    if (!wheel_timers)
+        return;
+
+    while (wheel_tick <= now) {
+        __u32 idx = wheel_tick & WHEEL_MASK;
+
+        for (int level = 1; !idx && level < WHEEL_LEVELS; level++) {
+            wheel_cascade(level);
+            idx = (wheel_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        }
+        wheel_expire(&wheel[0][wheel_tick & WHEEL_MASK]);
+        wheel_tick++;
+    }
+    refresh_flush();
+}
+
+/*
+ * Milliseconds until the next tick with due timers or a cascade, for the
+ * main loop to sleep, or -1 when there is nothing to refresh.
+ */
+int refresh_timeout(void)
+{
+    __u64 next = wheel_tick;
+    __u64 now;
+
+    if (!wheel_timers)
+        return -1;
+
+    while (next & WHEEL_MASK && !wheel[0][next & WHEEL_MASK].len)
+        next++;
+
+    now = now_ms();
+    if (next * WHEEL_TICK_MS <= now)
+        return 0;
+    return next * WHEEL_TICK_MS - now;
+}
+
+void refresh_free(void)
+{
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int i = 0; i < WHEEL_SLOTS; i++)
+            free(wheel[level][i].timers);
+    }
+    memset(wheel, 0, sizeof(wheel));
+    wheel_timers = 0;
+}
+
+void refresh_print_stats(void)
+{
+    pr_info("Refresh: %u timers, %llu refreshed, %llu expired, %llu failed "
+            "in %llu batches\n", wheel_timers, stats.refreshed,
+            stats.expired, stats.failed, stats.batches);
+}
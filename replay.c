@@ -0,0 +1,263 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is> */
+/* SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com> */
+/* SPDX-FileContributor: Freysteinn Alfredsson <freysteinn@freysteinn.com> */
+/* SPDX-FileContributor: Julius Thor Bess Rikardsson <juliusbess@gmail.com> */
+
+/*
+ * Offline replay of capture files through the userspace pipeline. Frames are
+ * either parsed in userspace with the same parsers as the BPF program, or run
+ * through the loaded XDP program with BPF_PROG_TEST_RUN and read back from
+ * the ring buffer. Run the daemon inside a scratch network namespace to let
+ * it install neighbors, or with --dry-run to only report what it would do.
+ *
+ * The timers run on the capture clock: now_ms() returns the time of the
+ * frame being replayed, and the tick does the periodic work of the main loop
+ * after every batch. Damping and the notifications of the netlink mock then
+ * play out as they did in the capture, however fast it is replayed.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "neighsnoopd.h"
+#include "neighsnoopd_shared.h"
+
+extern struct env env;
+
+static struct neighbor_reply replay_reply;
+static replay_tick_t replay_tick;
+
+// The userspace parsers fill in a single reusable record
+static inline struct neighbor_reply *neighbor_reply_reserve(void)
+{
+    memset(&replay_reply, 0, sizeof(replay_reply));
+    return &replay_reply;
+}
+
+// Parse like the BPF program specialised for the same options
+#define PARSE_IPV4 (!env.only_ipv6)
+#define PARSE_IPV6 (!env.only_ipv4)
+#define VLAN_PARSE_DEPTH env.vlan_depth
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunknown-pragmas" // #pragma unroll
+#include "neighsnoopd_parse.h"
+#pragma GCC diagnostic pop
+
+static const char *stage_names[REPLAY_STAGE_MAX] = {
+    [REPLAY_STAGE_PARSE] = "parse",
+    [REPLAY_STAGE_LOOKUP] = "lookup",
+    [REPLAY_STAGE_FDB] = "fdb",
+    [REPLAY_STAGE_INSTALL] = "install",
+};
+
+static struct {
+    __u64 frames;
+    __u64 events;
+    __u64 stage_ns[REPLAY_STAGE_MAX];
+    __u64 stage_count[REPLAY_STAGE_MAX];
+} stats;
+
+static __u64 now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Stage timestamps are only taken while replaying
+__u64 replay_stage_start(void)
+{
+    if (!env.replay_file)
+        return 0;
+    return now_ns();
+}
+
+void replay_stage_end(enum replay_stage stage, __u64 *start)
+{
+    __u64 now;
+
+    if (!env.replay_file)
+        return;
+
+    now = now_ns();
+    stats.stage_ns[stage] += now - *start;
+    stats.stage_count[stage]++;
+    *start = now;
+}
+
+static struct neighbor_reply *replay_parse(const struct pcap_frame *frame)
+{
+    void *data = (void *)frame->data;
+    void *data_end = data + frame->len;
+    struct neighbor_reply *neighbor_reply;
+    struct collect_vlans vlans = { 0 };
+    struct hdr_cursor nh = { .pos = data };
+    struct ethhdr *eth;
+    int eth_type;
+
+    eth_type = parse_ethhdr_vlan(&nh, data_end, &eth, &vlans);
+
+    neighbor_reply = parse_neighbor_reply(&nh, data_end, eth, eth_type);
+    if (!neighbor_reply)
+        return NULL;
+
+    // Captures hold the VLAN tags in the packet, as XDP sees them
+    neighbor_reply->vlan_id = vlans.id[0];
+    neighbor_reply->ingress_ifindex = env.ifidx_mon;
+    return neighbor_reply;
+}
+
+struct replay_sample {
+    replay_handler_t handler;
+};
+
+/*
+ * The handler queues the reply. Like the main loop after a ring buffer poll,
+ * the queue is run once WORKQ_BATCH replies have arrived, so that
+ * coalescing, shedding and eviction see the same bursts, and then the timers.
+ */
+static int replay_handle(replay_handler_t handler, void *data,
+                         size_t data_sz)
+{
+    stats.events++;
+    handler(NULL, data, data_sz);
+    if (stats.events % WORKQ_BATCH == 0) {
+        workq_run(WORKQ_BATCH);
+        replay_tick();
+    }
+    return 0;
+}
+
+static int replay_record(void *ctx, void *data, size_t data_sz)
+{
+    struct replay_sample *sample = ctx;
+
+    return replay_handle(sample->handler, data, data_sz);
+}
+
+static int replay_ringbuf_cb(void *ctx, void *data, size_t data_sz)
+{
+    record_decode(data, data_sz, replay_record, ctx);
+    return 0;
+}
+
+static void replay_report(__u64 elapsed_ns)
+{
+    double secs = elapsed_ns / 1e9;
+
+    // Only installed neighbors complete the install stage
+    pr_info("Replayed %llu frames, %llu events, %llu %s in %.3f s\n",
+            stats.frames, stats.events,
+            stats.stage_count[REPLAY_STAGE_INSTALL],
+            env.dry_run ? "would be installed" : "installed", secs);
+    pr_info("Throughput: %.0f frames/s, %.0f events/s\n",
+            secs > 0 ? stats.frames / secs : 0,
+            secs > 0 ? stats.events / secs : 0);
+
+    for (int i = 0; i < REPLAY_STAGE_MAX; i++) {
+        if (!stats.stage_count[i])
+            continue;
+        pr_info("Stage %-7s %10llu samples %10.1f ns avg\n", stage_names[i],
+                stats.stage_count[i],
+                (double)stats.stage_ns[i] / stats.stage_count[i]);
+    }
+    workq_print_stats();
+}
+
+/*
+ * Replays every frame of a capture file through the handler, and runs the
+ * tick after every batch. With a program fd and ring buffer the frames are
+ * run through the BPF program, which reports its own duration as the parse
+ * stage, otherwise they are parsed in userspace. Returns 0 on success or -1
+ * with errno set.
+ */
+int replay_run(const char *path, replay_handler_t handler, replay_tick_t tick,
+               int prog_fd, int ringbuf_fd,
+               const volatile sig_atomic_t *exiting)
+{
+    struct replay_sample sample = { .handler = handler };
+    struct ring_buffer *rb = NULL;
+    struct pcap_frame frame;
+    struct pcap_file *pcap;
+    __u64 start;
+    int err = -1;
+    int ret = 0;
+
+    pcap = pcap_open(path);
+    if (!pcap) {
+        pr_err(errno, "Failed to open %s", path);
+        return -1;
+    }
+
+    if (prog_fd >= 0) {
+        rb = ring_buffer__new(ringbuf_fd, replay_ringbuf_cb, &sample, NULL);
+        if (!rb) {
+            pr_err(errno, "Failed to create ring buffer");
+            goto out;
+        }
+    }
+
+    pr_info("Replaying %s through the %s parser%s\n", path,
+            rb ? "BPF" : "userspace", env.dry_run ? " (dry run)" : "");
+
+    replay_tick = tick;
+    start = now_ns();
+    while (!*exiting && (ret = pcap_next(pcap, &frame)) == 1) {
+        stats.frames++;
+        now_ms_set(frame.ts_ns / 1000000);
+
+        if (rb) {
+            LIBBPF_OPTS(bpf_test_run_opts, opts,
+                        .data_in = frame.data,
+                        .data_size_in = frame.len,
+                        .repeat = 1);
+
+            if (bpf_prog_test_run_opts(prog_fd, &opts)) {
+                pr_err(errno, "Test run of frame %llu failed", stats.frames);
+                goto out;
+            }
+            stats.stage_ns[REPLAY_STAGE_PARSE] += opts.duration;
+            stats.stage_count[REPLAY_STAGE_PARSE]++;
+
+            if (ring_buffer__consume(rb) < 0)
+                pr_err(errno, "Error consuming ring buffer");
+        } else {
+            __u64 ts = now_ns();
+            struct neighbor_reply *neighbor_reply = replay_parse(&frame);
+
+            replay_stage_end(REPLAY_STAGE_PARSE, &ts);
+            if (neighbor_reply)
+                replay_handle(handler, neighbor_reply,
+                              sizeof(*neighbor_reply));
+        }
+
+        if (env.has_count && env.count <= 0)
+            break;
+    }
+
+    if (ret < 0) {
+        pr_err(errno, "Malformed capture file %s", path);
+        goto out;
+    }
+
+    while (workq_run(WORKQ_BATCH))
+        ;
+    replay_tick();
+
+    replay_report(now_ns() - start);
+    err = 0;
+out:
+    now_ms_reset();
+    ring_buffer__free(rb);
+    pcap_close(pcap);
+    return err;
+}
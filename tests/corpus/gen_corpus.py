@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-or-later
+# SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is>
+# SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com>
+"""
+Generates the pcap corpus used by the BPF parser tests, the replay mode and
+the fuzzers. Each file holds a single frame of one frame class. The expected
+parse results are listed in tests/test_bpf.c.
+
+Usage: gen_corpus.py [OUTPUT_DIR]
+"""
+
+import os
+import struct
+import sys
+
+ETH_P_IP = 0x0800
+ETH_P_ARP = 0x0806
+ETH_P_8021Q = 0x8100
+ETH_P_8021AD = 0x88a8
+ETH_P_IPV6 = 0x86dd
+
+EPOCH = 1700000000  # Seconds of the first frame in a capture
+
+BCAST = bytes.fromhex("ffffffffffff")
+ROUTER_MAC = bytes.fromhex("0200000000fe")
+HOST_MAC = bytes.fromhex("02000000000a")
+NA_TLLA_MAC = bytes.fromhex("020000000010")
+NA_SRC_MAC = bytes.fromhex("020000000011")
+
+HOST_IP4 = bytes([192, 0, 2, 10])
+ROUTER_IP4 = bytes([192, 0, 2, 1])
+HOST_IP6 = bytes.fromhex("20010db8000000000000000000000010")
+ROUTER_IP6 = bytes.fromhex("20010db8000000000000000000000001")
+ALL_NODES_IP6 = bytes.fromhex("ff020000000000000000000000000001")
+
+
+def eth(dst, src, ethertype, payload, vlans=()):
+    """Ethernet frame with (tpid, vid) tags from the outermost inwards."""
+    frame = dst + src
+    for tpid, vid in vlans:
+        frame += struct.pack("!HH", tpid, vid)
+    return frame + struct.pack("!H", ethertype) + payload
+
+
+def arp(op, sha, spa, tha, tpa):
+    return struct.pack("!HHBBH", 1, ETH_P_IP, 6, 4, op) + sha + spa + tha + tpa
+
+
+def checksum(data):
+    if len(data) % 2:
+        data += b"\0"
+    total = sum(struct.unpack("!%dH" % (len(data) // 2), data))
+    while total >> 16:
+        total = (total & 0xffff) + (total >> 16)
+    return ~total & 0xffff
+
+
+def icmp6(src, dst, payload):
+    pseudo = src + dst + struct.pack("!I3xB", len(payload), 58)
+    csum = checksum(pseudo + payload)
+    return payload[:2] + struct.pack("!H", csum) + payload[4:]
+
+
+def na(target, tlla=None):
+    # Type 136, code 0, checksum, flags (solicited, override)
+    msg = struct.pack("!BBHI", 136, 0, 0, 0x60000000) + target
+    if tlla:
+        msg += struct.pack("!BB", 2, 1) + tlla
+    return msg
+
+
+def ipv6(src, dst, next_hdr, payload, hop_limit=255):
+    return struct.pack("!IHBB", 0x60000000, len(payload), next_hdr,
+                       hop_limit) + src + dst + payload
+
+
+def na_frame(src_mac, tlla=None, hbh=False, vlans=()):
+    msg = icmp6(HOST_IP6, ALL_NODES_IP6, na(HOST_IP6, tlla))
+    if hbh:
+        # Hop-by-hop header with a PadN option, followed by ICMPv6
+        ext = struct.pack("!BBBB4x", 58, 0, 1, 4)
+        packet = ipv6(HOST_IP6, ALL_NODES_IP6, 0, ext + msg)
+    else:
+        packet = ipv6(HOST_IP6, ALL_NODES_IP6, 58, msg)
+    return eth(bytes.fromhex("333300000001"), src_mac, ETH_P_IPV6, packet,
+               vlans)
+
+
+def arp_reply_frame(vlans=()):
+    return eth(ROUTER_MAC, HOST_MAC, ETH_P_ARP,
+               arp(2, HOST_MAC, HOST_IP4, ROUTER_MAC, ROUTER_IP4), vlans)
+
+
+CORPUS = {
+    "arp_untagged": arp_reply_frame(),
+    "arp_vlan": arp_reply_frame(vlans=[(ETH_P_8021Q, 100)]),
+    "arp_qinq": arp_reply_frame(vlans=[(ETH_P_8021AD, 200),
+                                       (ETH_P_8021Q, 100)]),
+    "arp_request": eth(BCAST, HOST_MAC, ETH_P_ARP,
+                       arp(1, HOST_MAC, HOST_IP4, bytes(6), ROUTER_IP4)),
+    "na_tlla": na_frame(ROUTER_MAC, tlla=NA_TLLA_MAC),
+    "na_no_tlla": na_frame(NA_SRC_MAC),
+    "na_vlan": na_frame(ROUTER_MAC, tlla=NA_TLLA_MAC,
+                        vlans=[(ETH_P_8021Q, 100)]),
+    "na_exthdr": na_frame(ROUTER_MAC, tlla=NA_TLLA_MAC, hbh=True),
+    "arp_truncated": arp_reply_frame()[:14 + 8 + 4],
+    "na_truncated": na_frame(ROUTER_MAC, tlla=NA_TLLA_MAC)[:14 + 40 + 12],
+}
+
+
+def write_pcap(path, frames, times=None):
+    """Frame i is stamped times[i] seconds after EPOCH, or i microseconds."""
+    with open(path, "wb") as f:
+        f.write(struct.pack("<IHHiIII", 0xa1b2c3d4, 2, 4, 0, 0, 65535, 1))
+        for i, frame in enumerate(frames):
+            usec = round(times[i] * 1000000) if times else i
+            f.write(struct.pack("<IIII", EPOCH + usec // 1000000,
+                                usec % 1000000, len(frame), len(frame)))
+            f.write(frame)
+
+
+def main():
+    out = sys.argv[1] if len(sys.argv) > 1 else os.path.dirname(
+        os.path.abspath(__file__))
+    for name, frame in CORPUS.items():
+        write_pcap(os.path.join(out, name + ".pcap"), [frame])
+
+
+if __name__ == "__main__":
+    main()
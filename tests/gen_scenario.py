@@ -0,0 +1,219 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-or-later
+# SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is>
+# SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com>
+"""
+Writes the capture of a replay scenario for tests/test_scenario.sh, and the
+notifications the netlink mock sends during it to the events file. Prints
+what the daemon should do, in order, as "add IP MAC" lines for the neighbors
+it installs and "del IP" lines for the ones it deletes, followed by the
+neighsnoopd options the scenario needs on a line starting with "args:".
+
+The hosts are the ones the netlink mock serves with svis=1,hosts=32,ext=0:
+host i of VLAN 100 has fd00:64::<i + 2> and MAC 02:00:00:64:00:<i>, and any
+of those MACs is local to the VLAN. Replay runs the work queue and then the
+timers after every 64 replies, so the scenarios are laid out in batches of
+that size, and a batch takes effect at the time of its last reply.
+
+Scenarios:
+  workq     priority order, coalescing, supersession, shedding and eviction
+            in the work queue, and the sweep of a neighbor table full of
+            spoofed entries
+  damping   a flapping neighbor held back, then released with its newest MAC
+  reconcile an FDB entry moving to a remote VTEP deletes only the neighbors
+            the daemon still owns
+
+Usage: gen_scenario.py SCENARIO --output FILE --events FILE
+"""
+
+import argparse
+import os
+import socket
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                "corpus"))
+from gen_corpus import (BCAST, EPOCH, ETH_P_8021Q, ETH_P_ARP,  # noqa
+                        ETH_P_IPV6, arp, eth, icmp6, ipv6, na, write_pcap)
+
+VID = 100
+BATCH = 64  # WORKQ_BATCH
+NEIGH_ROOM = 1 << 17  # Neighbors in a full table, see neighs.c
+ALL_NODES_MAC = bytes.fromhex("333300000001")
+ALL_NODES_IP6 = socket.inet_pton(socket.AF_INET6, "ff02::1")
+GW4 = bytes([10, VID >> 8, VID & 0xff, 1])
+
+
+def host_ip(i):
+    return "fd00:%x::%x" % (VID, i + 2)
+
+
+def host_mac(i):
+    return "02:00:00:%02x:00:%02x" % (VID, i)
+
+
+def reply(i, mac):
+    """Unsolicited NA of host i with MAC address index mac."""
+    ip = socket.inet_pton(socket.AF_INET6, host_ip(i))
+    src = bytes.fromhex(host_mac(mac).replace(":", ""))
+    msg = icmp6(ip, ALL_NODES_IP6, na(ip, src))
+    return eth(ALL_NODES_MAC, src, ETH_P_IPV6,
+               ipv6(ip, ALL_NODES_IP6, 58, msg), [(ETH_P_8021Q, VID)])
+
+
+def spoof(n):
+    """ARP reply from an address outside every SVI subnet."""
+    ip = bytes([192, 168 + (n >> 16), (n >> 8) & 0xff, n & 0xff])
+    src = bytes.fromhex(host_mac(0).replace(":", ""))
+    return eth(BCAST, src, ETH_P_ARP, arp(2, src, ip, BCAST, GW4),
+               [(ETH_P_8021Q, VID)])
+
+
+def batch(frames, pad):
+    """Fills a batch up with replies that coalesce without side effects."""
+    assert len(frames) <= BATCH
+    return frames + [pad] * (BATCH - len(frames))
+
+
+class Scenario:
+    def __init__(self, options):
+        self.options = options
+        self.frames = []
+        self.times = []
+        self.expected = []
+        self.events = []
+
+    def replay(self, t, frames):
+        """Replays frames t seconds into the capture."""
+        self.frames += frames
+        self.times += [t] * len(frames)
+
+    def add(self, i, mac):
+        self.expected.append("add %s %s" % (host_ip(i), host_mac(mac)))
+
+    def delete(self, i):
+        self.expected.append("del %s" % host_ip(i))
+
+    def notify(self, t, event):
+        """Has the mock send a notification t seconds into the capture."""
+        self.events.append("%d %s" % (EPOCH * 1000 + round(t * 1000), event))
+
+
+def scenario_workq():
+    s = Scenario("--queue-size 8")
+    frames = []
+
+    # Hosts 0-7 are queued once each, duplicates of host 0 coalesce
+    frames += batch([reply(i, i) for i in range(8)], reply(0, 0))
+    for i in range(8):
+        s.add(i, i)
+
+    # With a queue of 8, refreshes are shed once 6 are queued. Host 0 moves
+    # to 9 and 10, and its refresh in between is superseded. Host 1 moves to
+    # 11 and back, and the refresh back is evicted by the new binding of host
+    # 11. It stays the newest reply, so the move to 11 is superseded as well.
+    # The refresh of host 2 is shed, so its move to 12 goes through. Host 12
+    # finds the queue full without a refresh to evict. Changes are installed
+    # before new bindings, whatever their order of arrival.
+    frames += batch([
+        reply(8, 8),
+        reply(0, 9),
+        reply(0, 0),
+        reply(0, 10),
+        reply(1, 1),  # A refresh of an installed neighbor coalesces
+        reply(1, 11),
+        reply(1, 1),
+        reply(2, 12),
+        reply(2, 2),  # Shed
+        reply(9, 13),
+        reply(10, 14),  # Evicts the refresh of host 0
+        reply(11, 15),  # Evicts the refresh of host 1
+        reply(12, 16),  # Dropped
+    ], reply(3, 3))
+    for i, mac in [(0, 10), (2, 12), (8, 8), (9, 13), (10, 14), (11, 15)]:
+        s.add(i, mac)
+
+    # A neighbor table full of spoofed senders is swept, so host 13 is
+    # tracked and its duplicates coalesce into one install
+    spoofs = [spoof(n) for n in range(NEIGH_ROOM)]
+    spoofs += [reply(3, 3)] * (-len(spoofs) % BATCH)
+    frames += spoofs
+    frames += batch([reply(13, 17)] * 3, reply(3, 3))
+    s.add(13, 17)
+
+    s.replay(0, frames)
+    return s
+
+
+def scenario_damping():
+    # A move adds 1000 to a penalty that halves every second. The second
+    # move within a second crosses 1500 and suppresses the neighbor, and it
+    # is released at the first check after the penalty decayed below 1000.
+    s = Scenario("--damping half-life=1,max-suppress=4,suppress=1500,"
+                 "reuse=1000")
+
+    s.replay(0, batch([reply(0, 0), reply(1, 1)], reply(1, 1)))
+    s.add(0, 0)
+    s.add(1, 1)
+
+    s.replay(0.1, batch([reply(0, 1)], reply(1, 1)))
+    s.add(0, 1)
+
+    # Held back: the move back to 0 and the move on to 2
+    s.replay(0.2, batch([reply(0, 0)], reply(1, 1)))
+    s.replay(0.3, batch([reply(0, 2)], reply(1, 1)))
+
+    # The penalty is 2874 at 0.3 s, and has decayed to 445 by the next check
+    s.replay(3, batch([], reply(1, 1)))
+    s.add(0, 2)
+    return s
+
+
+def scenario_reconcile():
+    s = Scenario("")
+
+    # Hosts 4 and 5 share MAC 20, host 6 has MAC 21
+    s.replay(0, batch([reply(4, 20), reply(5, 20), reply(6, 21)],
+                      reply(6, 21)))
+    s.add(4, 20)
+    s.add(5, 20)
+    s.add(6, 21)
+
+    # Someone else points host 5 elsewhere, so the daemon no longer owns it.
+    # MAC 21 is relearned locally and MAC 20 moves to a remote VTEP, which
+    # deletes host 4 alone.
+    s.notify(0.1, "neigh br0.%d %s %s" % (VID, host_ip(5), host_mac(22)))
+    s.notify(0.1, "fdb %s %d local" % (host_mac(21), VID))
+    s.notify(0.1, "fdb %s %d ext" % (host_mac(20), VID))
+    s.replay(0.2, batch([], reply(6, 21)))
+    s.delete(4)
+    return s
+
+
+SCENARIOS = {
+    "workq": scenario_workq,
+    "damping": scenario_damping,
+    "reconcile": scenario_reconcile,
+}
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("scenario", choices=SCENARIOS)
+    parser.add_argument("--output", required=True)
+    parser.add_argument("--events", required=True)
+    args = parser.parse_args()
+
+    s = SCENARIOS[args.scenario]()
+    write_pcap(args.output, s.frames, s.times)
+    with open(args.events, "w") as f:
+        for event in s.events:
+            print(event, file=f)
+    for line in s.expected:
+        print(line)
+    print("args:", s.options)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,414 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is> */
+/* SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com> */
+/* SPDX-FileContributor: Freysteinn Alfredsson <freysteinn@freysteinn.com> */
+/* SPDX-FileContributor: Julius Thor Bess Rikardsson <juliusbess@gmail.com> */
+
+/*
+ * Runs the corpus frames through handle_neighbor_reply_xdp and
+ * handle_neighbor_reply_tc with BPF_PROG_TEST_RUN, decodes and checks the
+ * ring buffer records they produce and reports the kernel measured
+ * ns/packet of each frame class. No network device is needed, but loading
+ * BPF requires root.
+ *
+ * The options load the variants of the program the daemon can load, so that
+ * the verifier sees the code they enable: -b stages NUM replies per sample
+ * as --batch does, -f resolves the SVI in TC as --fib does, -H counts the
+ * heavy hitters and -l enables rate limits too high to drop a test run.
+ *
+ * With -H, ten heavy sources are then mixed with 50000 light ones, and
+ * hitters.c has to rank the heavy ones first without undercounting them.
+ *
+ * Usage: test_bpf [-d CORPUS_DIR] [-r REPEAT] [-b NUM] [-f] [-H] [-l]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <net/if_arp.h>
+#include <linux/if_ether.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "neighsnoopd.h"
+#include "neighsnoopd_shared.h"
+#include "neighsnoopd.bpf.skel.h"
+
+struct env env = {0};
+
+struct corpus_entry {
+    const char *name;
+    bool has_record;
+    __u8 in_family;
+    const char *ip;
+    const char *mac;
+    __u16 xdp_vlan_id; // TC only sees accelerated tags, which test runs lack
+};
+
+// Expected results for the frames written by tests/corpus/gen_corpus.py
+static const struct corpus_entry corpus[] = {
+    { "arp_untagged", true, AF_INET, "192.0.2.10", "02:00:00:00:00:0a", 0 },
+    { "arp_vlan", true, AF_INET, "192.0.2.10", "02:00:00:00:00:0a", 100 },
+    { "arp_qinq", true, AF_INET, "192.0.2.10", "02:00:00:00:00:0a", 200 },
+    { "arp_request", false },
+    { "arp_truncated", false },
+    { "na_tlla", true, AF_INET6, "2001:db8::10", "02:00:00:00:00:10", 0 },
+    { "na_no_tlla", true, AF_INET6, "2001:db8::10", "02:00:00:00:00:11", 0 },
+    { "na_vlan", true, AF_INET6, "2001:db8::10", "02:00:00:00:00:10", 100 },
+    { "na_exthdr", true, AF_INET6, "2001:db8::10", "02:00:00:00:00:10", 0 },
+    { "na_truncated", false },
+};
+
+// Longer than REPLY_STAGE_DELAY_NS, so the stage timers have fired
+#define STAGE_WAIT_NS 20000000
+
+#define HEAVY_SOURCES HITTERS_TOP
+#define LIGHT_SOURCES 50000
+#define HITTER_ROUNDS 50
+
+struct records {
+    int count;
+    int malformed;
+    struct neighbor_reply first;
+};
+
+static int handle_record(void *ctx, void *data, size_t data_sz)
+{
+    struct records *records = ctx;
+
+    if (records->count++ == 0)
+        memcpy(&records->first, data, sizeof(records->first));
+    return 0;
+}
+
+static int handle_sample(void *ctx, void *data, size_t data_sz)
+{
+    struct records *records = ctx;
+
+    if (record_decode(data, data_sz, handle_record, ctx) < 0)
+        records->malformed++;
+    return 0;
+}
+
+static bool check_record(const struct corpus_entry *entry, bool is_xdp,
+                         const struct records *records, int repeat)
+{
+    const struct neighbor_reply *reply = &records->first;
+    struct in6_addr ip;
+    __u16 vlan_id = is_xdp ? entry->xdp_vlan_id : 0;
+
+    if (records->malformed)
+        return false;
+    if (!entry->has_record)
+        return records->count == 0;
+
+    if (records->count != repeat)
+        return false;
+
+    if (entry->in_family == AF_INET) {
+        struct in_addr ipv4;
+        inet_pton(AF_INET, entry->ip, &ipv4);
+        map_ipv4_to_ipv6(&ip, ipv4.s_addr);
+    } else {
+        inet_pton(AF_INET6, entry->ip, &ip);
+    }
+
+    return reply->in_family == entry->in_family &&
+        memcmp(&reply->ip, &ip, sizeof(ip)) == 0 &&
+        strcmp(fmt_mac(reply->mac), entry->mac) == 0 &&
+        reply->vlan_id == vlan_id;
+}
+
+static bool run_entry(struct neighsnoopd_bpf *skel, struct ring_buffer *rb,
+                      struct records *records, const char *dir,
+                      const struct corpus_entry *entry, int repeat,
+                      bool batched)
+{
+    const struct timespec stage_wait = { .tv_nsec = STAGE_WAIT_NS };
+    struct bpf_program *progs[] = {
+        skel->progs.handle_neighbor_reply_xdp,
+        skel->progs.handle_neighbor_reply_tc,
+    };
+    struct pcap_frame frame;
+    struct pcap_file *pcap;
+    char path[4096];
+    bool passed = true;
+
+    snprintf(path, sizeof(path), "%s/%s.pcap", dir, entry->name);
+    pcap = pcap_open(path);
+    if (!pcap) {
+        pr_err(errno, "Failed to open %s", path);
+        return false;
+    }
+
+    if (pcap_next(pcap, &frame) != 1) {
+        pr_err(errno, "No frame in %s", path);
+        pcap_close(pcap);
+        return false;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        bool is_xdp = i == 0;
+        LIBBPF_OPTS(bpf_test_run_opts, opts,
+                    .data_in = frame.data,
+                    .data_size_in = frame.len,
+                    .repeat = repeat);
+        bool ok;
+
+        memset(records, 0, sizeof(*records));
+        if (bpf_prog_test_run_opts(bpf_program__fd(progs[i]), &opts)) {
+            pr_err(errno, "Test run of %s failed", entry->name);
+            passed = false;
+            continue;
+        }
+        // The last records of a batch wait for the stage timer
+        if (batched)
+            nanosleep(&stage_wait, NULL);
+        ring_buffer__consume(rb);
+
+        ok = check_record(entry, is_xdp, records, repeat);
+        passed &= ok;
+        printf("%-4s %-14s %6u ns/pkt %s\n", is_xdp ? "xdp" : "tc",
+               entry->name, opts.duration, ok ? "PASS" : "FAIL");
+    }
+
+    pcap_close(pcap);
+    return passed;
+}
+
+// ARP reply of the source 198.18.0.0 + ip, which has the MAC 02:00:<ip>
+static void build_arp_reply(__u8 *frame, __u32 ip)
+{
+    __u8 mac[ETH_ALEN] = { 0x02, 0x00 };
+    __be32 sip = htonl(0xc6120000 | ip);
+    __be32 tip = htonl(0xc0000201);
+    struct arphdr *arp;
+    struct ethhdr *eth;
+
+    memcpy(&mac[2], &sip, sizeof(sip));
+    memset(frame, 0, sizeof(*eth) + sizeof(*arp) + 20);
+
+    eth = (struct ethhdr *)frame;
+    memset(eth->h_dest, 0xff, ETH_ALEN);
+    memcpy(eth->h_source, mac, ETH_ALEN);
+    eth->h_proto = htons(ETH_P_ARP);
+
+    arp = (struct arphdr *)(eth + 1);
+    arp->ar_hrd = htons(ARPHRD_ETHER);
+    arp->ar_pro = htons(ETH_P_IP);
+    arp->ar_hln = ETH_ALEN;
+    arp->ar_pln = sizeof(sip);
+    arp->ar_op = htons(ARPOP_REPLY);
+    memcpy(arp + 1, mac, ETH_ALEN);
+    memcpy((__u8 *)(arp + 1) + ETH_ALEN, &sip, sizeof(sip));
+    memcpy((__u8 *)(arp + 1) + 2 * ETH_ALEN + sizeof(sip), &tip,
+           sizeof(tip));
+}
+
+static int run_source(struct neighsnoopd_bpf *skel, struct ring_buffer *rb,
+                      __u32 ip, int repeat)
+{
+    __u8 frame[sizeof(struct ethhdr) + sizeof(struct arphdr) + 20];
+    LIBBPF_OPTS(bpf_test_run_opts, opts,
+                .data_in = frame,
+                .data_size_in = sizeof(frame),
+                .repeat = repeat);
+    int err;
+
+    build_arp_reply(frame, ip);
+    err = bpf_prog_test_run_opts(
+        bpf_program__fd(skel->progs.handle_neighbor_reply_xdp), &opts);
+
+    // A full ring buffer would stop the parser before the count
+    ring_buffer__consume(rb);
+    return err;
+}
+
+/*
+ * Source i of the heavy ones sends 40 + 10 * i replies in every round, so
+ * they rank in reverse. The window is closed on a clock set by the test.
+ */
+static bool check_hitters(struct neighsnoopd_bpf *skel, struct ring_buffer *rb)
+{
+    struct hitter top[HITTERS_TOP];
+    __u64 total = 0;
+    bool passed = true;
+    bool ok;
+    int n;
+
+    now_ms_set(0);
+    if (hitters_attach(bpf_map__fd(skel->maps.hitter_sketch),
+                       bpf_map__fd(skel->maps.hitter_top))) {
+        pr_err(errno, "Failed to read the heavy hitters");
+        return false;
+    }
+
+    // The first window holds the corpus frames
+    now_ms_set(10000);
+    hitters_run();
+
+    for (int round = 0; round < HITTER_ROUNDS; round++) {
+        for (int i = 0; i < HEAVY_SOURCES; i++) {
+            if (run_source(skel, rb, 0x10000 | i, 40 + 10 * i))
+                goto err;
+            total += 40 + 10 * i;
+        }
+        for (int i = 0; i < LIGHT_SOURCES / HITTER_ROUNDS; i++) {
+            if (run_source(skel, rb, round * 1000 + i, 1))
+                goto err;
+            total++;
+        }
+    }
+
+    now_ms_set(20000);
+    hitters_run();
+
+    // The estimates overcount by at most e * total / HITTER_WIDTH
+    for (int kind = HITTER_MAC; kind <= HITTER_IP; kind++) {
+        n = hitters_top(kind, top);
+        passed &= n == HEAVY_SOURCES;
+        for (int i = 0; i < n; i++) {
+            int heavy = HEAVY_SOURCES - 1 - i;
+            __u64 count = HITTER_ROUNDS * (40 + 10 * heavy);
+            struct hitter_key key = {};
+            __be32 ip = htonl(0xc6130000 | heavy);
+            struct in6_addr *ip6 = (struct in6_addr *)&key;
+            __u8 *mac = (__u8 *)&key;
+
+            if (kind == HITTER_MAC) {
+                mac[0] = 0x02;
+                memcpy(&mac[2], &ip, sizeof(ip));
+            } else {
+                map_ipv4_to_ipv6(ip6, ip);
+            }
+            ok = !memcmp(&top[i].key, &key, sizeof(key)) &&
+                top[i].count >= count &&
+                top[i].count - count <= total * 3 / HITTER_WIDTH;
+            passed &= ok;
+            printf("hitter %-17s %6llu replies, %6llu estimated %s\n",
+                   kind == HITTER_MAC ? fmt_mac(mac) : fmt_ip(ip6), count,
+                   top[i].count, ok ? "PASS" : "FAIL");
+        }
+    }
+
+    // Every source is untagged, so VLAN 0 is the only key and exact
+    n = hitters_top(HITTER_VLAN, top);
+    ok = n == 1 && top[0].count == total;
+    passed &= ok;
+    printf("hitter %-17s %6llu replies, %6llu estimated %s\n", "untagged",
+           total, n ? top[0].count : 0, ok ? "PASS" : "FAIL");
+
+    hitters_free();
+    now_ms_reset();
+    return passed;
+err:
+    pr_err(errno, "Test run of the heavy hitters failed");
+    hitters_free();
+    now_ms_reset();
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = "tests/corpus";
+    struct neighsnoopd_bpf *skel;
+    struct records records;
+    struct ring_buffer *rb;
+    bool passed = true;
+    bool fib = false, hitters = false, rate_limit = false;
+    int repeat = 10000;
+    int batch = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:r:b:fHl")) != -1) {
+        switch (opt) {
+        case 'd':
+            dir = optarg;
+            break;
+        case 'r':
+            repeat = strtol(optarg, NULL, 0);
+            break;
+        case 'b':
+            batch = strtol(optarg, NULL, 0);
+            break;
+        case 'f':
+            fib = true;
+            break;
+        case 'H':
+            hitters = true;
+            break;
+        case 'l':
+            rate_limit = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d CORPUS_DIR] [-r REPEAT] [-b NUM] "
+                    "[-f] [-H] [-l]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (batch < 1 || batch > REPLY_BATCH_MAX) {
+        fprintf(stderr, "NUM must be between 1 and %d\n", REPLY_BATCH_MAX);
+        return EXIT_FAILURE;
+    }
+
+    // Every repeat of a matching frame leaves a record in the ring buffer
+    if (repeat <= 0 || repeat > 100000) {
+        fprintf(stderr, "REPEAT must be between 1 and 100000\n");
+        return EXIT_FAILURE;
+    }
+
+    skel = neighsnoopd_bpf__open();
+    if (!skel) {
+        pr_err(errno, "Failed to open BPF skeleton");
+        return EXIT_FAILURE;
+    }
+
+    // Set up like neighsnoopd.c does for the same options
+    skel->rodata->fib_lookup = fib;
+    skel->rodata->hitters = hitters;
+    if (rate_limit) {
+        skel->rodata->mac_interval_ns = 1;
+        skel->rodata->mac_burst_ns = 1000000000000ULL;
+        skel->rodata->vlan_interval_ns = 1;
+        skel->rodata->vlan_burst_ns = 1000000000000ULL;
+    }
+    if (batch > 1) {
+        skel->rodata->batch_replies = batch;
+        bpf_map__set_max_entries(skel->maps.reply_stages,
+                                 libbpf_num_possible_cpus());
+    } else {
+        bpf_map__set_autocreate(skel->maps.reply_stages, false);
+    }
+
+    if (neighsnoopd_bpf__load(skel)) {
+        pr_err(errno, "Failed to load BPF skeleton");
+        neighsnoopd_bpf__destroy(skel);
+        return EXIT_FAILURE;
+    }
+
+    rb = ring_buffer__new(bpf_map__fd(skel->maps.neighbor_ringbuf),
+                          handle_sample, &records, NULL);
+    if (!rb) {
+        pr_err(errno, "Failed to create ring buffer");
+        neighsnoopd_bpf__destroy(skel);
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++)
+        passed &= run_entry(skel, rb, &records, dir, &corpus[i], repeat,
+                            batch > 1);
+    if (hitters)
+        passed &= check_hitters(skel, rb);
+
+    ring_buffer__free(rb);
+    neighsnoopd_bpf__destroy(skel);
+
+    printf("%s\n", passed ? "All tests passed" : "Some tests failed");
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0-or-later
+# SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is>
+# SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com>
+#
+# Replays the testbed hosts through neighsnoopd against the netlink mock and
+# checks that exactly the hosts with local MACs on SVIs are installed. Needs
+# no privileges.
+#
+# Usage: test_mock.sh [NEIGHSNOOPD_ARGS...]
+
+set -eu
+
+TESTS_DIR=$(cd "$(dirname "$0")" && pwd)
+NEIGHSNOOPD=${NEIGHSNOOPD:-$TESTS_DIR/../neighsnoopd}
+SVIS=4
+HOSTS=64
+EXT_EVERY=4
+MACVLANS=2
+
+PCAP=$(mktemp)
+trap 'rm -f "$PCAP"' EXIT
+
+expected=$(python3 "$TESTS_DIR/testbed/inject.py" pcap --output "$PCAP" \
+    --svis $SVIS --hosts $HOSTS --ext-every $EXT_EVERY --macvlans $MACVLANS)
+
+report=$("$NEIGHSNOOPD" "$@" --replay "$PCAP" \
+    --mock svis=$SVIS,hosts=$HOSTS,ext=$EXT_EVERY,macvlans=$MACVLANS br0 |
+    grep -v "Added MAC")
+echo "$report"
+
+installed=$(echo "$report" | sed -n 's/.* events, \([0-9]*\) installed.*/\1/p')
+if [ "$installed" != "$expected" ]; then
+    echo "FAIL: installed ${installed:-none}, expected $expected" >&2
+    exit 1
+fi
+echo "PASS: installed $installed neighbors"
@@ -0,0 +1,43 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0-or-later
+# SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is>
+# SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com>
+#
+# Replays a scenario from tests/gen_scenario.py through neighsnoopd against
+# the netlink mock and checks that it installs and deletes exactly the
+# expected neighbors, in order. Needs no privileges.
+#
+# Usage: test_scenario.sh SCENARIO [NEIGHSNOOPD_ARGS...]
+
+set -eu
+
+TESTS_DIR=$(cd "$(dirname "$0")" && pwd)
+NEIGHSNOOPD=${NEIGHSNOOPD:-$TESTS_DIR/../neighsnoopd}
+SCENARIO=$1
+shift
+
+PCAP=$(mktemp)
+EVENTS=$(mktemp)
+trap 'rm -f "$PCAP" "$EVENTS"' EXIT
+
+output=$(python3 "$TESTS_DIR/gen_scenario.py" "$SCENARIO" --output "$PCAP" \
+    --events "$EVENTS")
+expected=$(echo "$output" | grep -v "^args:")
+options=$(echo "$output" | sed -n 's/^args: *//p')
+
+# shellcheck disable=SC2086 # The scenario options are split into words
+report=$("$NEIGHSNOOPD" $options "$@" --replay "$PCAP" \
+    --mock svis=1,hosts=32,ext=0,macvlans=0,events="$EVENTS" br0)
+echo "$report" | grep -v "Added MAC\|deleting neighbor"
+
+actions=$(echo "$report" | sed -n \
+    -e 's/.*Added MAC: \([^ ]*\) IP: \([^/ ]*\).*/add \2 \1/p' \
+    -e 's/.*moved to a remote VTEP, deleting neighbor \(.*\)$/del \1/p')
+if [ "$actions" != "$expected" ]; then
+    echo "FAIL: $SCENARIO added and deleted, in order:" >&2
+    echo "$actions" >&2
+    echo "expected:" >&2
+    echo "$expected" >&2
+    exit 1
+fi
+echo "PASS: $SCENARIO added and deleted $(echo "$actions" | wc -l) neighbors"
@@ -0,0 +1,249 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-or-later
+# SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is>
+# SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com>
+"""
+Host model and traffic injector for tests/testbed/testbed.sh. Every SVI VLAN
+has HOSTS hosts with an IPv4 and an IPv6 address and a MAC in the bridge FDB,
+where every EXT_EVERY-th MAC is flagged extern_learn. Every macvlan subnet
+has HOSTS untagged IPv4 hosts. Only the SVI hosts with local MACs should be
+installed by neighsnoopd.
+
+The same hosts are served by the netlink mock in nlmock.c, so a capture
+written with the pcap command can be replayed with neighsnoopd --mock.
+
+Usage: inject.py fdb OPTIONS
+       inject.py run --iface IFNAME OPTIONS
+       inject.py pcap --output FILE OPTIONS
+"""
+
+import argparse
+import os
+import select
+import socket
+import statistics
+import struct
+import sys
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                "..", "corpus"))
+from gen_corpus import (BCAST, ETH_P_8021Q, ETH_P_ARP, ETH_P_IPV6,  # noqa
+                        arp, eth, icmp6, ipv6, na, write_pcap)
+
+ALL_NODES_MAC = bytes.fromhex("333300000001")
+ALL_NODES_IP6 = socket.inet_pton(socket.AF_INET6, "ff02::1")
+
+RTM_NEWNEIGH = 28
+NDA_DST = 1
+RTMGRP_NEIGH = 0x4
+NLMSG_HDR = struct.Struct("=IHHII")
+NDMSG = struct.Struct("=BxxxiHBB")
+RTATTR = struct.Struct("=HH")
+
+
+class Host:
+    def __init__(self, vid, index, ext, macvlan=False):
+        self.vid = vid
+        self.ext = ext
+        self.macvlan = macvlan
+        self.mac = struct.pack("!BBHH", 2, 1 if macvlan else 0, vid, index)
+        if macvlan:
+            self.ip4 = bytes([172, 16, vid, index + 2])
+            self.gw4 = bytes([172, 16, vid, 1])
+            self.ip6 = None
+        else:
+            self.ip4 = bytes([10, vid >> 8, vid & 0xff, index + 2])
+            self.gw4 = bytes([10, vid >> 8, vid & 0xff, 1])
+            self.ip6 = socket.inet_pton(socket.AF_INET6,
+                                        "fd00:%x::%x" % (vid, index + 2))
+
+    @property
+    def expected(self):
+        return not self.ext and not self.macvlan
+
+    def frames(self):
+        vlans = [] if self.macvlan else [(ETH_P_8021Q, self.vid)]
+        frames = [(self.ip4, eth(BCAST, self.mac, ETH_P_ARP,
+                                 arp(2, self.mac, self.ip4, BCAST, self.gw4),
+                                 vlans))]
+        if self.ip6:
+            msg = icmp6(self.ip6, ALL_NODES_IP6, na(self.ip6, self.mac))
+            frames.append((self.ip6, eth(ALL_NODES_MAC, self.mac, ETH_P_IPV6,
+                                         ipv6(self.ip6, ALL_NODES_IP6, 58,
+                                              msg), vlans)))
+        return frames
+
+
+def hosts(args):
+    result = []
+    for svi in range(args.svis):
+        vid = args.first_vid + svi
+        for i in range(args.hosts):
+            result.append(Host(vid, i, args.ext_every and
+                               i % args.ext_every == args.ext_every - 1))
+    for mv in range(1, args.macvlans + 1):
+        for i in range(args.hosts):
+            result.append(Host(mv, i, False, macvlan=True))
+    return result
+
+
+def fmt_mac(mac):
+    return ":".join("%02x" % b for b in mac)
+
+
+def cmd_fdb(args):
+    """Prints a bridge -batch script with the FDB entries of the hosts."""
+    for host in hosts(args):
+        if host.macvlan:
+            continue
+        print("fdb add %s dev %s master %s vlan %d" % (
+            fmt_mac(host.mac), args.port,
+            "extern_learn" if host.ext else "static", host.vid))
+
+
+def cmd_pcap(args):
+    """Writes the frames of all hosts to a capture file and prints the
+    number of neighbors that should be installed from it."""
+    all_hosts = hosts(args)
+    write_pcap(args.output, [frame for host in all_hosts
+                             for _, frame in host.frames()])
+    print(sum(len(host.frames()) for host in all_hosts if host.expected))
+
+
+def nl_open():
+    sock = socket.socket(socket.AF_NETLINK, socket.SOCK_RAW,
+                         socket.NETLINK_ROUTE)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 32 * 1024 * 1024)
+    sock.bind((0, RTMGRP_NEIGH))
+    sock.setblocking(False)
+    return sock
+
+
+def nl_new_neighbors(sock):
+    """Returns the destinations of the pending RTM_NEWNEIGH notifications."""
+    dsts = []
+    while True:
+        try:
+            buf = sock.recv(65536)
+        except BlockingIOError:
+            return dsts
+        except OSError:  # ENOBUFS, the count will come up short
+            continue
+        pos = 0
+        while pos + NLMSG_HDR.size <= len(buf):
+            length, msg_type = NLMSG_HDR.unpack_from(buf, pos)[:2]
+            if length < NLMSG_HDR.size:
+                break
+            if msg_type == RTM_NEWNEIGH:
+                family = NDMSG.unpack_from(buf, pos + NLMSG_HDR.size)[0]
+                attr = pos + NLMSG_HDR.size + NDMSG.size
+                while family in (socket.AF_INET, socket.AF_INET6) and \
+                        attr + RTATTR.size <= pos + length:
+                    alen, atype = RTATTR.unpack_from(buf, attr)
+                    if alen < RTATTR.size:
+                        break
+                    if atype == NDA_DST:
+                        dsts.append(bytes(buf[attr + 4:attr + alen]))
+                        break
+                    attr += (alen + 3) & ~3
+            pos += (length + 3) & ~3
+
+
+def wait_for(sock, pending, timeout):
+    """Collects notifications until all pending destinations are seen."""
+    seen = {}
+    deadline = time.monotonic() + timeout
+    while pending.keys() - seen.keys():
+        left = deadline - time.monotonic()
+        if left <= 0 or not select.select([sock], [], [], left)[0]:
+            break
+        now = time.monotonic()
+        for dst in nl_new_neighbors(sock):
+            if dst in pending and dst not in seen:
+                seen[dst] = now
+    return seen
+
+
+def cmd_run(args):
+    pkt = socket.socket(socket.AF_PACKET, socket.SOCK_RAW)
+    pkt.bind((args.iface, 0))
+    nl = nl_open()
+    all_hosts = hosts(args)
+    latency_hosts = [h for h in all_hosts if h.expected][:args.latency]
+    bulk_hosts = [h for h in all_hosts if h not in latency_hosts]
+    failed = False
+
+    # Install latency of single replies on an idle daemon
+    latencies = []
+    for host in latency_hosts:
+        ip, frame = host.frames()[0]
+        start = time.monotonic()
+        pkt.send(frame)
+        seen = wait_for(nl, {ip: host}, 1.0)
+        if ip in seen:
+            latencies.append((seen[ip] - start) * 1e6)
+    if latency_hosts:
+        print("latency: %d/%d installed, p50 %.0f us, p99 %.0f us, "
+              "max %.0f us" % (
+                  len(latencies), len(latency_hosts),
+                  statistics.median(latencies) if latencies else 0,
+                  sorted(latencies)[int(len(latencies) * 0.99)]
+                  if latencies else 0,
+                  max(latencies) if latencies else 0))
+        failed |= len(latencies) != len(latency_hosts)
+
+    # Throughput of a burst of replies for the remaining hosts
+    frames = [(ip, frame, host) for host in bulk_hosts
+              for ip, frame in host.frames()]
+    expected = {ip: host for ip, _, host in frames if host.expected}
+    unexpected = {ip: host for ip, _, host in frames if not host.expected}
+    start = time.monotonic()
+    for _, frame, _ in frames:
+        pkt.send(frame)
+    sent = time.monotonic()
+    seen = wait_for(nl, {**expected, **unexpected}, args.timeout)
+    installed = [dst for dst in seen if dst in expected]
+    leaked = [dst for dst in seen if dst in unexpected]
+    elapsed = max(seen.values(), default=sent) - start
+
+    print("burst: sent %d frames in %.3f s (%.0f frames/s)" % (
+        len(frames), sent - start, len(frames) / max(sent - start, 1e-9)))
+    print("burst: installed %d/%d in %.3f s (%.0f installs/s), "
+          "%d filtered hosts installed" % (
+              len(installed), len(expected), elapsed,
+              len(installed) / max(elapsed, 1e-9), len(leaked)))
+    failed |= len(installed) != len(expected) or bool(leaked)
+    return 1 if failed else 0
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("command", choices=["fdb", "run", "pcap"])
+    parser.add_argument("--iface", default="inj0")
+    parser.add_argument("--port", default="port0")
+    parser.add_argument("--svis", type=int, default=4)
+    parser.add_argument("--first-vid", type=int, default=100)
+    parser.add_argument("--hosts", type=int, default=64)
+    parser.add_argument("--ext-every", type=int, default=4)
+    parser.add_argument("--macvlans", type=int, default=2)
+    parser.add_argument("--latency", type=int, default=32)
+    parser.add_argument("--timeout", type=float, default=10.0)
+    parser.add_argument("--output")
+    args = parser.parse_args()
+
+    if args.hosts > 250:
+        parser.error("--hosts must be at most 250")
+    if args.command == "fdb":
+        cmd_fdb(args)
+        return 0
+    if args.command == "pcap":
+        if not args.output:
+            parser.error("pcap needs --output")
+        cmd_pcap(args)
+        return 0
+    return cmd_run(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,138 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0-or-later
+# SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is>
+# SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com>
+#
+# End to end testbed. Builds a network namespace with a VLAN-aware bridge,
+# SVIs with IPv4 and IPv6 subnets, macvlans and a populated FDB, runs
+# neighsnoopd on the bridge and injects ARP replies and NAs over a veth port.
+# Reports the install latency and burst throughput, and fails if a host is
+# not installed or a filtered host is. Needs root, iproute2 and python3, but
+# no network.
+#
+# Usage: testbed.sh [-s SVIS] [-H HOSTS] [-e EXT_EVERY] [-m MACVLANS]
+#                   [-- NEIGHSNOOPD_ARGS...]
+
+set -eu
+
+TESTBED_DIR=$(cd "$(dirname "$0")" && pwd)
+NEIGHSNOOPD=${NEIGHSNOOPD:-$TESTBED_DIR/../../neighsnoopd}
+NS=neighsnoopd-testbed-$$
+SVIS=4
+HOSTS=64
+EXT_EVERY=4
+MACVLANS=2
+FIRST_VID=100
+
+while getopts "s:H:e:m:" opt; do
+    case $opt in
+        s) SVIS=$OPTARG ;;
+        H) HOSTS=$OPTARG ;;
+        e) EXT_EVERY=$OPTARG ;;
+        m) MACVLANS=$OPTARG ;;
+        *) sed -n 's/^# Usage: //p' "$0" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+HOST_ARGS="--svis $SVIS --hosts $HOSTS --ext-every $EXT_EVERY \
+    --macvlans $MACVLANS --first-vid $FIRST_VID"
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "The testbed must be run as root" >&2
+    exit 1
+fi
+
+if [ ! -x "$NEIGHSNOOPD" ]; then
+    echo "Build neighsnoopd first, or set NEIGHSNOOPD" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d)
+DAEMON_PID=
+
+cleanup() {
+    if [ -n "$DAEMON_PID" ]; then
+        kill -INT "$DAEMON_PID" 2>/dev/null || true
+        wait "$DAEMON_PID" 2>/dev/null || true
+    fi
+    ip netns del "$NS" 2>/dev/null || true
+    rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+nsexec() {
+    ip netns exec "$NS" "$@"
+}
+
+echo "Building topology: $SVIS SVIs, $MACVLANS macvlans, $HOSTS hosts each"
+ip netns add "$NS"
+nsexec sysctl -qw net.ipv6.conf.all.accept_dad=0
+nsexec sysctl -qw net.ipv6.conf.default.accept_dad=0
+
+{
+    echo "link set lo up"
+    echo "link add br0 type bridge vlan_filtering 1"
+    echo "link add inj0 type veth peer name port0"
+    echo "link set port0 master br0"
+    vid=$FIRST_VID
+    while [ "$vid" -lt $((FIRST_VID + SVIS)) ]; do
+        echo "link add link br0 name br0.$vid type vlan id $vid"
+        echo "address add 10.$((vid >> 8)).$((vid & 255)).1/24 dev br0.$vid"
+        printf "address add fd00:%x::1/64 dev br0.%d nodad\n" "$vid" "$vid"
+        echo "link set br0.$vid up"
+        vid=$((vid + 1))
+    done
+    i=1
+    while [ "$i" -le "$MACVLANS" ]; do
+        echo "link add link br0 name mv$i type macvlan mode bridge"
+        echo "address add 172.16.$i.1/24 dev mv$i"
+        echo "link set mv$i up"
+        i=$((i + 1))
+    done
+    echo "link set br0 up"
+    echo "link set port0 up"
+    echo "link set inj0 up"
+} > "$WORK/links.batch"
+ip -n "$NS" -batch "$WORK/links.batch"
+
+{
+    vid=$FIRST_VID
+    while [ "$vid" -lt $((FIRST_VID + SVIS)) ]; do
+        echo "vlan add dev br0 vid $vid self"
+        echo "vlan add dev port0 vid $vid"
+        vid=$((vid + 1))
+    done
+    # shellcheck disable=SC2086
+    python3 "$TESTBED_DIR/inject.py" fdb $HOST_ARGS
+} > "$WORK/fdb.batch"
+bridge -n "$NS" -batch "$WORK/fdb.batch"
+echo "FDB entries: $(grep -c '^fdb' "$WORK/fdb.batch")"
+
+nsexec "$NEIGHSNOOPD" "$@" br0 > "$WORK/neighsnoopd.log" 2>&1 &
+DAEMON_PID=$!
+
+# The daemon is ready once its program is attached to the bridge
+tries=0
+until nsexec tc filter show dev br0 ingress 2>/dev/null | grep -q bpf; do
+    tries=$((tries + 1))
+    if [ "$tries" -gt 100 ] || ! kill -0 "$DAEMON_PID" 2>/dev/null; then
+        echo "neighsnoopd did not start:" >&2
+        cat "$WORK/neighsnoopd.log" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+status=0
+# shellcheck disable=SC2086
+nsexec python3 "$TESTBED_DIR/inject.py" run --iface inj0 $HOST_ARGS ||
+    status=$?
+
+if [ "$status" -ne 0 ]; then
+    echo "Testbed FAILED, neighsnoopd output:" >&2
+    tail -n 50 "$WORK/neighsnoopd.log" >&2
+else
+    echo "Testbed passed"
+fi
+exit "$status"
@@ -0,0 +1,738 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is> */
+/* SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com> */
+/* SPDX-FileContributor: Freysteinn Alfredsson <freysteinn@freysteinn.com> */
+/* SPDX-FileContributor: Julius Thor Bess Rikardsson <juliusbess@gmail.com> */
+
+/*
+ * ARP reply and NA load generator. Frames are written to a PACKET_MMAP
+ * TX_RING and sent in batches, bypassing the qdisc, to push the TC and XDP
+ * hooks of a running neighsnoopd towards saturation. Once a second it
+ * reports the send rate together with the daemon's parsed replies and ring
+ * buffer drops, read from its neighbor_stats map, and the neighbors it
+ * installed. At the end it reports the install lag, from the last frame sent
+ * for a host until the first notification that its neighbor is reachable.
+ * Later notifications of the host, such as the daemon's refreshes, are not
+ * counted.
+ *
+ * Hosts use the address layout of tests/testbed: host k on VLAN vid has
+ * 10.<vid / 256>.<vid % 256>.<k + 2> and fd00:<vid>::<k + 2>, so every VLAN
+ * holds up to 253 hosts.
+ *
+ * Usage: loadgen -i IFNAME [-r PPS] [-n FRAMES] [-t SECONDS] [-H HOSTS]
+ *                [-V FIRST_VID[-LAST_VID]] [-6 NA_PERCENT] [-D DUP_PERCENT]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/rtnetlink.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <libmnl/libmnl.h>
+
+#include "neighsnoopd.h"
+#include "neighsnoopd_shared.h"
+
+#define FRAME_SIZE 2048
+#define FRAME_NR 4096
+#define BLOCK_SIZE (1 << 16)
+#define TX_BATCH 64
+#define HOSTS_PER_VLAN 253
+#define MIN_FRAME_LEN 60
+
+struct env env = {0};
+
+static volatile sig_atomic_t exiting;
+
+static struct {
+    const char *ifname;
+    __u64 pps;
+    __u64 frames;
+    __u64 seconds;
+    __u32 hosts;
+    __u16 first_vid;
+    __u16 n_vlans;
+    bool tagged;
+    int na_percent;
+    int dup_percent;
+} cfg = {
+    .hosts = 1024,
+    .na_percent = 50,
+    .n_vlans = 1,
+};
+
+struct tx_ring {
+    int fd;
+    __u8 *map;
+    size_t map_size;
+    __u32 head;
+};
+
+struct host_stats {
+    __u64 *last_sent_ns; // Send time of the last frame for each host
+    bool *installed;     // Whether each host has been seen reachable
+    __u64 *lags_ns;
+    __u64 n_lags;
+    __u64 installs;
+};
+
+static __u64 now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sig_handler(int sig)
+{
+    exiting = true;
+}
+
+static void host_addr(__u32 host, __u16 *vid, __u8 *mac, __u8 *ip4,
+                      struct in6_addr *ip6)
+{
+    __u32 k = host / cfg.n_vlans;
+
+    *vid = cfg.tagged ? cfg.first_vid + host % cfg.n_vlans : 0;
+
+    mac[0] = 0x02;
+    mac[1] = 0x4c;
+    mac[2] = host >> 24;
+    mac[3] = host >> 16;
+    mac[4] = host >> 8;
+    mac[5] = host;
+
+    ip4[0] = 10;
+    ip4[1] = *vid >> 8;
+    ip4[2] = *vid & 0xff;
+    ip4[3] = k + 2;
+
+    memset(ip6, 0, sizeof(*ip6));
+    ip6->s6_addr[0] = 0xfd;
+    ip6->s6_addr[2] = *vid >> 8;
+    ip6->s6_addr[3] = *vid & 0xff;
+    ip6->s6_addr[15] = k + 2;
+}
+
+// Maps an installed neighbor back to its host, or returns -1
+static long host_from_addr(int family, const __u8 *addr)
+{
+    __u16 vid;
+    __u32 k;
+
+    if (family == AF_INET && addr[0] == 10) {
+        vid = addr[1] << 8 | addr[2];
+        k = addr[3];
+    } else if (family == AF_INET6 && addr[0] == 0xfd) {
+        vid = addr[2] << 8 | addr[3];
+        k = addr[15];
+    } else {
+        return -1;
+    }
+
+    if (k < 2)
+        return -1;
+    k -= 2;
+
+    if (cfg.tagged) {
+        if (vid < cfg.first_vid || vid >= cfg.first_vid + cfg.n_vlans)
+            return -1;
+        vid -= cfg.first_vid;
+    } else if (vid != 0) {
+        return -1;
+    }
+
+    if (k * cfg.n_vlans + vid >= cfg.hosts)
+        return -1;
+    return k * cfg.n_vlans + vid;
+}
+
+static __u16 csum_fold(__u32 sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+static __u32 csum_add(__u32 sum, const __u8 *data, size_t len)
+{
+    for (size_t i = 0; i + 1 < len; i += 2)
+        sum += data[i] << 8 | data[i + 1];
+    if (len & 1)
+        sum += data[len - 1] << 8;
+    return sum;
+}
+
+static size_t put_eth(__u8 *buf, const __u8 *dst, const __u8 *src, __u16 vid,
+                      __u16 proto)
+{
+    size_t len = 0;
+
+    memcpy(buf, dst, ETH_ALEN);
+    memcpy(buf + ETH_ALEN, src, ETH_ALEN);
+    len = 2 * ETH_ALEN;
+
+    if (vid) {
+        buf[len++] = ETH_P_8021Q >> 8;
+        buf[len++] = ETH_P_8021Q & 0xff;
+        buf[len++] = vid >> 8;
+        buf[len++] = vid & 0xff;
+    }
+
+    buf[len++] = proto >> 8;
+    buf[len++] = proto & 0xff;
+    return len;
+}
+
+static size_t build_arp_reply(__u8 *buf, __u32 host)
+{
+    static const __u8 bcast[ETH_ALEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    static const __u8 arp_hdr[8] = { 0, 1, 8, 0, ETH_ALEN, 4, 0, 2 };
+    struct in6_addr ip6;
+    __u8 mac[ETH_ALEN];
+    __u8 ip4[4], gw4[4];
+    size_t len;
+    __u16 vid;
+
+    host_addr(host, &vid, mac, ip4, &ip6);
+    memcpy(gw4, ip4, sizeof(gw4));
+    gw4[3] = 1;
+
+    len = put_eth(buf, bcast, mac, vid, ETH_P_ARP);
+    memcpy(buf + len, arp_hdr, sizeof(arp_hdr));
+    len += sizeof(arp_hdr);
+    memcpy(buf + len, mac, ETH_ALEN);
+    memcpy(buf + len + 6, ip4, 4);
+    memcpy(buf + len + 10, bcast, ETH_ALEN);
+    memcpy(buf + len + 16, gw4, 4);
+    return len + 20;
+}
+
+static size_t build_na(__u8 *buf, __u32 host)
+{
+    static const __u8 all_nodes_mac[ETH_ALEN] = { 0x33, 0x33, 0, 0, 0, 1 };
+    struct in6_addr all_nodes = { .s6_addr = { 0xff, 0x02, [15] = 1 } };
+    struct in6_addr ip6;
+    __u8 mac[ETH_ALEN];
+    __u8 ip4[4];
+    __u8 *ip6h, *icmp;
+    size_t len;
+    __u32 sum;
+    __u16 vid, csum;
+
+    host_addr(host, &vid, mac, ip4, &ip6);
+    len = put_eth(buf, all_nodes_mac, mac, vid, ETH_P_IPV6);
+
+    // IPv6 header with a 32 byte NA: header, target and the TLLA option
+    ip6h = buf + len;
+    memset(ip6h, 0, 40);
+    ip6h[0] = 0x60;
+    ip6h[5] = 32;
+    ip6h[6] = IPPROTO_ICMPV6;
+    ip6h[7] = 255;
+    memcpy(ip6h + 8, &ip6, sizeof(ip6));
+    memcpy(ip6h + 24, &all_nodes, sizeof(all_nodes));
+
+    icmp = ip6h + 40;
+    memset(icmp, 0, 32);
+    icmp[0] = 136;  // Neighbor Advertisement
+    icmp[4] = 0x20; // Override
+    memcpy(icmp + 8, &ip6, sizeof(ip6));
+    icmp[24] = 2;   // Target link-layer address
+    icmp[25] = 1;
+    memcpy(icmp + 26, mac, ETH_ALEN);
+
+    // Pseudo header checksum
+    sum = csum_add(0, ip6h + 8, 32);
+    sum += 32 + IPPROTO_ICMPV6;
+    sum = csum_add(sum, icmp, 32);
+    csum = csum_fold(sum);
+    icmp[2] = csum >> 8;
+    icmp[3] = csum & 0xff;
+
+    return len + 40 + 32;
+}
+
+static int tx_ring_open(struct tx_ring *ring, const char *ifname)
+{
+    struct tpacket_req req = {
+        .tp_block_size = BLOCK_SIZE,
+        .tp_block_nr = FRAME_NR * FRAME_SIZE / BLOCK_SIZE,
+        .tp_frame_size = FRAME_SIZE,
+        .tp_frame_nr = FRAME_NR,
+    };
+    struct sockaddr_ll addr = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(ETH_P_ALL),
+    };
+    int version = TPACKET_V2;
+    int one = 1;
+
+    addr.sll_ifindex = if_nametoindex(ifname);
+    if (!addr.sll_ifindex) {
+        pr_err(errno, "Invalid network device %s", ifname);
+        return -1;
+    }
+
+    ring->fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (ring->fd < 0) {
+        pr_err(errno, "socket AF_PACKET");
+        return -1;
+    }
+
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version,
+                   sizeof(version)) < 0) {
+        pr_err(errno, "setsockopt PACKET_VERSION");
+        goto err;
+    }
+
+    // Frames go straight to the driver, as they would from a NIC
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one,
+                   sizeof(one)) < 0)
+        pr_info("PACKET_QDISC_BYPASS is not supported, using the qdisc\n");
+
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_TX_RING, &req,
+                   sizeof(req)) < 0) {
+        pr_err(errno, "setsockopt PACKET_TX_RING");
+        goto err;
+    }
+
+    ring->map_size = (size_t)req.tp_block_size * req.tp_block_nr;
+    ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     ring->fd, 0);
+    if (ring->map == MAP_FAILED) {
+        pr_err(errno, "mmap TX_RING");
+        goto err;
+    }
+
+    if (bind(ring->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        pr_err(errno, "bind %s", ifname);
+        munmap(ring->map, ring->map_size);
+        goto err;
+    }
+
+    ring->head = 0;
+    return 0;
+err:
+    close(ring->fd);
+    return -1;
+}
+
+static void tx_ring_close(struct tx_ring *ring)
+{
+    munmap(ring->map, ring->map_size);
+    close(ring->fd);
+}
+
+// Returns the next free frame in the ring, flushing it when it is full
+static struct tpacket2_hdr *tx_ring_next(struct tx_ring *ring)
+{
+    struct tpacket2_hdr *hdr;
+
+    hdr = (struct tpacket2_hdr *)(ring->map + ring->head * FRAME_SIZE);
+    while (hdr->tp_status != TP_STATUS_AVAILABLE) {
+        struct pollfd pfd = { .fd = ring->fd, .events = POLLOUT };
+
+        if (send(ring->fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN &&
+            errno != ENOBUFS)
+            return NULL;
+        poll(&pfd, 1, 10);
+        if (exiting)
+            return NULL;
+    }
+
+    ring->head = (ring->head + 1) % FRAME_NR;
+    return hdr;
+}
+
+static int tx_ring_flush(struct tx_ring *ring)
+{
+    if (send(ring->fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN &&
+        errno != ENOBUFS) {
+        pr_err(errno, "send TX_RING");
+        return -1;
+    }
+    return 0;
+}
+
+// Finds the stats map of a running daemon by name, returns -1 if none runs
+static int find_stats_map(void)
+{
+    __u32 id = 0;
+
+    while (!bpf_map_get_next_id(id, &id)) {
+        struct bpf_map_info info = {};
+        __u32 len = sizeof(info);
+        int fd = bpf_map_get_fd_by_id(id);
+
+        if (fd < 0)
+            continue;
+
+        if (!bpf_obj_get_info_by_fd(fd, &info, &len) &&
+            strcmp(info.name, "neighbor_stats") == 0)
+            return fd;
+        close(fd);
+    }
+    return -1;
+}
+
+static int read_stats(int map_fd, int n_cpus, struct neighbor_stats *total)
+{
+    struct neighbor_stats values[n_cpus];
+    __u32 key = 0;
+
+    memset(total, 0, sizeof(*total));
+    if (map_fd < 0 || bpf_map_lookup_elem(map_fd, &key, values))
+        return -1;
+
+    for (int i = 0; i < n_cpus; i++) {
+        total->replies += values[i].replies;
+        total->ringbuf_drops += values[i].ringbuf_drops;
+    }
+    return 0;
+}
+
+static struct mnl_socket *nl_open_monitor(void)
+{
+    unsigned int group = RTNLGRP_NEIGH;
+    int size = NL_RCVBUF_MONITOR;
+    struct mnl_socket *nl;
+    int fd;
+
+    nl = mnl_socket_open(NETLINK_ROUTE);
+    if (!nl) {
+        pr_err(errno, "mnl_socket_open");
+        return NULL;
+    }
+
+    fd = mnl_socket_get_fd(nl);
+    if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0 ||
+        mnl_socket_setsockopt(nl, NETLINK_ADD_MEMBERSHIP, &group,
+                              sizeof(group)) < 0) {
+        pr_err(errno, "Failed to join the neighbor group");
+        mnl_socket_close(nl);
+        return NULL;
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return nl;
+}
+
+static int neigh_attr_cb(const struct nlattr *attr, void *data)
+{
+    const struct nlattr **tb = data;
+
+    if (mnl_attr_type_valid(attr, NDA_MAX) < 0)
+        return MNL_CB_OK;
+    tb[mnl_attr_get_type(attr)] = attr;
+    return MNL_CB_OK;
+}
+
+static int neigh_cb(const struct nlmsghdr *nlh, void *data)
+{
+    struct host_stats *hosts = data;
+    struct nlattr *tb[NDA_MAX + 1] = {};
+    struct ndmsg *ndm = mnl_nlmsg_get_payload(nlh);
+    __u64 sent;
+    long host;
+
+    if (nlh->nlmsg_type != RTM_NEWNEIGH ||
+        mnl_nlmsg_get_payload_len(nlh) < sizeof(*ndm) ||
+        !(ndm->ndm_state & NUD_REACHABLE))
+        return MNL_CB_OK;
+
+    mnl_attr_parse(nlh, sizeof(*ndm), neigh_attr_cb, tb);
+    if (!tb[NDA_DST] || mnl_attr_get_payload_len(tb[NDA_DST]) !=
+        (ndm->ndm_family == AF_INET ? 4 : 16))
+        return MNL_CB_OK;
+
+    host = host_from_addr(ndm->ndm_family, mnl_attr_get_payload(tb[NDA_DST]));
+    if (host < 0 || hosts->installed[host])
+        return MNL_CB_OK;
+
+    hosts->installed[host] = true;
+    hosts->installs++;
+    sent = hosts->last_sent_ns[host];
+    if (sent)
+        hosts->lags_ns[hosts->n_lags++] = now_ns() - sent;
+    return MNL_CB_OK;
+}
+
+static void nl_drain(struct mnl_socket *nl, struct host_stats *hosts)
+{
+    char buf[NL_RECV_BUFFER_SIZE];
+    int ret;
+
+    for (;;) {
+        ret = mnl_socket_recvfrom(nl, buf, sizeof(buf));
+        if (ret < 0) {
+            if (errno == ENOBUFS) {
+                pr_info("Netlink monitor overrun, install counts are low\n");
+                continue;
+            }
+            return;
+        }
+        mnl_cb_run(buf, ret, 0, 0, neigh_cb, hosts);
+    }
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    __u64 x = *(const __u64 *)a;
+    __u64 y = *(const __u64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void report_lag(struct host_stats *hosts)
+{
+    __u64 n = hosts->n_lags;
+
+    if (!n) {
+        printf("install lag: no installs seen\n");
+        return;
+    }
+
+    qsort(hosts->lags_ns, n, sizeof(*hosts->lags_ns), cmp_u64);
+    printf("install lag: %llu samples, p50 %.1f us, p99 %.1f us, "
+           "max %.1f us\n", n,
+           hosts->lags_ns[n / 2] / 1e3,
+           hosts->lags_ns[n * 99 / 100] / 1e3,
+           hosts->lags_ns[n - 1] / 1e3);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s -i IFNAME [-r PPS] [-n FRAMES] [-t SECONDS] "
+            "[-H HOSTS]\n"
+            "       [-V FIRST_VID[-LAST_VID]] [-6 NA_PERCENT] "
+            "[-D DUP_PERCENT]\n", prog);
+}
+
+static int parse_vlans(const char *arg)
+{
+    char *end;
+    long first = strtol(arg, &end, 0);
+    long last = first;
+
+    if (*end == '-')
+        last = strtol(end + 1, &end, 0);
+
+    if (*end || first < 1 || last < first || last >= VLAN_ID_MAX)
+        return -1;
+
+    cfg.tagged = true;
+    cfg.first_vid = first;
+    cfg.n_vlans = last - first + 1;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct neighbor_stats stats, start_stats, prev_stats;
+    struct host_stats hosts = {0};
+    struct mnl_socket *nl = NULL;
+    struct tx_ring ring;
+    __u64 start, next_report, deadline = 0;
+    __u64 sent = 0, prev_sent = 0, prev_installs = 0;
+    __u32 host = 0;
+    int n_cpus = libbpf_num_possible_cpus();
+    int stats_fd = -1;
+    int err = EXIT_FAILURE;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:r:n:t:H:V:6:D:")) != -1) {
+        switch (opt) {
+        case 'i':
+            cfg.ifname = optarg;
+            break;
+        case 'r':
+            cfg.pps = strtoull(optarg, NULL, 0);
+            break;
+        case 'n':
+            cfg.frames = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            cfg.seconds = strtoull(optarg, NULL, 0);
+            break;
+        case 'H':
+            cfg.hosts = strtoul(optarg, NULL, 0);
+            break;
+        case 'V':
+            if (parse_vlans(optarg)) {
+                fprintf(stderr, "Invalid VLAN range %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case '6':
+            cfg.na_percent = atoi(optarg);
+            break;
+        case 'D':
+            cfg.dup_percent = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!cfg.ifname || n_cpus <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (cfg.hosts == 0 || cfg.hosts > HOSTS_PER_VLAN * cfg.n_vlans) {
+        fprintf(stderr, "HOSTS must be between 1 and %d with %d VLANs\n",
+                HOSTS_PER_VLAN * cfg.n_vlans, cfg.n_vlans);
+        return EXIT_FAILURE;
+    }
+
+    if (cfg.na_percent < 0 || cfg.na_percent > 100 ||
+        cfg.dup_percent < 0 || cfg.dup_percent > 100) {
+        fprintf(stderr, "Percentages must be between 0 and 100\n");
+        return EXIT_FAILURE;
+    }
+
+    hosts.last_sent_ns = calloc(cfg.hosts, sizeof(*hosts.last_sent_ns));
+    hosts.installed = calloc(cfg.hosts, sizeof(*hosts.installed));
+    hosts.lags_ns = calloc(cfg.hosts, sizeof(*hosts.lags_ns));
+    if (!hosts.last_sent_ns || !hosts.installed || !hosts.lags_ns) {
+        pr_err(errno, "Failed to allocate host state");
+        goto cleanup1;
+    }
+
+    stats_fd = find_stats_map();
+    if (stats_fd < 0)
+        pr_info("neighsnoopd is not running, daemon stats are unavailable\n");
+
+    nl = nl_open_monitor();
+    if (!nl)
+        goto cleanup2;
+
+    if (tx_ring_open(&ring, cfg.ifname))
+        goto cleanup3;
+
+    signal(SIGINT, sig_handler);
+    srand(time(NULL));
+
+    read_stats(stats_fd, n_cpus, &start_stats);
+    prev_stats = start_stats;
+    start = now_ns();
+    next_report = start + 1000000000ULL;
+    if (cfg.seconds)
+        deadline = start + cfg.seconds * 1000000000ULL;
+
+    while (!exiting && (!cfg.frames || sent < cfg.frames)) {
+        __u64 now;
+
+        for (int i = 0; i < TX_BATCH; i++) {
+            struct tpacket2_hdr *hdr = tx_ring_next(&ring);
+            __u8 *data;
+            size_t len;
+
+            if (!hdr)
+                break;
+
+            data = (__u8 *)hdr + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+            if (rand() % 100 < cfg.na_percent)
+                len = build_na(data, host);
+            else
+                len = build_arp_reply(data, host);
+
+            if (len < MIN_FRAME_LEN) {
+                memset(data + len, 0, MIN_FRAME_LEN - len);
+                len = MIN_FRAME_LEN;
+            }
+
+            hdr->tp_len = len;
+            hdr->tp_status = TP_STATUS_SEND_REQUEST;
+            hosts.last_sent_ns[host] = now_ns();
+            sent++;
+
+            // Duplicates repeat the host instead of moving on to the next
+            if (rand() % 100 >= cfg.dup_percent)
+                host = (host + 1) % cfg.hosts;
+        }
+
+        if (tx_ring_flush(&ring))
+            break;
+
+        nl_drain(nl, &hosts);
+
+        // Pace the batches to the requested rate
+        now = now_ns();
+        if (cfg.pps) {
+            __u64 due = start + sent * 1000000000ULL / cfg.pps;
+
+            if (due > now) {
+                struct timespec ts = {
+                    .tv_sec = due / 1000000000ULL,
+                    .tv_nsec = due % 1000000000ULL,
+                };
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+                now = now_ns();
+            }
+        }
+
+        if (now >= next_report) {
+            read_stats(stats_fd, n_cpus, &stats);
+            printf("sent %8llu pps  replies %8llu/s  ringbuf drops %8llu/s  "
+                   "installs %8llu/s\n", sent - prev_sent,
+                   stats.replies - prev_stats.replies,
+                   stats.ringbuf_drops - prev_stats.ringbuf_drops,
+                   hosts.installs - prev_installs);
+            fflush(stdout);
+            prev_stats = stats;
+            prev_sent = sent;
+            prev_installs = hosts.installs;
+            next_report += 1000000000ULL;
+        }
+
+        if (deadline && now >= deadline)
+            break;
+    }
+
+    // Give the daemon a moment to catch up before the final report
+    usleep(500000);
+    nl_drain(nl, &hosts);
+    read_stats(stats_fd, n_cpus, &stats);
+
+    printf("total: sent %llu frames in %.3f s, %llu installs",
+           sent, (now_ns() - start) / 1e9, hosts.installs);
+    if (stats_fd >= 0)
+        printf(", daemon stats: %llu replies, %llu ringbuf drops",
+               stats.replies - start_stats.replies,
+               stats.ringbuf_drops - start_stats.ringbuf_drops);
+    printf("\n");
+    report_lag(&hosts);
+    err = EXIT_SUCCESS;
+
+    tx_ring_close(&ring);
+cleanup3:
+    mnl_socket_close(nl);
+cleanup2:
+    if (stats_fd >= 0)
+        close(stats_fd);
+cleanup1:
+    free(hosts.last_sent_ns);
+    free(hosts.installed);
+    free(hosts.lags_ns);
+    return err;
+}
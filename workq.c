@@ -0,0 +1,236 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: 2024 - 1984 Hosting Company <1984@1984.is> */
+/* SPDX-FileCopyrightText: 2024 - Freyx Solutions <frey@freyx.com> */
+/* SPDX-FileContributor: Freysteinn Alfredsson <freysteinn@freysteinn.com> */
+/* SPDX-FileContributor: Julius Thor Bess Rikardsson <juliusbess@gmail.com> */
+
+/*
+ * Bounded work queue between the ring buffer consumer and the lookup and
+ * install stages. Replies are classified against the neighbor table when
+ * they are queued:
+ *
+ * - change:  the neighbor is known with another MAC address
+ * - new:     the neighbor has not been seen before
+ * - refresh: the neighbor is known with the same MAC address
+ *
+ * Each class has its own FIFO and the classes are served in that order, so
+ * that a backlog of refreshes never delays a new binding. A reply for a
+ * neighbor whose newest queued reply has the same MAC is coalesced into it.
+ * Since the classes are not served in arrival order, every queued reply
+ * carries the generation of its neighbor at the time it was queued, and a
+ * reply older than the newest queued reply of its neighbor is skipped as
+ * superseded. Refreshes are shed once the queue is three quarters
+ * full, and when it is full, new bindings and changes evict the oldest
+ * refresh, or are dropped themselves when there is none. Refreshes of
+ * installed neighbors are not queued at all, since refresh.c keeps those
+ * reachable for as long as they are seen.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "neighsnoopd.h"
+#include "neighsnoopd_shared.h"
+
+extern struct env env;
+
+struct workq_item {
+    struct neighbor_reply reply;
+    __u32 gen; // Generation of the neighbor when queued
+};
+
+struct workq_ring {
+    struct workq_item *items;
+    __u32 head;
+    __u32 len;
+};
+
+struct workq_stats {
+    __u64 queued;
+    __u64 processed;
+    __u64 coalesced;  // Merged into queued work or a scheduled refresh
+    __u64 superseded; // Skipped for a newer reply of the same neighbor
+    __u64 dropped;    // Shed under pressure or lost to a full queue
+};
+
+static const char *class_names[WORKQ_CLASS_MAX] = {
+    [WORKQ_CHANGE] = "change",
+    [WORKQ_NEW] = "new",
+    [WORKQ_REFRESH] = "refresh",
+};
+
+static struct workq_ring rings[WORKQ_CLASS_MAX];
+static struct workq_stats stats[WORKQ_CLASS_MAX];
+static workq_handler_t workq_handler;
+static __u32 workq_size;
+static __u32 workq_len;
+
+int workq_init(__u32 size, workq_handler_t handler)
+{
+    for (int i = 0; i < WORKQ_CLASS_MAX; i++) {
+        rings[i].items = calloc(size, sizeof(*rings[i].items));
+        if (!rings[i].items) {
+            workq_free();
+            return -1;
+        }
+    }
+    workq_size = size;
+    workq_handler = handler;
+    return 0;
+}
+
+void workq_free(void)
+{
+    for (int i = 0; i < WORKQ_CLASS_MAX; i++)
+        free(rings[i].items);
+    memset(rings, 0, sizeof(rings));
+    workq_size = workq_len = 0;
+    neigh_table_free();
+}
+
+__u32 workq_depth(void)
+{
+    return workq_len;
+}
+
+__u32 workq_capacity(void)
+{
+    return workq_size;
+}
+
+static void ring_push(struct workq_ring *ring, const struct workq_item *item)
+{
+    ring->items[(ring->head + ring->len) % workq_size] = *item;
+    ring->len++;
+    workq_len++;
+}
+
+static void ring_pop(struct workq_ring *ring, struct workq_item *item)
+{
+    *item = ring->items[ring->head];
+    ring->head = (ring->head + 1) % workq_size;
+    ring->len--;
+    workq_len--;
+}
+
+// A reply leaves the queue without being processed
+static void workq_forget(const struct neighbor_reply *reply)
+{
+    struct neigh_entry *neigh = neigh_table_get(&reply->ip, reply->vlan_id,
+                                                false);
+    if (neigh && neigh->pending)
+        neigh->pending--;
+}
+
+static enum workq_class workq_classify(const struct neigh_entry *neigh,
+                                       const struct neighbor_reply *reply)
+{
+    if (!neigh || !neigh->known)
+        return WORKQ_NEW;
+    if (memcmp(neigh->mac, reply->mac, sizeof(neigh->mac)))
+        return WORKQ_CHANGE;
+    return WORKQ_REFRESH;
+}
+
+/*
+ * Queue a reply for processing. Returns 0 if the reply was queued or
+ * coalesced, or -1 with errno set to ENOBUFS if it was dropped.
+ */
+int workq_push(const struct neighbor_reply *reply)
+{
+    struct workq_item item = { .reply = *reply };
+    struct neigh_entry *neigh;
+    enum workq_class class;
+
+    // Untracked neighbors are treated as new and never coalesced
+    neigh = neigh_table_get(&reply->ip, reply->vlan_id, true);
+    class = workq_classify(neigh, reply);
+    // Only a reply with the installed MAC address shows that it still holds
+    if (class == WORKQ_REFRESH)
+        neigh->seen = refresh_clock();
+
+    if (neigh && neigh->pending &&
+        !memcmp(neigh->pending_mac, reply->mac, sizeof(reply->mac))) {
+        stats[class].coalesced++;
+        return 0;
+    }
+
+    if (class == WORKQ_REFRESH && neigh->installed && !neigh->pending) {
+        stats[class].coalesced++;
+        return 0;
+    }
+
+    if (class == WORKQ_REFRESH && workq_len >= workq_size / 4 * 3) {
+        stats[class].dropped++;
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if (workq_len == workq_size) {
+        struct workq_item evicted;
+
+        if (!rings[WORKQ_REFRESH].len) {
+            stats[class].dropped++;
+            errno = ENOBUFS;
+            return -1;
+        }
+        ring_pop(&rings[WORKQ_REFRESH], &evicted);
+        workq_forget(&evicted.reply);
+        stats[WORKQ_REFRESH].dropped++;
+    }
+
+    if (neigh) {
+        neigh->pending++;
+        item.gen = ++neigh->gen;
+        memcpy(neigh->pending_mac, reply->mac, sizeof(reply->mac));
+    }
+    ring_push(&rings[class], &item);
+    stats[class].queued++;
+    return 0;
+}
+
+/*
+ * Process up to budget queued replies, highest priority class first.
+ * Returns the number of replies taken off the queue.
+ */
+int workq_run(int budget)
+{
+    struct workq_item item;
+    struct neigh_entry *neigh;
+    int done = 0;
+
+    while (done < budget && workq_len) {
+        enum workq_class class = 0;
+
+        while (!rings[class].len)
+            class++;
+        ring_pop(&rings[class], &item);
+        done++;
+
+        neigh = neigh_table_get(&item.reply.ip, item.reply.vlan_id, false);
+        if (neigh && neigh->pending) {
+            neigh->pending--;
+            if (item.gen != neigh->gen) {
+                stats[class].superseded++;
+                continue;
+            }
+        }
+
+        // The handler records the MAC address once it is installed
+        stats[class].processed++;
+        workq_handler(&item.reply);
+    }
+    return done;
+}
+
+void workq_print_stats(void)
+{
+    pr_info("Work queue: %u of %u queued, %u neighbors tracked\n", workq_len,
+            workq_size, neigh_table_count());
+    for (int i = 0; i < WORKQ_CLASS_MAX; i++)
+        pr_info("Class %-7s %10llu queued %10llu processed %10llu coalesced "
+                "%10llu superseded %10llu dropped\n", class_names[i],
+                stats[i].queued, stats[i].processed, stats[i].coalesced,
+                stats[i].superseded, stats[i].dropped);
+}